@@ -0,0 +1,495 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Scaling benchmark on generated graphs.
+ *
+ * Every graph is generated once, then for each thread count a fresh pool
+ * loads it back from a temporary file, builds it again from the edge list
+ * and runs every engine a few times. Load, build and traversal times are
+ * reported separately, with the traversal speedup and parallel efficiency
+ * relative to the first thread count, as CSV or JSON.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "os_bfs.h"
+#include "os_cc.h"
+#include "os_gen.h"
+#include "os_graph.h"
+#include "os_pagerank.h"
+#include "os_sssp.h"
+#include "os_threadpool.h"
+#include "os_time.h"
+#include "log/log.h"
+#include "utils.h"
+
+#define DEFAULT_GRAPH	"rmat:16"
+#define DEFAULT_RUNS	5
+#define MAX_THREADS	1024
+
+typedef enum bench_engine_t {
+	ENGINE_BFS,
+	ENGINE_CC,
+	ENGINE_SSSP,
+	ENGINE_PAGERANK,
+	NUM_ENGINES
+} bench_engine_t;
+
+static const char * const engine_names[NUM_ENGINES] = {
+	[ENGINE_BFS] = "bfs",
+	[ENGINE_CC] = "cc",
+	[ENGINE_SSSP] = "sssp",
+	[ENGINE_PAGERANK] = "pagerank",
+};
+
+typedef enum bench_load_t {
+	LOAD_NONE,
+	LOAD_TEXT,
+	LOAD_BINARY
+} bench_load_t;
+
+typedef struct bench_row {
+	const char *graph;
+	unsigned int num_nodes;
+	unsigned int num_edges;
+	bench_engine_t engine;
+	unsigned int threads;
+	/* Milliseconds, load is negative when skipped. */
+	double load, build, traverse;
+	double speedup, efficiency;
+	/* Sum of the engine, components or PageRank iterations, per thread count. */
+	long long result;
+} bench_row_t;
+
+static bench_row_t *rows;
+static size_t num_rows, rows_capacity;
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-g graph]... [-t threads] [-e engines] [-n runs]\n"
+		"       [-l format] [-f format] [-o output] [-w max_weight] [-S seed]\n", name);
+	fprintf(stderr, "  -g  graph to generate, can be repeated (default %s):\n"
+		"        rmat:SCALE[:EDGE_FACTOR]  2^SCALE nodes, EDGE_FACTOR (16) edges per node\n"
+		"        er:NODES:EDGES            uniformly random edges\n"
+		"        grid:WIDTH:HEIGHT         2D grid\n"
+		"        path:NODES, star:NODES\n", DEFAULT_GRAPH);
+	fprintf(stderr, "  -t  comma separated thread counts (default 1, 2, 4, ... online CPUs)\n");
+	fprintf(stderr, "  -e  comma separated engines: bfs, cc, sssp, pagerank (default bfs)\n");
+	fprintf(stderr, "  -n  timed runs of each engine, the median is reported (default %d)\n",
+		DEFAULT_RUNS);
+	fprintf(stderr, "  -l  file format the load is timed from: text (default), binary or none\n");
+	fprintf(stderr, "  -f  report format: csv (default) or json\n");
+	fprintf(stderr, "  -o  write the report to output instead of stdout\n");
+	fprintf(stderr, "  -w  give edges random weights from 1 to max_weight\n");
+	fprintf(stderr, "  -S  generator seed\n");
+	fprintf(stderr, "Build with CFLAGS=-O2 for meaningful numbers.\n");
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Parse a comma separated list of positive numbers into values, at most
+ * max of them. Return how many there are, 0 if the list is malformed.
+ */
+static unsigned int parse_list(const char *list, unsigned int *values, unsigned int max)
+{
+	const char *p = list;
+	unsigned int n = 0;
+	char *end;
+
+	while (n < max) {
+		errno = 0;
+		values[n] = strtoul(p, &end, 10);
+		if (end == p || errno != 0 || values[n] == 0 || (*end != ',' && *end != '\0'))
+			return 0;
+		n++;
+		if (*end == '\0')
+			return n;
+		p = end + 1;
+	}
+
+	return 0;
+}
+
+static int parse_engines(const char *list, int *enabled)
+{
+	char *copy = strdup(list), *save = NULL;
+	int rc = 0;
+
+	DIE(copy == NULL, "strdup");
+	memset(enabled, 0, NUM_ENGINES * sizeof(*enabled));
+
+	for (char *name = strtok_r(copy, ",", &save); name != NULL;
+			name = strtok_r(NULL, ",", &save)) {
+		int e;
+
+		for (e = 0; e < NUM_ENGINES; e++)
+			if (strcmp(name, engine_names[e]) == 0)
+				break;
+		if (e == NUM_ENGINES) {
+			log_error("Unknown engine \"%s\"", name);
+			rc = -1;
+			break;
+		}
+		enabled[e] = 1;
+	}
+
+	free(copy);
+	return rc;
+}
+
+/* Root of traversals: the node of highest degree, which has to be in the big component. */
+static unsigned int pick_root(os_graph_t *graph)
+{
+	unsigned int root = 0;
+
+	for (unsigned int v = 1; v < graph->num_nodes; v++)
+		if (os_graph_degree(graph, v) > os_graph_degree(graph, root))
+			root = v;
+
+	return root;
+}
+
+/* Run engine once on graph, return its result. */
+static long long run_engine(bench_engine_t engine, os_graph_t *graph, unsigned int root,
+		os_threadpool_t *tp)
+{
+	os_pagerank_params_t pr = {
+		.damping = OS_PAGERANK_DAMPING,
+		.tolerance = OS_PAGERANK_TOLERANCE,
+		.max_iterations = OS_PAGERANK_MAX_ITERATIONS,
+	};
+	os_bfs_result_t bfs;
+	os_cc_result_t cc;
+	os_sssp_result_t sssp;
+	os_pagerank_result_t rank;
+	long long result = 0;
+
+	switch (engine) {
+	case ENGINE_BFS:
+		os_bfs(graph, &root, 1, tp, &bfs);
+		result = bfs.sum;
+		os_bfs_result_destroy(&bfs);
+		break;
+	case ENGINE_CC:
+		os_cc(graph, tp, &cc);
+		result = cc.num_components;
+		os_cc_result_destroy(&cc);
+		break;
+	case ENGINE_SSSP:
+		os_sssp(graph, &root, 1, 0, tp, &sssp);
+		result = sssp.sum;
+		os_sssp_result_destroy(&sssp);
+		break;
+	case ENGINE_PAGERANK:
+		os_pagerank(graph, &pr, tp, &rank);
+		result = rank.iterations;
+		os_pagerank_result_destroy(&rank);
+		break;
+	default:
+		break;
+	}
+
+	return result;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static bench_row_t *add_row(void)
+{
+	if (num_rows == rows_capacity) {
+		rows_capacity = rows_capacity ? 2 * rows_capacity : 64;
+		rows = realloc(rows, rows_capacity * sizeof(*rows));
+		DIE(rows == NULL, "realloc");
+	}
+
+	memset(&rows[num_rows], 0, sizeof(rows[num_rows]));
+	return &rows[num_rows++];
+}
+
+/* Write gen to a temporary file in the given format, for timing loads. */
+static FILE *write_input(const os_gen_graph_t *gen, bench_load_t format)
+{
+	FILE *file;
+	os_graph_t *graph;
+
+	if (format == LOAD_NONE)
+		return NULL;
+
+	file = tmpfile();
+	DIE(file == NULL, "tmpfile");
+
+	if (format == LOAD_TEXT) {
+		DIE(os_gen_write_text(gen, file) < 0, "os_gen_write_text");
+	} else {
+		graph = create_graph_from_data(gen->num_nodes, gen->num_edges, gen->values,
+				gen->edges, gen->weighted);
+		DIE(graph == NULL, "create_graph_from_data");
+		DIE(write_graph_binary(graph, file) < 0, "write_graph_binary");
+		DIE(fflush(file) != 0, "fflush");
+		destroy_graph(graph);
+	}
+
+	return file;
+}
+
+static void bench_graph(const os_gen_spec_t *spec, const unsigned int *threads,
+		unsigned int num_threads, const int *enabled, unsigned int runs,
+		bench_load_t format)
+{
+	os_threadpool_t *tp;
+	os_gen_graph_t gen;
+	os_graph_t *graph;
+	FILE *file;
+	double start, *times;
+	size_t first_row = num_rows;
+	unsigned int max_threads = 0;
+
+	for (unsigned int i = 0; i < num_threads; i++)
+		if (threads[i] > max_threads)
+			max_threads = threads[i];
+
+	start = os_time_seconds();
+	tp = create_threadpool_mode(max_threads, OS_TP_WORK_STEALING);
+	os_gen_generate(spec, tp, &gen);
+	destroy_threadpool(tp);
+	log_info("Generated %s: %u nodes, %u edges in %.3f ms", spec->name, gen.num_nodes,
+		gen.num_edges, (os_time_seconds() - start) * 1e3);
+
+	file = write_input(&gen, format);
+
+	times = malloc(runs * sizeof(*times));
+	DIE(times == NULL, "malloc");
+
+	for (unsigned int t = 0; t < num_threads; t++) {
+		double load = -1, build;
+		unsigned int root;
+
+		tp = create_threadpool_mode(threads[t], OS_TP_WORK_STEALING);
+
+		if (file != NULL) {
+			DIE(fseek(file, 0, SEEK_SET) != 0, "fseek");
+			start = os_time_seconds();
+			graph = create_graph_from_file_parallel(file, tp);
+			load = (os_time_seconds() - start) * 1e3;
+			DIE(graph == NULL, "create_graph_from_file_parallel");
+			destroy_graph(graph);
+		}
+
+		start = os_time_seconds();
+		graph = create_graph_from_data_parallel(gen.num_nodes, gen.num_edges, gen.values,
+				gen.edges, gen.weighted, tp);
+		build = (os_time_seconds() - start) * 1e3;
+		DIE(graph == NULL, "create_graph_from_data_parallel");
+
+		root = pick_root(graph);
+
+		for (int e = 0; e < NUM_ENGINES; e++) {
+			bench_row_t *row;
+			long long result = 0;
+
+			if (!enabled[e])
+				continue;
+
+			for (unsigned int r = 0; r < runs; r++) {
+				start = os_time_seconds();
+				result = run_engine(e, graph, root, tp);
+				times[r] = (os_time_seconds() - start) * 1e3;
+			}
+			qsort(times, runs, sizeof(*times), &compare_doubles);
+
+			row = add_row();
+			row->graph = spec->name;
+			row->num_nodes = gen.num_nodes;
+			row->num_edges = gen.num_edges;
+			row->engine = e;
+			row->threads = threads[t];
+			row->load = load;
+			row->build = build;
+			row->traverse = times[runs / 2];
+			row->result = result;
+		}
+
+		destroy_graph(graph);
+		destroy_threadpool(tp);
+	}
+
+	// Speedups are against the first thread count of the same engine
+	for (size_t i = first_row; i < num_rows; i++) {
+		bench_row_t *base = &rows[first_row];
+
+		while (base->engine != rows[i].engine)
+			base++;
+
+		rows[i].speedup = rows[i].traverse > 0 ? base->traverse / rows[i].traverse : 0;
+		rows[i].efficiency = rows[i].speedup * base->threads / rows[i].threads;
+		if (rows[i].result != base->result)
+			log_error("%s %s: result %lld with %u threads, %lld with %u", rows[i].graph,
+				engine_names[rows[i].engine], rows[i].result, rows[i].threads,
+				base->result, base->threads);
+	}
+
+	free(times);
+	if (file != NULL)
+		fclose(file);
+	os_gen_destroy(&gen);
+}
+
+/* Millions of input edges traversed per second. */
+static double row_mteps(const bench_row_t *row)
+{
+	return row->traverse > 0 ? row->num_edges / row->traverse / 1e3 : 0;
+}
+
+static void write_csv(FILE *file)
+{
+	fprintf(file, "graph,nodes,edges,engine,threads,load_ms,build_ms,traverse_ms,"
+		"speedup,efficiency,mteps,result\n");
+
+	for (size_t i = 0; i < num_rows; i++) {
+		const bench_row_t *r = &rows[i];
+
+		fprintf(file, "%s,%u,%u,%s,%u,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%lld\n",
+			r->graph, r->num_nodes, r->num_edges, engine_names[r->engine],
+			r->threads, r->load, r->build, r->traverse, r->speedup,
+			r->efficiency, row_mteps(r), r->result);
+	}
+}
+
+static void write_json(FILE *file)
+{
+	fprintf(file, "[\n");
+
+	for (size_t i = 0; i < num_rows; i++) {
+		const bench_row_t *r = &rows[i];
+
+		fprintf(file, "  {\"graph\": \"%s\", \"nodes\": %u, \"edges\": %u, "
+			"\"engine\": \"%s\", \"threads\": %u, ",
+			r->graph, r->num_nodes, r->num_edges, engine_names[r->engine], r->threads);
+		if (r->load >= 0)
+			fprintf(file, "\"load_ms\": %.3f, ", r->load);
+		else
+			fprintf(file, "\"load_ms\": null, ");
+		fprintf(file, "\"build_ms\": %.3f, \"traverse_ms\": %.3f, \"speedup\": %.3f, "
+			"\"efficiency\": %.3f, \"mteps\": %.3f, \"result\": %lld}%s\n",
+			r->build, r->traverse, r->speedup, r->efficiency, row_mteps(r),
+			r->result, i + 1 < num_rows ? "," : "");
+	}
+
+	fprintf(file, "]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	os_gen_spec_t *specs = NULL;
+	unsigned int num_specs = 0;
+	unsigned int threads[MAX_THREADS];
+	unsigned int num_threads = 0;
+	int enabled[NUM_ENGINES] = { [ENGINE_BFS] = 1 };
+	unsigned int runs = DEFAULT_RUNS;
+	unsigned int max_weight = 0;
+	unsigned long long seed = 0;
+	int have_seed = 0, json = 0;
+	bench_load_t format = LOAD_TEXT;
+	const char *output = NULL;
+	FILE *file = stdout;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "e:f:g:l:n:o:S:t:w:")) != -1) {
+		switch (opt) {
+		case 'g':
+			specs = realloc(specs, (num_specs + 1) * sizeof(*specs));
+			DIE(specs == NULL, "realloc");
+			if (os_gen_parse(optarg, &specs[num_specs++]) < 0)
+				usage(argv[0]);
+			break;
+		case 't':
+			num_threads = parse_list(optarg, threads, MAX_THREADS);
+			if (num_threads == 0)
+				usage(argv[0]);
+			break;
+		case 'e':
+			if (parse_engines(optarg, enabled) < 0)
+				usage(argv[0]);
+			break;
+		case 'n':
+			runs = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			if (strcmp(optarg, "text") == 0)
+				format = LOAD_TEXT;
+			else if (strcmp(optarg, "binary") == 0)
+				format = LOAD_BINARY;
+			else if (strcmp(optarg, "none") == 0)
+				format = LOAD_NONE;
+			else
+				usage(argv[0]);
+			break;
+		case 'f':
+			if (strcmp(optarg, "json") != 0 && strcmp(optarg, "csv") != 0)
+				usage(argv[0]);
+			json = strcmp(optarg, "json") == 0;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'w':
+			max_weight = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			seed = strtoull(optarg, NULL, 0);
+			have_seed = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc || runs == 0)
+		usage(argv[0]);
+
+	if (num_specs == 0) {
+		specs = malloc(sizeof(*specs));
+		DIE(specs == NULL, "malloc");
+		DIE(os_gen_parse(DEFAULT_GRAPH, &specs[num_specs++]) < 0, "os_gen_parse");
+	}
+
+	if (num_threads == 0) {
+		unsigned int cpus = get_num_online_cpus();
+
+		for (unsigned int t = 1; t < cpus && num_threads < MAX_THREADS - 1; t *= 2)
+			threads[num_threads++] = t;
+		threads[num_threads++] = cpus;
+	}
+
+	for (unsigned int i = 0; i < num_specs; i++) {
+		specs[i].max_weight = max_weight;
+		if (have_seed)
+			specs[i].seed = seed;
+		bench_graph(&specs[i], threads, num_threads, enabled, runs, format);
+	}
+
+	if (output != NULL) {
+		file = fopen(output, "w");
+		DIE(file == NULL, "fopen");
+	}
+	if (json)
+		write_json(file);
+	else
+		write_csv(file);
+	if (output != NULL)
+		DIE(fclose(file) != 0, "fclose");
+
+	free(rows);
+	free(specs);
+
+	return 0;
+}
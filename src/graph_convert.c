@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Convert a graph to the binary format understood by create_graph_from_file(),
+ * or check that a binary graph is intact.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "os_graph.h"
+#include "log/log.h"
+#include "utils.h"
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s input_file output_file\n", name);
+	fprintf(stderr, "       %s -c binary_file\n", name);
+	exit(EXIT_FAILURE);
+}
+
+/* Validate the checksum and the contents of a binary graph. */
+static int check_binary(const char *path)
+{
+	FILE *file;
+	os_input_t in;
+	os_graph_t *graph;
+
+	file = fopen(path, "r");
+	DIE(file == NULL, "fopen");
+
+	DIE(os_input_open(file, &in) < 0, "os_input_open");
+	fclose(file);
+
+	if (!is_graph_binary(in.data, in.size)) {
+		log_error("%s is not a binary graph", path);
+		os_input_close(&in);
+		return -1;
+	}
+
+	graph = create_graph_from_binary(&in, 1);
+	os_input_close(&in);
+	if (graph == NULL)
+		return -1;
+
+	printf("%s: %u nodes, %u edges, ok\n", path, graph->num_nodes, graph->num_edges);
+	destroy_graph(graph);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *input_file, *output_file;
+	os_graph_t *graph;
+	int rc;
+
+	if (argc == 3 && strcmp(argv[1], "-c") == 0)
+		return check_binary(argv[2]) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+	if (argc != 3)
+		usage(argv[0]);
+
+	input_file = fopen(argv[1], "r");
+	DIE(input_file == NULL, "fopen");
+
+	graph = create_graph_from_file(input_file);
+	DIE(graph == NULL, "create_graph_from_file");
+	fclose(input_file);
+
+	output_file = fopen(argv[2], "w");
+	DIE(output_file == NULL, "fopen");
+
+	rc = write_graph_binary(graph, output_file);
+	DIE(fclose(output_file) != 0, "fclose");
+
+	destroy_graph(graph);
+
+	return rc < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
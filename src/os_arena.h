@@ -0,0 +1,115 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+/*
+ * Bump allocator for data that is freed all at once. Small allocations are
+ * carved out of shared blocks, large ones get a block of their own. Nothing
+ * is freed before os_arena_destroy(). Not thread safe.
+ */
+
+#ifndef __OS_ARENA_H__
+#define __OS_ARENA_H__	1
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+#define OS_ARENA_BLOCK_SIZE	(64 * 1024)
+/* Allocations start on a cache line. */
+#define OS_ARENA_ALIGN		64
+
+typedef struct os_arena_block_t {
+	struct os_arena_block_t *next;
+	char *data;
+	size_t used;
+	size_t size;
+} os_arena_block_t;
+
+typedef struct os_arena_t {
+	/* The first block is the one small allocations are carved from. */
+	os_arena_block_t *blocks;
+} os_arena_t;
+
+static inline void os_arena_init(os_arena_t *a)
+{
+	a->blocks = NULL;
+}
+
+static inline void os_arena_destroy(os_arena_t *a)
+{
+	os_arena_block_t *b = a->blocks;
+
+	while (b != NULL) {
+		os_arena_block_t *next = b->next;
+
+		free(b);
+		b = next;
+	}
+	a->blocks = NULL;
+}
+
+static inline os_arena_block_t *os_arena_block_new(size_t size, int zero)
+{
+	size_t total = sizeof(os_arena_block_t) + OS_ARENA_ALIGN + size;
+	os_arena_block_t *b;
+
+	DIE(total < size, "os_arena_block_new");
+	b = zero ? calloc(1, total) : malloc(total);
+	DIE(b == NULL, "malloc");
+
+	b->data = (char *)(((uintptr_t)(b + 1) + OS_ARENA_ALIGN - 1) &
+			~(uintptr_t)(OS_ARENA_ALIGN - 1));
+	b->used = 0;
+	b->size = size;
+
+	return b;
+}
+
+static inline void *os_arena_alloc_zero(os_arena_t *a, size_t size, int zero)
+{
+	os_arena_block_t *b = a->blocks;
+	void *p;
+
+	size = (size + OS_ARENA_ALIGN - 1) & ~(size_t)(OS_ARENA_ALIGN - 1);
+
+	if (size > OS_ARENA_BLOCK_SIZE / 4) {
+		// Keep the current block for the small allocations after this one
+		b = os_arena_block_new(size, zero);
+		if (a->blocks != NULL) {
+			b->next = a->blocks->next;
+			a->blocks->next = b;
+		} else {
+			b->next = NULL;
+			a->blocks = b;
+		}
+		b->used = size;
+		return b->data;
+	}
+
+	if (b == NULL || b->size - b->used < size) {
+		b = os_arena_block_new(OS_ARENA_BLOCK_SIZE, 0);
+		b->next = a->blocks;
+		a->blocks = b;
+	}
+
+	p = b->data + b->used;
+	b->used += size;
+	if (zero)
+		memset(p, 0, size);
+
+	return p;
+}
+
+static inline void *os_arena_alloc(os_arena_t *a, size_t size)
+{
+	return os_arena_alloc_zero(a, size, 0);
+}
+
+static inline void *os_arena_calloc(os_arena_t *a, size_t n, size_t size)
+{
+	DIE(size != 0 && n > SIZE_MAX / size, "os_arena_calloc");
+	return os_arena_alloc_zero(a, n * size, 1);
+}
+
+#endif
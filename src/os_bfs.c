@@ -0,0 +1,436 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Level-synchronous BFS over the threadpool.
+ *
+ * One long running task per worker expands the frontier level by level,
+ * with a barrier between levels. Small frontiers are expanded top-down from
+ * a queue: every frontier node claims its unvisited neighbours with a CAS on
+ * parent. Once the frontier touches a large share of the remaining edges,
+ * levels are expanded bottom-up from a bitmap instead: every unvisited node
+ * looks for any parent in the frontier and stops at the first one, which
+ * skips most of the edges a top-down step would have rejected.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "os_bfs.h"
+#include "os_threadpool.h"
+#include "log/log.h"
+#include "utils.h"
+
+/* Switch to bottom-up once the frontier has more than 1/ALPHA of the edges left. */
+#define BFS_ALPHA		14
+/* Switch back to top-down once the frontier is under 1/BETA of the nodes. */
+#define BFS_BETA		24
+
+/* Frontier entries grabbed at a time by a top-down worker. */
+#define TD_CHUNK		64
+/* Bitmap words grabbed at a time by a bottom-up worker. */
+#define BU_CHUNK		16
+/* Discovered nodes buffered by a worker before they're appended to the queue. */
+#define LOCAL_QUEUE		256
+
+#define WORD_BITS		64
+
+enum { TOP_DOWN, BOTTOM_UP };
+
+typedef struct bfs_ctx {
+	os_graph_t *graph;
+	unsigned int num_threads;
+	pthread_barrier_t barrier;
+	os_threadpool_t *tp;
+
+	_Atomic unsigned int *parent;
+	unsigned int *level;
+
+	/* Frontier is queue[qcur] when top-down, bits[bcur] when bottom-up. */
+	unsigned int *queue[2];
+	unsigned int qcur;
+	unsigned int frontier_size;
+	_Atomic unsigned long *bits[2];
+	unsigned int bcur;
+	size_t num_words;
+
+	int dir;
+	int convert;
+	int done;
+	unsigned int depth;
+	unsigned long long edges_to_check;
+	unsigned int prev_awake;
+
+	/* Reduced during a step, reset by the serial section. */
+	_Atomic unsigned int tail;
+	_Atomic unsigned int awake;
+	_Atomic unsigned long long scout;
+	_Atomic size_t next_chunk;
+
+	unsigned int top_down_steps;
+	unsigned int bottom_up_steps;
+} bfs_ctx_t;
+
+typedef struct bfs_thread {
+	bfs_ctx_t *ctx;
+	unsigned int tid;
+	unsigned int buf[LOCAL_QUEUE];
+	unsigned int count;
+	unsigned int awake;
+	unsigned long long scout;
+} bfs_thread_t;
+
+static void flush_local(bfs_thread_t *th, unsigned int *queue)
+{
+	unsigned int pos;
+
+	if (th->count == 0)
+		return;
+
+	pos = atomic_fetch_add_explicit(&th->ctx->tail, th->count, memory_order_relaxed);
+	for (unsigned int i = 0; i < th->count; i++)
+		queue[pos + i] = th->buf[i];
+	th->count = 0;
+}
+
+static void push_local(bfs_thread_t *th, unsigned int *queue, unsigned int v)
+{
+	if (th->count == LOCAL_QUEUE)
+		flush_local(th, queue);
+	th->buf[th->count++] = v;
+}
+
+static void discovered(bfs_thread_t *th, unsigned int v)
+{
+	os_graph_t *graph = th->ctx->graph;
+
+	th->ctx->level[v] = th->ctx->depth + 1;
+	th->awake++;
+	th->scout += os_graph_degree(graph, v);
+}
+
+static void top_down_step(bfs_thread_t *th)
+{
+	bfs_ctx_t *ctx = th->ctx;
+	os_graph_t *graph = ctx->graph;
+	unsigned int *frontier = ctx->queue[ctx->qcur];
+	unsigned int *next = ctx->queue[ctx->qcur ^ 1];
+	size_t first;
+
+	while ((first = atomic_fetch_add_explicit(&ctx->next_chunk, TD_CHUNK,
+					memory_order_relaxed)) < ctx->frontier_size) {
+		size_t last = first + TD_CHUNK < ctx->frontier_size ?
+			first + TD_CHUNK : ctx->frontier_size;
+
+		for (size_t k = first; k < last; k++) {
+			unsigned int u = frontier[k];
+			unsigned int *neighbours = os_graph_neighbours(graph, u);
+			unsigned int degree = os_graph_degree(graph, u);
+
+			for (unsigned int i = 0; i < degree; i++) {
+				unsigned int v = neighbours[i], none = OS_BFS_NONE;
+
+				if (atomic_load_explicit(&ctx->parent[v], memory_order_relaxed) != OS_BFS_NONE)
+					continue;
+				if (!atomic_compare_exchange_strong_explicit(&ctx->parent[v], &none, u,
+							memory_order_relaxed, memory_order_relaxed))
+					continue;
+				discovered(th, v);
+				push_local(th, next, v);
+			}
+		}
+	}
+
+	flush_local(th, next);
+}
+
+static int test_bit(_Atomic unsigned long *bits, unsigned int v)
+{
+	return (atomic_load_explicit(&bits[v / WORD_BITS], memory_order_relaxed) >>
+			(v % WORD_BITS)) & 1;
+}
+
+/* Every word of the output bitmap is written by exactly one worker. */
+static void bottom_up_step(bfs_thread_t *th)
+{
+	bfs_ctx_t *ctx = th->ctx;
+	os_graph_t *graph = ctx->graph;
+	_Atomic unsigned long *frontier = ctx->bits[ctx->bcur];
+	_Atomic unsigned long *next = ctx->bits[ctx->bcur ^ 1];
+	size_t first;
+
+	while ((first = atomic_fetch_add_explicit(&ctx->next_chunk, BU_CHUNK,
+					memory_order_relaxed)) < ctx->num_words) {
+		size_t last = first + BU_CHUNK < ctx->num_words ? first + BU_CHUNK : ctx->num_words;
+
+		for (size_t w = first; w < last; w++) {
+			unsigned long word = 0;
+
+			for (unsigned int b = 0; b < WORD_BITS; b++) {
+				unsigned int v = w * WORD_BITS + b;
+				unsigned int *neighbours;
+				unsigned int degree;
+
+				if (v >= graph->num_nodes)
+					break;
+				if (atomic_load_explicit(&ctx->parent[v], memory_order_relaxed) != OS_BFS_NONE)
+					continue;
+
+				neighbours = os_graph_neighbours(graph, v);
+				degree = os_graph_degree(graph, v);
+				for (unsigned int i = 0; i < degree; i++) {
+					if (!test_bit(frontier, neighbours[i]))
+						continue;
+					atomic_store_explicit(&ctx->parent[v], neighbours[i],
+							memory_order_relaxed);
+					discovered(th, v);
+					word |= 1UL << b;
+					break;
+				}
+			}
+
+			atomic_store_explicit(&next[w], word, memory_order_relaxed);
+		}
+	}
+}
+
+/* Run by a single worker between two barriers. */
+static void decide_next_step(bfs_ctx_t *ctx)
+{
+	unsigned int awake = atomic_load(&ctx->awake);
+	unsigned long long scout = atomic_load(&ctx->scout);
+	int next_dir;
+
+	ctx->edges_to_check -= scout < ctx->edges_to_check ? scout : ctx->edges_to_check;
+
+	if (ctx->dir == TOP_DOWN) {
+		ctx->top_down_steps++;
+		ctx->frontier_size = atomic_load(&ctx->tail);
+		ctx->qcur ^= 1;
+		next_dir = scout > ctx->edges_to_check / BFS_ALPHA ? BOTTOM_UP : TOP_DOWN;
+	} else {
+		ctx->bottom_up_steps++;
+		ctx->bcur ^= 1;
+		next_dir = awake < ctx->graph->num_nodes / BFS_BETA && awake < ctx->prev_awake ?
+			TOP_DOWN : BOTTOM_UP;
+	}
+
+	ctx->done = (awake == 0);
+	ctx->convert = (next_dir != ctx->dir);
+	ctx->dir = next_dir;
+	ctx->prev_awake = awake;
+	ctx->depth++;
+
+	atomic_store(&ctx->tail, 0);
+	atomic_store(&ctx->awake, 0);
+	atomic_store(&ctx->scout, 0);
+	atomic_store(&ctx->next_chunk, 0);
+}
+
+static void set_queue_size(bfs_ctx_t *ctx)
+{
+	ctx->frontier_size = atomic_load(&ctx->tail);
+	atomic_store(&ctx->tail, 0);
+}
+
+/* Wait for all workers, then let one of them run fn before any continues. */
+static void serial_section(bfs_ctx_t *ctx, void (*fn)(bfs_ctx_t *ctx))
+{
+	if (pthread_barrier_wait(&ctx->barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+		fn(ctx);
+	pthread_barrier_wait(&ctx->barrier);
+}
+
+static void static_range(size_t n, unsigned int tid, unsigned int num_threads,
+		size_t *first, size_t *last)
+{
+	*first = n * tid / num_threads;
+	*last = n * (tid + 1) / num_threads;
+}
+
+static void queue_to_bits(bfs_thread_t *th)
+{
+	bfs_ctx_t *ctx = th->ctx;
+	_Atomic unsigned long *bits = ctx->bits[ctx->bcur];
+	unsigned int *queue = ctx->queue[ctx->qcur];
+	size_t first, last;
+
+	static_range(ctx->num_words, th->tid, ctx->num_threads, &first, &last);
+	for (size_t w = first; w < last; w++)
+		atomic_store_explicit(&bits[w], 0, memory_order_relaxed);
+	pthread_barrier_wait(&ctx->barrier);
+
+	static_range(ctx->frontier_size, th->tid, ctx->num_threads, &first, &last);
+	for (size_t k = first; k < last; k++)
+		atomic_fetch_or_explicit(&bits[queue[k] / WORD_BITS], 1UL << (queue[k] % WORD_BITS),
+				memory_order_relaxed);
+	pthread_barrier_wait(&ctx->barrier);
+}
+
+static void bits_to_queue(bfs_thread_t *th)
+{
+	bfs_ctx_t *ctx = th->ctx;
+	_Atomic unsigned long *bits = ctx->bits[ctx->bcur];
+	unsigned int *queue = ctx->queue[ctx->qcur];
+	size_t first, last;
+
+	static_range(ctx->num_words, th->tid, ctx->num_threads, &first, &last);
+	for (size_t w = first; w < last; w++) {
+		unsigned long word = atomic_load_explicit(&bits[w], memory_order_relaxed);
+
+		while (word != 0) {
+			push_local(th, queue, w * WORD_BITS + __builtin_ctzl(word));
+			word &= word - 1;
+		}
+	}
+	flush_local(th, queue);
+
+	serial_section(ctx, &set_queue_size);
+}
+
+static void bfs_worker(void *arg)
+{
+	bfs_thread_t *th = arg;
+	bfs_ctx_t *ctx = th->ctx;
+
+	while (1) {
+		th->awake = 0;
+		th->scout = 0;
+
+		if (ctx->dir == TOP_DOWN)
+			top_down_step(th);
+		else
+			bottom_up_step(th);
+
+		atomic_fetch_add_explicit(&ctx->awake, th->awake, memory_order_relaxed);
+		atomic_fetch_add_explicit(&ctx->scout, th->scout, memory_order_relaxed);
+		serial_section(ctx, &decide_next_step);
+
+		if (ctx->done)
+			break;
+
+		if (ctx->convert) {
+			if (ctx->dir == BOTTOM_UP)
+				queue_to_bits(th);
+			else
+				bits_to_queue(th);
+		}
+	}
+}
+
+/*
+ * Start the per-worker tasks from inside the pool. Each of them blocks on
+ * the level barriers, so every worker ends up running exactly one.
+ */
+static void spawn_workers(void *arg)
+{
+	bfs_thread_t *threads = arg;
+	bfs_ctx_t *ctx = threads[0].ctx;
+
+	for (unsigned int i = 1; i < ctx->num_threads; i++)
+		enqueue_task(ctx->tp, create_task(&bfs_worker, &threads[i], NULL));
+	bfs_worker(&threads[0]);
+}
+
+void os_bfs(os_graph_t *graph, const unsigned int *roots, unsigned int num_roots,
+		os_threadpool_t *tp, os_bfs_result_t *result)
+{
+	unsigned int num_threads = tp->num_threads;
+	bfs_ctx_t ctx = {
+		.graph = graph,
+		.num_threads = num_threads,
+		.num_words = graph->num_nodes / WORD_BITS + 1,
+		.dir = TOP_DOWN,
+		.edges_to_check = 2ULL * graph->num_edges,
+	};
+	bfs_thread_t *threads;
+
+	ctx.parent = malloc(graph->num_nodes * sizeof(*ctx.parent));
+	ctx.level = malloc(graph->num_nodes * sizeof(*ctx.level));
+	DIE((ctx.parent == NULL || ctx.level == NULL) && graph->num_nodes != 0, "malloc");
+
+	for (unsigned int i = 0; i < 2; i++) {
+		ctx.queue[i] = malloc((graph->num_nodes + 1) * sizeof(*ctx.queue[i]));
+		DIE(ctx.queue[i] == NULL, "malloc");
+		ctx.bits[i] = calloc(ctx.num_words, sizeof(*ctx.bits[i]));
+		DIE(ctx.bits[i] == NULL, "calloc");
+	}
+
+	for (unsigned int i = 0; i < graph->num_nodes; i++) {
+		atomic_init(&ctx.parent[i], OS_BFS_NONE);
+		ctx.level[i] = OS_BFS_NONE;
+	}
+
+	threads = calloc(num_threads, sizeof(*threads));
+	DIE(threads == NULL, "calloc");
+	for (unsigned int i = 0; i < num_threads; i++) {
+		threads[i].ctx = &ctx;
+		threads[i].tid = i;
+	}
+
+	// All the roots make up level 0, repeated ones are only counted once
+	for (unsigned int i = 0; i < num_roots; i++) {
+		unsigned int root = roots[i];
+
+		if (ctx.level[root] == 0)
+			continue;
+		ctx.parent[root] = root;
+		ctx.level[root] = 0;
+		ctx.queue[0][ctx.frontier_size++] = root;
+		ctx.edges_to_check -= os_graph_degree(graph, root);
+	}
+
+	pthread_barrier_init(&ctx.barrier, NULL, num_threads);
+	ctx.tp = tp;
+	threadpool_run(tp, create_task(&spawn_workers, threads, NULL));
+	pthread_barrier_destroy(&ctx.barrier);
+
+	result->num_levels = ctx.depth;
+	result->level = ctx.level;
+	result->parent = (unsigned int *)ctx.parent;
+	result->top_down_steps = ctx.top_down_steps;
+	result->bottom_up_steps = ctx.bottom_up_steps;
+
+	// Values are summed in a sequential sweep once done rather than as
+	// nodes are discovered, which saves a random access per node
+	result->num_reached = 0;
+	for (unsigned int i = 0; i < graph->num_nodes; i++)
+		result->num_reached += (ctx.level[i] != OS_BFS_NONE);
+
+	if (result->num_reached == graph->num_nodes) {
+		result->sum = os_graph_info_sum(graph, 0, graph->num_nodes);
+	} else {
+		result->sum = 0;
+		for (unsigned int i = 0; i < graph->num_nodes; i++)
+			result->sum += ctx.level[i] != OS_BFS_NONE ? os_graph_info(graph, i) : 0;
+	}
+
+	free(threads);
+	for (unsigned int i = 0; i < 2; i++) {
+		free(ctx.queue[i]);
+		free(ctx.bits[i]);
+	}
+}
+
+void os_bfs_result_destroy(os_bfs_result_t *result)
+{
+	free(result->level);
+	free(result->parent);
+}
+
+/* One "node level parent" line per reached node, in input ids. */
+int os_bfs_write_result(const os_bfs_result_t *result, const os_graph_t *graph, FILE *file)
+{
+	for (unsigned int i = 0; i < graph->num_nodes; i++) {
+		unsigned int v = os_graph_node_of(graph, i);
+
+		if (result->level[v] == OS_BFS_NONE)
+			continue;
+		if (fprintf(file, "%u %u %u\n", i, result->level[v],
+				os_graph_input_id(graph, result->parent[v])) < 0)
+			return -1;
+	}
+
+	return 0;
+}
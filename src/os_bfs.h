@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __OS_BFS_H__
+#define __OS_BFS_H__	1
+
+#include "os_graph.h"
+#include "os_threadpool.h"
+
+/* Level and parent of nodes that were not reached. */
+#define OS_BFS_NONE	((unsigned int)-1)
+
+typedef struct os_bfs_result_t {
+	long long sum;
+	unsigned int num_reached;
+	unsigned int num_levels;
+
+	/* Per node, OS_BFS_NONE if not reached. The root is its own parent. */
+	unsigned int *level;
+	unsigned int *parent;
+
+	/* Levels expanded top-down and bottom-up. */
+	unsigned int top_down_steps;
+	unsigned int bottom_up_steps;
+} os_bfs_result_t;
+
+/*
+ * Level-synchronous, direction-optimizing BFS (Beamer et al., SC 2012) from
+ * all of roots at once, run by one task per worker of tp, which must be
+ * idle. Every root is its own parent at level 0. It doesn't use
+ * graph->visited.
+ */
+void os_bfs(os_graph_t *graph, const unsigned int *roots, unsigned int num_roots,
+		os_threadpool_t *tp, os_bfs_result_t *result);
+void os_bfs_result_destroy(os_bfs_result_t *result);
+int os_bfs_write_result(const os_bfs_result_t *result, const os_graph_t *graph, FILE *file);
+
+#endif
@@ -0,0 +1,217 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Afforest connected components.
+ *
+ * Roots are always linked under the smaller id, so the root of a set is the
+ * smallest node of the set and component ids come out the same as with a
+ * serial traversal in node order. Parents only ever decrease and stay in
+ * the same set, which makes path halving with plain CAS safe.
+ *
+ * 1. Link every node with its first few neighbours, which already merges
+ *    most of the giant component if there is one.
+ * 2. Guess the largest component from a sample of nodes.
+ * 3. Link the remaining edges, skipping nodes already in that component.
+ *    Edges from it to other components are still seen from their other end.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "os_cc.h"
+#include "os_threadpool.h"
+#include "log/log.h"
+#include "utils.h"
+
+/* Neighbours linked per node before sampling. */
+#define NEIGHBOUR_ROUNDS	2
+#define NUM_SAMPLES		1024
+#define RANGES_PER_THREAD	8
+
+typedef struct cc_ctx {
+	os_graph_t *graph;
+	_Atomic unsigned int *parent;
+	unsigned int round;
+	unsigned int skip;
+	_Atomic long long *sum;
+} cc_ctx_t;
+
+typedef struct cc_range {
+	cc_ctx_t *ctx;
+	unsigned int first, last;
+} cc_range_t;
+
+static unsigned int cc_find(_Atomic unsigned int *parent, unsigned int x)
+{
+	while (1) {
+		unsigned int p = atomic_load_explicit(&parent[x], memory_order_relaxed);
+		unsigned int gp;
+
+		if (p == x)
+			return x;
+
+		// Path halving: point x at its grandparent
+		gp = atomic_load_explicit(&parent[p], memory_order_relaxed);
+		if (gp != p)
+			atomic_compare_exchange_weak_explicit(&parent[x], &p, gp,
+					memory_order_relaxed, memory_order_relaxed);
+		x = gp;
+	}
+}
+
+static void cc_union(_Atomic unsigned int *parent, unsigned int u, unsigned int v)
+{
+	while (1) {
+		unsigned int expected;
+
+		u = cc_find(parent, u);
+		v = cc_find(parent, v);
+		if (u == v)
+			return;
+
+		if (u < v) {
+			unsigned int tmp = u;
+
+			u = v;
+			v = tmp;
+		}
+
+		// Link the larger root under the smaller one
+		expected = u;
+		if (atomic_compare_exchange_strong_explicit(&parent[u], &expected, v,
+					memory_order_relaxed, memory_order_relaxed))
+			return;
+	}
+}
+
+static void link_round(void *arg)
+{
+	cc_range_t *range = arg;
+	cc_ctx_t *ctx = range->ctx;
+	os_graph_t *graph = ctx->graph;
+
+	for (unsigned int u = range->first; u < range->last; u++)
+		if (ctx->round < os_graph_degree(graph, u))
+			cc_union(ctx->parent, u, os_graph_neighbours(graph, u)[ctx->round]);
+}
+
+static void link_remaining(void *arg)
+{
+	cc_range_t *range = arg;
+	cc_ctx_t *ctx = range->ctx;
+	os_graph_t *graph = ctx->graph;
+
+	for (unsigned int u = range->first; u < range->last; u++) {
+		unsigned int *neighbours = os_graph_neighbours(graph, u);
+		unsigned int degree = os_graph_degree(graph, u);
+
+		if (cc_find(ctx->parent, u) == ctx->skip)
+			continue;
+
+		for (unsigned int i = NEIGHBOUR_ROUNDS; i < degree; i++)
+			cc_union(ctx->parent, u, neighbours[i]);
+	}
+}
+
+static void compress(void *arg)
+{
+	cc_range_t *range = arg;
+	_Atomic unsigned int *parent = range->ctx->parent;
+
+	for (unsigned int u = range->first; u < range->last; u++)
+		atomic_store_explicit(&parent[u], cc_find(parent, u), memory_order_relaxed);
+}
+
+/* Sums for the most common component are kept local to avoid contention. */
+static void sum_components(void *arg)
+{
+	cc_range_t *range = arg;
+	cc_ctx_t *ctx = range->ctx;
+	long long local = 0;
+
+	for (unsigned int u = range->first; u < range->last; u++) {
+		unsigned int c = atomic_load_explicit(&ctx->parent[u], memory_order_relaxed);
+		int info = os_graph_info(ctx->graph, u);
+
+		if (c == ctx->skip)
+			local += info;
+		else
+			atomic_fetch_add_explicit(&ctx->sum[c], info, memory_order_relaxed);
+	}
+
+	atomic_fetch_add_explicit(&ctx->sum[ctx->skip], local, memory_order_relaxed);
+}
+
+/* Most frequent root among a fixed pseudo-random sample of nodes. */
+static unsigned int sample_largest(cc_ctx_t *ctx)
+{
+	unsigned int num_nodes = ctx->graph->num_nodes;
+	unsigned int samples[NUM_SAMPLES];
+	unsigned int seed = 2463534242u, best = 0, best_count = 0;
+
+	for (unsigned int i = 0; i < NUM_SAMPLES; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		samples[i] = cc_find(ctx->parent, seed % num_nodes);
+	}
+
+	// Boyer-Moore majority vote, then an exact count of the candidate
+	for (unsigned int i = 0, count = 0; i < NUM_SAMPLES; i++) {
+		if (count == 0)
+			best = samples[i];
+		count += (samples[i] == best) ? 1 : -1;
+	}
+	for (unsigned int i = 0; i < NUM_SAMPLES; i++)
+		best_count += (samples[i] == best);
+
+	return best_count > NUM_SAMPLES / 4 ? best : num_nodes;
+}
+
+void os_cc(os_graph_t *graph, os_threadpool_t *tp, os_cc_result_t *result)
+{
+	cc_ctx_t ctx = { .graph = graph };
+	unsigned int num_ranges = tp->num_threads * RANGES_PER_THREAD;
+	unsigned int num_nodes = graph->num_nodes;
+	cc_range_t *ranges;
+
+	ctx.parent = malloc(num_nodes * sizeof(*ctx.parent));
+	DIE(ctx.parent == NULL && num_nodes != 0, "malloc");
+	for (unsigned int i = 0; i < num_nodes; i++)
+		atomic_init(&ctx.parent[i], i);
+
+	ranges = malloc(num_ranges * sizeof(*ranges));
+	DIE(ranges == NULL, "malloc");
+	for (unsigned int i = 0; i < num_ranges; i++) {
+		ranges[i].ctx = &ctx;
+		ranges[i].first = (unsigned long long)num_nodes * i / num_ranges;
+		ranges[i].last = (unsigned long long)num_nodes * (i + 1) / num_ranges;
+	}
+
+	for (ctx.round = 0; ctx.round < NEIGHBOUR_ROUNDS; ctx.round++)
+		run_parallel(tp, &link_round, ranges, sizeof(*ranges), num_ranges);
+	run_parallel(tp, &compress, ranges, sizeof(*ranges), num_ranges);
+
+	ctx.skip = num_nodes != 0 ? sample_largest(&ctx) : 0;
+	run_parallel(tp, &link_remaining, ranges, sizeof(*ranges), num_ranges);
+	run_parallel(tp, &compress, ranges, sizeof(*ranges), num_ranges);
+
+	ctx.sum = calloc(num_nodes + 1, sizeof(*ctx.sum));
+	DIE(ctx.sum == NULL, "calloc");
+	run_parallel(tp, &sum_components, ranges, sizeof(*ranges), num_ranges);
+
+	result->comp = (unsigned int *)ctx.parent;
+	result->sum = (long long *)ctx.sum;
+	result->num_components = 0;
+	for (unsigned int i = 0; i < num_nodes; i++)
+		result->num_components += (result->comp[i] == i);
+
+	free(ranges);
+}
+
+void os_cc_result_destroy(os_cc_result_t *result)
+{
+	free(result->comp);
+	free(result->sum);
+}
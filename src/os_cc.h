@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __OS_CC_H__
+#define __OS_CC_H__	1
+
+#include "os_graph.h"
+#include "os_threadpool.h"
+
+typedef struct os_cc_result_t {
+	/* Component of every node, identified by its smallest node id. */
+	unsigned int *comp;
+	/* Sum of info over each component, indexed by component id. */
+	long long *sum;
+	unsigned int num_components;
+} os_cc_result_t;
+
+/*
+ * Parallel connected components on the workers of tp, using
+ * lock-free union-find with Afforest-style neighbour sampling (Sutton et al.,
+ * IPDPS 2018).
+ */
+void os_cc(os_graph_t *graph, os_threadpool_t *tp, os_cc_result_t *result);
+void os_cc_result_destroy(os_cc_result_t *result);
+
+#endif
@@ -0,0 +1,157 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+/*
+ * Chase-Lev work-stealing deque, using the C11 memory model mapping from:
+ * N. M. Le et al., "Correct and Efficient Work-Stealing for Weak Memory
+ * Models", PPoPP 2013.
+ *
+ * The owner thread pushes and takes at the bottom (LIFO), any other thread
+ * steals from the top (FIFO). Arrays replaced by a resize can still be read
+ * by concurrent thieves, so they are only freed by os_deque_destroy().
+ */
+
+#ifndef __OS_DEQUE_H__
+#define __OS_DEQUE_H__	1
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "utils.h"
+
+#define OS_DEQUE_INITIAL_SIZE	256
+#define OS_CACHE_LINE		64
+
+typedef struct os_deque_array_t {
+	long size;
+	struct os_deque_array_t *retired;
+	_Atomic(void *) buf[];
+} os_deque_array_t;
+
+typedef struct os_deque_t {
+	/* Thieves and the owner write different ends, keep them apart. */
+	_Atomic long top __attribute__((aligned(OS_CACHE_LINE)));
+	_Atomic long bottom __attribute__((aligned(OS_CACHE_LINE)));
+	_Atomic(os_deque_array_t *) array;
+} os_deque_t;
+
+/* Returned by os_deque_steal() when it lost a race and should be retried. */
+#define OS_DEQUE_ABORT	((void *)-1)
+
+static inline os_deque_array_t *os_deque_array_new(long size)
+{
+	os_deque_array_t *a;
+
+	a = calloc(1, sizeof(*a) + size * sizeof(a->buf[0]));
+	DIE(a == NULL, "calloc");
+	a->size = size;
+
+	return a;
+}
+
+static inline void os_deque_init(os_deque_t *d)
+{
+	atomic_init(&d->top, 0);
+	atomic_init(&d->bottom, 0);
+	atomic_init(&d->array, os_deque_array_new(OS_DEQUE_INITIAL_SIZE));
+}
+
+static inline void os_deque_destroy(os_deque_t *d)
+{
+	os_deque_array_t *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+
+	while (a != NULL) {
+		os_deque_array_t *retired = a->retired;
+
+		free(a);
+		a = retired;
+	}
+}
+
+/* Approximate number of items, for heuristics only. */
+static inline long os_deque_size(os_deque_t *d)
+{
+	long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+	long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+	return b > t ? b - t : 0;
+}
+
+static inline os_deque_array_t *os_deque_grow(os_deque_t *d, os_deque_array_t *a,
+		long top, long bottom)
+{
+	os_deque_array_t *n = os_deque_array_new(2 * a->size);
+
+	for (long i = top; i < bottom; i++)
+		atomic_store_explicit(&n->buf[i & (n->size - 1)],
+			atomic_load_explicit(&a->buf[i & (a->size - 1)], memory_order_relaxed),
+			memory_order_relaxed);
+	n->retired = a;
+	atomic_store_explicit(&d->array, n, memory_order_release);
+
+	return n;
+}
+
+/* Owner only. */
+static inline void os_deque_push(os_deque_t *d, void *item)
+{
+	long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+	long t = atomic_load_explicit(&d->top, memory_order_acquire);
+	os_deque_array_t *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+
+	if (b - t > a->size - 1)
+		a = os_deque_grow(d, a, t, b);
+	atomic_store_explicit(&a->buf[b & (a->size - 1)], item, memory_order_relaxed);
+	atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+}
+
+/* Owner only. Return NULL if the deque is empty. */
+static inline void *os_deque_take(os_deque_t *d)
+{
+	long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+	os_deque_array_t *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+	long t;
+	void *item = NULL;
+
+	atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+	if (t <= b) {
+		item = atomic_load_explicit(&a->buf[b & (a->size - 1)], memory_order_relaxed);
+		if (t == b) {
+			// Last item, race against thieves for it
+			if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+						memory_order_seq_cst, memory_order_relaxed))
+				item = NULL;
+			atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+		}
+	} else {
+		atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+	}
+
+	return item;
+}
+
+/* Any thread. Return NULL if empty, OS_DEQUE_ABORT if the race was lost. */
+static inline void *os_deque_steal(os_deque_t *d)
+{
+	long t = atomic_load_explicit(&d->top, memory_order_acquire);
+	long b;
+	void *item = NULL;
+
+	atomic_thread_fence(memory_order_seq_cst);
+	b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+
+	if (t < b) {
+		os_deque_array_t *a = atomic_load_explicit(&d->array, memory_order_acquire);
+
+		item = atomic_load_explicit(&a->buf[t & (a->size - 1)], memory_order_relaxed);
+		if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+					memory_order_seq_cst, memory_order_relaxed))
+			return OS_DEQUE_ABORT;
+	}
+
+	return item;
+}
+
+#endif
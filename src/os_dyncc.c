@@ -0,0 +1,540 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "os_dyncc.h"
+#include "os_time.h"
+#include "log/log.h"
+#include "utils.h"
+
+/* Nodes a removal may visit from each end, looking for another path. */
+#define REPAIR_BUDGET		4096
+#define EXTRA_INITIAL		1024
+#define NONE			UINT_MAX
+
+static unsigned int find(os_dyncc_t *dc, unsigned int x)
+{
+	// Path halving
+	while (dc->parent[x] != x) {
+		dc->parent[x] = dc->parent[dc->parent[x]];
+		x = dc->parent[x];
+	}
+
+	return x;
+}
+
+static void unite(os_dyncc_t *dc, unsigned int a, unsigned int b)
+{
+	unsigned int tmp;
+
+	a = find(dc, a);
+	b = find(dc, b);
+	if (a == b)
+		return;
+
+	// Union by size
+	if (dc->size[a] < dc->size[b]) {
+		tmp = a;
+		a = b;
+		b = tmp;
+	}
+
+	dc->parent[b] = a;
+	dc->size[a] += dc->size[b];
+	dc->sum[a] += dc->sum[b];
+	dc->dirty[a] |= dc->dirty[b];
+
+	// Swapping the successors of two nodes joins their member lists
+	tmp = dc->next[a];
+	dc->next[a] = dc->next[b];
+	dc->next[b] = tmp;
+}
+
+/* Forget every mark, epochs are even so that epoch + 1 never wraps. */
+static void new_epoch(os_dyncc_t *dc)
+{
+	dc->epoch += 2;
+	if (dc->epoch < 2) {
+		memset(dc->mark, 0, dc->graph->num_nodes * sizeof(*dc->mark));
+		dc->epoch = 2;
+	}
+}
+
+static void queue_push(os_dyncc_queue_t *q, size_t *tail, unsigned int idx)
+{
+	if (*tail == q->capacity) {
+		q->capacity = q->capacity ? 2 * q->capacity : 1024;
+		q->ids = realloc(q->ids, q->capacity * sizeof(*q->ids));
+		DIE(q->ids == NULL, "realloc");
+	}
+
+	q->ids[(*tail)++] = idx;
+}
+
+/* Mark idx as seen from side. Return 1 if the other side saw it already. */
+static int visit(os_dyncc_t *dc, unsigned int side, unsigned int idx, size_t *tail)
+{
+	if (dc->mark[idx] == dc->epoch + (side ^ 1))
+		return 1;
+	if (dc->mark[idx] == dc->epoch + side)
+		return 0;
+
+	dc->mark[idx] = dc->epoch + side;
+	queue_push(&dc->queue[side], tail, idx);
+	return 0;
+}
+
+static int is_dead(const os_dyncc_t *dc, size_t slot)
+{
+	return dc->dead != NULL && (dc->dead[slot / 32] >> (slot % 32)) & 1;
+}
+
+/*
+ * Visit the neighbours of idx over the edges left, added ones included.
+ * Return 1 as soon as one of them was seen from the other side.
+ */
+static int expand(os_dyncc_t *dc, unsigned int side, unsigned int idx, size_t *tail)
+{
+	const os_graph_t *graph = dc->graph;
+
+	for (size_t slot = graph->offsets[idx]; slot < graph->offsets[idx + 1]; slot++)
+		if (!is_dead(dc, slot) && visit(dc, side, graph->adj[slot], tail))
+			return 1;
+
+	for (unsigned int e = dc->extra_head[idx]; e != NONE; e = dc->extra_next[e])
+		if (visit(dc, side, dc->extra_dst[e], tail))
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Look for a path between u and v with a search from each, growing the
+ * smaller frontier first, until they meet or either has seen about
+ * REPAIR_BUDGET nodes. On random graphs they meet after about the square
+ * root of the component size. Return 0 if there is no path or the search
+ * gave up.
+ */
+static int still_connected(os_dyncc_t *dc, unsigned int u, unsigned int v)
+{
+	size_t head[2] = { 0, 0 }, tail[2] = { 0, 0 };
+
+	new_epoch(dc);
+	visit(dc, 0, u, &tail[0]);
+	visit(dc, 1, v, &tail[1]);
+
+	while (tail[0] < REPAIR_BUDGET && tail[1] < REPAIR_BUDGET) {
+		unsigned int side = tail[0] - head[0] <= tail[1] - head[1] ? 0 : 1;
+
+		// One end ran out of nodes without meeting the other
+		if (head[side] == tail[side])
+			return 0;
+		if (expand(dc, side, dc->queue[side].ids[head[side]++], &tail[side]))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Split the dirty component rooted at root into the components its
+ * members form over the edges left. Each new one is rooted at its first
+ * member in list order.
+ */
+static void relabel(os_dyncc_t *dc, unsigned int root)
+{
+	size_t count = 0, head, tail;
+	unsigned int x = root;
+
+	// Members first, the searches queue nodes after them
+	do {
+		queue_push(&dc->queue[0], &count, x);
+		x = dc->next[x];
+	} while (x != root);
+
+	new_epoch(dc);
+	for (size_t i = 0; i < count; i++) {
+		unsigned int r = dc->queue[0].ids[i];
+
+		if (dc->mark[r] == dc->epoch)
+			continue;
+
+		dc->parent[r] = r;
+		dc->next[r] = r;
+		dc->size[r] = 0;
+		dc->sum[r] = 0;
+		dc->dirty[r] = 0;
+
+		head = tail = count;
+		visit(dc, 0, r, &tail);
+		while (head != tail) {
+			x = dc->queue[0].ids[head++];
+			if (x != r) {
+				dc->parent[x] = r;
+				dc->next[x] = dc->next[r];
+				dc->next[r] = x;
+			}
+			dc->size[r]++;
+			dc->sum[r] += dc->info[x];
+			expand(dc, 0, x, &tail);
+		}
+	}
+
+	dc->recomputes++;
+	dc->recomputed_nodes += count;
+}
+
+void os_dyncc_init(os_dyncc_t *dc, os_graph_t *graph, const unsigned int *comp)
+{
+	unsigned int n = graph->num_nodes;
+
+	memset(dc, 0, sizeof(*dc));
+	dc->graph = graph;
+	dc->extra_free = NONE;
+
+	dc->info = malloc(n * sizeof(*dc->info));
+	dc->parent = malloc(n * sizeof(*dc->parent));
+	dc->size = malloc(n * sizeof(*dc->size));
+	dc->next = malloc(n * sizeof(*dc->next));
+	dc->sum = malloc(n * sizeof(*dc->sum));
+	dc->dirty = calloc(n, sizeof(*dc->dirty));
+	dc->extra_head = malloc(n * sizeof(*dc->extra_head));
+	dc->mark = calloc(n, sizeof(*dc->mark));
+	DIE(n != 0 && (dc->info == NULL || dc->parent == NULL || dc->size == NULL ||
+			dc->next == NULL || dc->sum == NULL || dc->dirty == NULL ||
+			dc->extra_head == NULL || dc->mark == NULL), "malloc");
+
+	for (unsigned int v = 0; v < n; v++) {
+		dc->info[v] = os_graph_info(graph, v);
+		dc->size[v] = 0;
+		dc->sum[v] = 0;
+		dc->next[v] = v;
+		dc->extra_head[v] = NONE;
+	}
+
+	// comp[c] == c for the node c naming each component, which is its root
+	for (unsigned int v = 0; v < n; v++) {
+		unsigned int c = comp[v];
+
+		dc->parent[v] = c;
+		dc->size[c]++;
+		dc->sum[c] += dc->info[v];
+		if (v != c) {
+			dc->next[v] = dc->next[c];
+			dc->next[c] = v;
+		}
+	}
+}
+
+void os_dyncc_destroy(os_dyncc_t *dc)
+{
+	free(dc->info);
+	free(dc->parent);
+	free(dc->size);
+	free(dc->next);
+	free(dc->sum);
+	free(dc->dirty);
+	free(dc->dead);
+	free(dc->extra_head);
+	free(dc->extra_dst);
+	free(dc->extra_next);
+	free(dc->mark);
+	free(dc->queue[0].ids);
+	free(dc->queue[1].ids);
+}
+
+static void add_extra(os_dyncc_t *dc, unsigned int u, unsigned int v)
+{
+	unsigned int e = dc->extra_free;
+
+	if (e != NONE) {
+		dc->extra_free = dc->extra_next[e];
+	} else {
+		if (dc->extra_used == dc->extra_capacity) {
+			dc->extra_capacity = dc->extra_capacity ? 2 * dc->extra_capacity :
+				EXTRA_INITIAL;
+			dc->extra_dst = realloc(dc->extra_dst,
+					dc->extra_capacity * sizeof(*dc->extra_dst));
+			dc->extra_next = realloc(dc->extra_next,
+					dc->extra_capacity * sizeof(*dc->extra_next));
+			DIE(dc->extra_dst == NULL || dc->extra_next == NULL, "realloc");
+		}
+		e = dc->extra_used++;
+	}
+
+	dc->extra_dst[e] = v;
+	dc->extra_next[e] = dc->extra_head[u];
+	dc->extra_head[u] = e;
+}
+
+void os_dyncc_add_edge(os_dyncc_t *dc, unsigned int u, unsigned int v)
+{
+	add_extra(dc, u, v);
+	add_extra(dc, v, u);
+	unite(dc, u, v);
+}
+
+/* Flag the first live slot of u's neighbours holding v. */
+static int kill_slot(os_dyncc_t *dc, unsigned int u, unsigned int v)
+{
+	const os_graph_t *graph = dc->graph;
+
+	for (size_t slot = graph->offsets[u]; slot < graph->offsets[u + 1]; slot++) {
+		if (graph->adj[slot] != v || is_dead(dc, slot))
+			continue;
+
+		if (dc->dead == NULL) {
+			dc->dead = calloc((2 * (size_t)graph->num_edges + 31) / 32,
+					sizeof(*dc->dead));
+			DIE(dc->dead == NULL, "calloc");
+		}
+		dc->dead[slot / 32] |= 1u << (slot % 32);
+		return 0;
+	}
+
+	return -1;
+}
+
+/* Unlink the first slot of u's added edges holding v. */
+static int unlink_extra(os_dyncc_t *dc, unsigned int u, unsigned int v)
+{
+	for (unsigned int *link = &dc->extra_head[u]; *link != NONE;
+			link = &dc->extra_next[*link]) {
+		unsigned int e = *link;
+
+		if (dc->extra_dst[e] != v)
+			continue;
+
+		*link = dc->extra_next[e];
+		dc->extra_next[e] = dc->extra_free;
+		dc->extra_free = e;
+		return 0;
+	}
+
+	return -1;
+}
+
+int os_dyncc_remove_edge(os_dyncc_t *dc, unsigned int u, unsigned int v)
+{
+	// Both ends list the edge, a self loop lists it twice
+	if (kill_slot(dc, u, v) == 0) {
+		DIE(kill_slot(dc, v, u) < 0, "kill_slot");
+	} else if (unlink_extra(dc, u, v) == 0) {
+		DIE(unlink_extra(dc, v, u) < 0, "unlink_extra");
+	} else {
+		return -1;
+	}
+
+	if (u != v && !still_connected(dc, u, v))
+		dc->dirty[find(dc, u)] = 1;
+
+	return 0;
+}
+
+void os_dyncc_set_info(os_dyncc_t *dc, unsigned int idx, int value)
+{
+	dc->sum[find(dc, idx)] += (long long)value - dc->info[idx];
+	dc->info[idx] = value;
+}
+
+long long os_dyncc_sum(os_dyncc_t *dc, unsigned int idx)
+{
+	unsigned int r = find(dc, idx);
+
+	if (dc->dirty[r]) {
+		relabel(dc, r);
+		r = find(dc, idx);
+	}
+
+	return dc->sum[r];
+}
+
+int os_dyncc_write_components(os_dyncc_t *dc, FILE *file)
+{
+	unsigned int n = dc->graph->num_nodes;
+	unsigned int *comp;
+	long long *sum;
+	int rc;
+
+	comp = malloc(n * sizeof(*comp));
+	sum = malloc(n * sizeof(*sum));
+	DIE(n != 0 && (comp == NULL || sum == NULL), "malloc");
+
+	for (unsigned int v = 0; v < n; v++) {
+		unsigned int r = find(dc, v);
+
+		if (dc->dirty[r])
+			relabel(dc, r);
+	}
+
+	// Nodes come in increasing order, so the first one seen of each
+	// component is its smallest. Its name is kept in comp[root] until the
+	// root itself comes, which then finds its own name there.
+	new_epoch(dc);
+	for (unsigned int v = 0; v < n; v++) {
+		unsigned int r = find(dc, v);
+
+		if (dc->mark[r] != dc->epoch) {
+			dc->mark[r] = dc->epoch;
+			comp[r] = v;
+			sum[v] = dc->sum[r];
+		}
+		comp[v] = comp[r];
+	}
+
+	rc = write_graph_components(dc->graph, comp, sum, file);
+
+	free(comp);
+	free(sum);
+	return rc;
+}
+
+/* Parse an input node id at *p into the node holding it. */
+static int parse_node(os_dyncc_t *dc, char **p, unsigned int *idx)
+{
+	unsigned long id;
+	char *end;
+
+	errno = 0;
+	id = strtoul(*p, &end, 10);
+	if (end == *p || errno != 0 || id >= dc->graph->num_nodes)
+		return -1;
+
+	*p = end;
+	*idx = os_graph_node_of(dc->graph, id);
+	return 0;
+}
+
+static int at_end(const char *p)
+{
+	while (isspace((unsigned char)*p))
+		p++;
+
+	return *p == '\0';
+}
+
+int os_dyncc_apply_file(os_dyncc_t *dc, FILE *file, FILE *out)
+{
+	unsigned long long updates = 0, queries = 0, line_no = 0;
+	double start = os_time_seconds();
+	char *line = NULL;
+	size_t line_size = 0;
+	int rc = 0;
+
+	while (rc == 0 && getline(&line, &line_size, file) != -1) {
+		unsigned int u, v;
+		char *p = line, *end;
+		char op;
+		long value;
+
+		line_no++;
+		while (isspace((unsigned char)*p))
+			p++;
+		if (*p == '\0' || *p == '#')
+			continue;
+
+		op = *p++;
+		switch (op) {
+		case '+':
+			if (parse_node(dc, &p, &u) < 0 || parse_node(dc, &p, &v) < 0)
+				goto invalid;
+			// An optional weight, meaningless for components
+			strtoul(p, &end, 10);
+			if (!at_end(end))
+				goto invalid;
+			os_dyncc_add_edge(dc, u, v);
+			updates++;
+			break;
+		case '-':
+			if (parse_node(dc, &p, &u) < 0 || parse_node(dc, &p, &v) < 0 || !at_end(p))
+				goto invalid;
+			if (os_dyncc_remove_edge(dc, u, v) < 0) {
+				log_error("Line %llu: no edge to remove", line_no);
+				rc = -1;
+			}
+			updates++;
+			break;
+		case '=':
+			if (parse_node(dc, &p, &u) < 0)
+				goto invalid;
+			errno = 0;
+			value = strtol(p, &end, 10);
+			if (end == p || errno != 0 || value < INT_MIN || value > INT_MAX ||
+					!at_end(end))
+				goto invalid;
+			os_dyncc_set_info(dc, u, value);
+			updates++;
+			break;
+		case '?':
+			if (parse_node(dc, &p, &u) < 0 || !at_end(p))
+				goto invalid;
+			if (fprintf(out, "%lld\n", os_dyncc_sum(dc, u)) < 0) {
+				log_error("Can't write query results");
+				rc = -1;
+			}
+			queries++;
+			break;
+		default:
+			goto invalid;
+		}
+		continue;
+
+invalid:
+		log_error("Line %llu: invalid update", line_no);
+		rc = -1;
+	}
+
+	free(line);
+
+	if (rc == 0 && ferror(file)) {
+		log_error("Can't read updates");
+		rc = -1;
+	}
+
+	if (getenv("OS_GRAPH_STATS") != NULL)
+		log_info("%llu updates and %llu queries in %.3f ms, %llu components relabelled "
+			"(%llu nodes)", updates, queries, (os_time_seconds() - start) * 1e3,
+			dc->recomputes, dc->recomputed_nodes);
+
+	return rc;
+}
+
+int os_dyncc_run_file(os_graph_t *graph, const unsigned int *comp, const char *updates,
+		const char *output)
+{
+	os_dyncc_t dc;
+	FILE *file;
+	int rc;
+
+	file = fopen(updates, "r");
+	if (file == NULL) {
+		log_error("Can't open %s: %s", updates, strerror(errno));
+		return -1;
+	}
+
+	os_dyncc_init(&dc, graph, comp);
+	rc = os_dyncc_apply_file(&dc, file, stdout);
+	fclose(file);
+
+	if (rc == 0 && output != NULL) {
+		file = fopen(output, "w");
+		if (file == NULL) {
+			log_error("Can't open %s: %s", output, strerror(errno));
+			rc = -1;
+		} else {
+			if (os_dyncc_write_components(&dc, file) < 0)
+				rc = -1;
+			if (fclose(file) != 0)
+				rc = -1;
+			if (rc < 0)
+				log_error("Can't write %s", output);
+		}
+	}
+
+	os_dyncc_destroy(&dc);
+	return rc;
+}
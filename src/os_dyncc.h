@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __OS_DYNCC_H__
+#define __OS_DYNCC_H__	1
+
+#include <stdio.h>
+
+#include "os_graph.h"
+
+typedef struct os_dyncc_queue_t {
+	unsigned int *ids;
+	size_t capacity;
+} os_dyncc_queue_t;
+
+/*
+ * Connected components of a graph under edge and value updates, with the
+ * sum of the values of each component.
+ *
+ * Components are union-find trees whose roots hold the sum, the size and
+ * a circular list of the members. Inserting an edge merges two trees.
+ * Removing one can split a component, which union-find can't undo: unless
+ * a short search from both ends still finds a path between them, the
+ * component is marked dirty and relabelled from its member list, over the
+ * edges left, the next time it is queried.
+ *
+ * The graph itself is never modified: edges added go to per-node overflow
+ * lists, removed ones are flagged, and values are copied, since the graph
+ * may point into a read-only mapping.
+ */
+typedef struct os_dyncc_t {
+	os_graph_t *graph;
+	int *info;
+
+	unsigned int *parent;
+	unsigned int *size;
+	unsigned int *next;
+	long long *sum;
+	unsigned char *dirty;
+
+	/* One bit per slot of graph->adj, set once its edge was removed. */
+	unsigned int *dead;
+
+	/* Added edges, two slots each, linked from extra_head by extra_next. */
+	unsigned int *extra_head;
+	unsigned int *extra_dst;
+	unsigned int *extra_next;
+	unsigned int extra_used, extra_capacity, extra_free;
+
+	/*
+	 * Scratch for searches and relabelling. Searches go from both ends of
+	 * a removed edge: a node was seen from side s if mark == epoch + s.
+	 */
+	unsigned int *mark;
+	unsigned int epoch;
+	os_dyncc_queue_t queue[2];
+
+	/* Components relabelled so far, and their total size. */
+	unsigned long long recomputes;
+	unsigned long long recomputed_nodes;
+} os_dyncc_t;
+
+/*
+ * Set up dc for graph, whose components are given by comp: the component
+ * of every node, identified by one of its nodes, as os_cc() returns them.
+ */
+void os_dyncc_init(os_dyncc_t *dc, os_graph_t *graph, const unsigned int *comp);
+void os_dyncc_destroy(os_dyncc_t *dc);
+
+void os_dyncc_add_edge(os_dyncc_t *dc, unsigned int u, unsigned int v);
+/* Remove one edge between u and v. Return -1 if there is none. */
+int os_dyncc_remove_edge(os_dyncc_t *dc, unsigned int u, unsigned int v);
+void os_dyncc_set_info(os_dyncc_t *dc, unsigned int idx, int value);
+/* Sum of the values of the component of idx. */
+long long os_dyncc_sum(os_dyncc_t *dc, unsigned int idx);
+
+/* Write the current components as write_graph_components() does. */
+int os_dyncc_write_components(os_dyncc_t *dc, FILE *file);
+
+/*
+ * Apply the updates read from file, one per line, with node ids of the
+ * input:
+ *   + u v      add an edge between u and v (a weight after v is ignored)
+ *   - u v      remove one edge between u and v
+ *   = u value  set the value of u
+ *   ? u        write the sum of the component of u to out
+ * Blank lines and lines starting with '#' are skipped. Return -1 at the
+ * first line that can't be applied.
+ */
+int os_dyncc_apply_file(os_dyncc_t *dc, FILE *file, FILE *out);
+
+/*
+ * Track the components in comp of graph through the updates file, writing
+ * its query results to stdout, then write the components left to output,
+ * if not NULL. Return -1, once the error is logged, if anything fails.
+ */
+int os_dyncc_run_file(os_graph_t *graph, const unsigned int *comp, const char *updates,
+		const char *output);
+
+#endif
@@ -0,0 +1,358 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Synthetic graph generators for benchmarks.
+ *
+ * Node values and edges are drawn in chunks of GEN_CHUNK, each seeded from
+ * the spec seed and its index with splitmix64, and generated in parallel.
+ * R-MAT node ids go through a bijective scramble, as Graph500 does, so
+ * that hubs aren't all packed at the lowest ids.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "os_gen.h"
+#include "os_threadpool.h"
+#include "log/log.h"
+#include "utils.h"
+
+#define GEN_CHUNK		(1u << 16)
+#define RMAT_EDGE_FACTOR	16
+#define RMAT_MAX_SCALE		31
+/* Graph500 quadrant probabilities, as fractions of 2^32; d is the rest. */
+#define RMAT_A			((uint64_t)(0.57 * 4294967296.0))
+#define RMAT_B			((uint64_t)(0.19 * 4294967296.0))
+#define RMAT_C			((uint64_t)(0.19 * 4294967296.0))
+/* Node values are drawn from [-VALUE_RANGE, VALUE_RANGE]. */
+#define VALUE_RANGE		100
+#define DEFAULT_SEED		0x5eed
+
+typedef struct gen_chunk {
+	const os_gen_spec_t *spec;
+	os_gen_graph_t *out;
+	unsigned int index;
+	unsigned int first, last;
+	int nodes;
+} gen_chunk_t;
+
+static uint64_t splitmix64(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* Uniform in [0, n), from the high half of r. n is at most 2^32. */
+static unsigned int below(uint64_t r, uint64_t n)
+{
+	return ((r >> 32) * n) >> 32;
+}
+
+/* Bijection on the ids of a 2^scale node graph. */
+static unsigned int scramble(unsigned int v, unsigned int scale)
+{
+	uint64_t mask = (1ULL << scale) - 1;
+	uint64_t x = v;
+
+	x = (x * 0x9e3779b1u) & mask;
+	x ^= x >> (scale / 2 + 1);
+	x = (x * 0x85ebca6bu) & mask;
+
+	return x;
+}
+
+static void rmat_edge(unsigned int scale, uint64_t *state, os_edge_t *edge)
+{
+	unsigned int u = 0, v = 0;
+	uint64_t r = 0;
+
+	for (unsigned int bit = 0; bit < scale; bit++) {
+		uint64_t p;
+
+		// Two 32-bit draws per 64-bit number
+		if (bit % 2 == 0)
+			r = splitmix64(state);
+		p = bit % 2 == 0 ? r & 0xffffffff : r >> 32;
+
+		u <<= 1;
+		v <<= 1;
+		if (p < RMAT_A)
+			continue;
+		if (p < RMAT_A + RMAT_B) {
+			v |= 1;
+		} else if (p < RMAT_A + RMAT_B + RMAT_C) {
+			u |= 1;
+		} else {
+			u |= 1;
+			v |= 1;
+		}
+	}
+
+	edge->src = scramble(u, scale);
+	edge->dst = scramble(v, scale);
+}
+
+static void generate_edge(const os_gen_spec_t *spec, unsigned int i, uint64_t *state,
+		os_edge_t *edge)
+{
+	unsigned int w = spec->width;
+	unsigned int horizontal;
+
+	switch (spec->kind) {
+	case OS_GEN_RMAT:
+		rmat_edge(spec->width, state, edge);
+		break;
+	case OS_GEN_ER:
+		edge->src = below(splitmix64(state), spec->num_nodes);
+		edge->dst = below(splitmix64(state), spec->num_nodes);
+		break;
+	case OS_GEN_GRID:
+		// Edges to the right neighbour come first, then the ones below
+		horizontal = (spec->num_nodes / w) * (w - 1);
+		if (i < horizontal) {
+			edge->src = i / (w - 1) * w + i % (w - 1);
+			edge->dst = edge->src + 1;
+		} else {
+			edge->src = i - horizontal;
+			edge->dst = edge->src + w;
+		}
+		break;
+	case OS_GEN_PATH:
+		edge->src = i;
+		edge->dst = i + 1;
+		break;
+	case OS_GEN_STAR:
+		edge->src = 0;
+		edge->dst = i + 1;
+		break;
+	}
+
+	edge->weight = spec->max_weight ? 1 + below(splitmix64(state), spec->max_weight) : 1;
+}
+
+static void generate_chunk(void *arg)
+{
+	gen_chunk_t *chunk = arg;
+	const os_gen_spec_t *spec = chunk->spec;
+	uint64_t state = spec->seed ^ ((uint64_t)chunk->index + 1) * 0xd1342543de82ef95ULL;
+
+	if (chunk->nodes) {
+		state ^= 0x5851f42d4c957f2dULL;
+		for (unsigned int i = chunk->first; i < chunk->last; i++)
+			chunk->out->values[i] = (int)below(splitmix64(&state),
+					2 * VALUE_RANGE + 1) - VALUE_RANGE;
+		return;
+	}
+
+	for (unsigned int i = chunk->first; i < chunk->last; i++)
+		generate_edge(spec, i, &state, &chunk->out->edges[i]);
+}
+
+/* Parse the next ":number" of spec at *p. Return -1 if there is none. */
+static int parse_field(const char **p, unsigned long long *value)
+{
+	char *end;
+
+	if (**p != ':')
+		return -1;
+
+	errno = 0;
+	*value = strtoull(*p + 1, &end, 10);
+	if (end == *p + 1 || errno != 0)
+		return -1;
+
+	*p = end;
+	return 0;
+}
+
+int os_gen_parse(const char *spec, os_gen_spec_t *out)
+{
+	static const char * const kinds[] = {
+		[OS_GEN_RMAT] = "rmat",
+		[OS_GEN_ER] = "er",
+		[OS_GEN_GRID] = "grid",
+		[OS_GEN_PATH] = "path",
+		[OS_GEN_STAR] = "star",
+	};
+	unsigned long long a = 0, b = 0;
+	const char *p = strchr(spec, ':');
+	size_t len = p != NULL ? (size_t)(p - spec) : strlen(spec);
+	unsigned int kind;
+
+	memset(out, 0, sizeof(*out));
+	out->seed = DEFAULT_SEED;
+	snprintf(out->name, sizeof(out->name), "%s", spec);
+
+	for (kind = 0; kind < sizeof(kinds) / sizeof(kinds[0]); kind++)
+		if (strlen(kinds[kind]) == len && strncmp(spec, kinds[kind], len) == 0)
+			break;
+	if (kind == sizeof(kinds) / sizeof(kinds[0]) || p == NULL || parse_field(&p, &a) < 0)
+		goto invalid;
+	out->kind = kind;
+
+	switch (out->kind) {
+	case OS_GEN_RMAT:
+		b = RMAT_EDGE_FACTOR;
+		if (*p != '\0' && parse_field(&p, &b) < 0)
+			goto invalid;
+		if (a == 0 || a > RMAT_MAX_SCALE || b > (UINT_MAX >> a))
+			goto invalid;
+		out->width = a;
+		out->num_nodes = 1ULL << a;
+		out->num_edges = b << a;
+		break;
+	case OS_GEN_ER:
+		if (parse_field(&p, &b) < 0 || a == 0)
+			goto invalid;
+		out->num_nodes = a;
+		out->num_edges = b;
+		break;
+	case OS_GEN_GRID:
+		if (parse_field(&p, &b) < 0 || a == 0 || b == 0 || a > UINT_MAX / b)
+			goto invalid;
+		out->width = a;
+		out->num_nodes = a * b;
+		out->num_edges = (a - 1) * b + a * (b - 1);
+		break;
+	case OS_GEN_PATH:
+	case OS_GEN_STAR:
+		if (a == 0)
+			goto invalid;
+		out->num_nodes = a;
+		out->num_edges = a - 1;
+		break;
+	}
+
+	if (*p != '\0' || out->num_nodes > UINT_MAX || out->num_edges > UINT_MAX)
+		goto invalid;
+
+	return 0;
+
+invalid:
+	log_error("Invalid graph \"%s\"", spec);
+	return -1;
+}
+
+void os_gen_generate(const os_gen_spec_t *spec, os_threadpool_t *tp, os_gen_graph_t *out)
+{
+	unsigned int node_chunks = (spec->num_nodes + GEN_CHUNK - 1) / GEN_CHUNK;
+	unsigned int edge_chunks = (spec->num_edges + GEN_CHUNK - 1) / GEN_CHUNK;
+	unsigned int count = node_chunks + edge_chunks;
+	gen_chunk_t *chunks;
+
+	out->num_nodes = spec->num_nodes;
+	out->num_edges = spec->num_edges;
+	out->weighted = spec->max_weight != 0;
+	out->values = malloc(out->num_nodes * sizeof(*out->values));
+	out->edges = malloc((size_t)out->num_edges * sizeof(*out->edges));
+	DIE(out->values == NULL || (out->edges == NULL && out->num_edges != 0), "malloc");
+
+	chunks = malloc((count + 1) * sizeof(*chunks));
+	DIE(chunks == NULL, "malloc");
+
+	for (unsigned int i = 0; i < count; i++) {
+		int nodes = i < node_chunks;
+		unsigned int index = nodes ? i : i - node_chunks;
+		unsigned long long total = nodes ? out->num_nodes : out->num_edges;
+		unsigned long long last = ((unsigned long long)index + 1) * GEN_CHUNK;
+
+		chunks[i].spec = spec;
+		chunks[i].out = out;
+		chunks[i].index = index;
+		chunks[i].nodes = nodes;
+		chunks[i].first = index * GEN_CHUNK;
+		chunks[i].last = last < total ? last : total;
+	}
+
+	run_parallel(tp, &generate_chunk, chunks, sizeof(*chunks), count);
+
+	free(chunks);
+}
+
+void os_gen_destroy(os_gen_graph_t *graph)
+{
+	free(graph->values);
+	free(graph->edges);
+}
+
+/* Output buffer for os_gen_write_text(), fprintf() is far too slow. */
+typedef struct text_buf {
+	FILE *file;
+	char data[1 << 16];
+	size_t len;
+	int error;
+} text_buf_t;
+
+static void text_flush(text_buf_t *buf)
+{
+	if (buf->len != 0 && fwrite(buf->data, 1, buf->len, buf->file) != buf->len)
+		buf->error = 1;
+	buf->len = 0;
+}
+
+/* Append value and then sep. */
+static void text_put(text_buf_t *buf, long long value, char sep)
+{
+	char digits[24];
+	unsigned long long u = value < 0 ? -(unsigned long long)value : (unsigned long long)value;
+	size_t n = 0;
+
+	if (buf->len + sizeof(digits) + 2 > sizeof(buf->data))
+		text_flush(buf);
+
+	do {
+		digits[n++] = '0' + u % 10;
+		u /= 10;
+	} while (u != 0);
+
+	if (value < 0)
+		buf->data[buf->len++] = '-';
+	while (n > 0)
+		buf->data[buf->len++] = digits[--n];
+	buf->data[buf->len++] = sep;
+}
+
+int os_gen_write_text(const os_gen_graph_t *graph, FILE *file)
+{
+	text_buf_t *buf = malloc(sizeof(*buf));
+
+	DIE(buf == NULL, "malloc");
+	buf->file = file;
+	buf->len = 0;
+	buf->error = 0;
+
+	if (fprintf(file, "%u %u%s\n", graph->num_nodes, graph->num_edges,
+				graph->weighted ? " w" : "") < 0)
+		buf->error = 1;
+
+	for (unsigned int i = 0; i < graph->num_nodes; i++)
+		text_put(buf, graph->values[i], i == graph->num_nodes - 1 ? '\n' : ' ');
+
+	for (unsigned int i = 0; i < graph->num_edges; i++) {
+		const os_edge_t *e = &graph->edges[i];
+
+		text_put(buf, e->src, ' ');
+		if (graph->weighted) {
+			text_put(buf, e->dst, ' ');
+			text_put(buf, e->weight, '\n');
+		} else {
+			text_put(buf, e->dst, '\n');
+		}
+	}
+
+	text_flush(buf);
+	if (buf->error || fflush(file) != 0) {
+		log_error("Can't write generated graph");
+		free(buf);
+		return -1;
+	}
+
+	free(buf);
+	return 0;
+}
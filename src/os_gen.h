@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __OS_GEN_H__
+#define __OS_GEN_H__	1
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "os_graph.h"
+
+struct os_threadpool;
+
+typedef enum os_gen_kind_t {
+	/* Recursive matrix (Chakrabarti et al., SDM 2004), Graph500 parameters. */
+	OS_GEN_RMAT,
+	/* Erdős–Rényi G(n, m): m edges between uniformly random ends. */
+	OS_GEN_ER,
+	/* 2D grid, every node linked to its right and lower neighbours. */
+	OS_GEN_GRID,
+	OS_GEN_PATH,
+	/* Node 0 linked to every other node. */
+	OS_GEN_STAR
+} os_gen_kind_t;
+
+/*
+ * Graph to generate, parsed from "rmat:SCALE[:EDGE_FACTOR]",
+ * "er:NODES:EDGES", "grid:WIDTH:HEIGHT", "path:NODES" or "star:NODES".
+ */
+typedef struct os_gen_spec_t {
+	os_gen_kind_t kind;
+	unsigned long long num_nodes;
+	unsigned long long num_edges;
+	/* Grid width, or the log2 of the number of nodes of R-MAT graphs. */
+	unsigned int width;
+	/* Edges weigh 1 ... max_weight, unweighted if 0. */
+	unsigned int max_weight;
+	uint64_t seed;
+	char name[64];
+} os_gen_spec_t;
+
+/* Edge list and node values, as create_graph_from_data() takes them. */
+typedef struct os_gen_graph_t {
+	unsigned int num_nodes;
+	unsigned int num_edges;
+	int *values;
+	os_edge_t *edges;
+	int weighted;
+} os_gen_graph_t;
+
+/* Parse spec into out. Return -1 if it is malformed or too large. */
+int os_gen_parse(const char *spec, os_gen_spec_t *out);
+
+/*
+ * Generate the graph described by spec on tp, which must be idle. Edges
+ * are drawn in fixed-size chunks, each from its own seed, so the graph
+ * only depends on spec, not on the number of threads.
+ */
+void os_gen_generate(const os_gen_spec_t *spec, struct os_threadpool *tp, os_gen_graph_t *out);
+void os_gen_destroy(os_gen_graph_t *graph);
+
+/* Write graph in the text input format. */
+int os_gen_write_text(const os_gen_graph_t *graph, FILE *file);
+
+#endif
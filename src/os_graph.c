@@ -2,114 +2,519 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "os_graph.h"
+#include "os_input.h"
+#include "os_time.h"
 #include "log/log.h"
 #include "utils.h"
 
-/* Node functions */
-os_node_t *os_create_node(unsigned int id, int info)
+/* Graph functions */
+
+/* Create an empty graph living in its own arena. */
+os_graph_t *os_graph_alloc(unsigned int num_nodes, unsigned int num_edges)
 {
-	os_node_t *node;
+	os_arena_t arena;
+	os_graph_t *graph;
 
-	node = malloc(sizeof(*node));
-	DIE(node == NULL, "mallloc");
+	os_arena_init(&arena);
+	graph = os_arena_calloc(&arena, 1, sizeof(*graph));
+	graph->arena = arena;
 
-	node->id = id;
-	node->info = info;
-	node->num_neighbours = 0;
-	node->neighbours = NULL;
+	graph->num_nodes = num_nodes;
+	graph->num_edges = num_edges;
 
-	return node;
+	return graph;
+}
+
+/*
+ * Set up the node values and the visit state of graph. Values are read
+ * from info, which must outlive the graph, or if it is NULL from a new
+ * array the caller fills.
+ */
+void os_graph_alloc_nodes(os_graph_t *graph, int *info)
+{
+	graph->info = info != NULL ? info :
+		os_arena_alloc(&graph->arena, graph->num_nodes * sizeof(*graph->info));
+
+	graph->visited = calloc(graph->num_nodes, sizeof(*graph->visited));
+	DIE(graph->visited == NULL && graph->num_nodes != 0, "calloc");
 }
 
-/* Graph functions */
 os_graph_t *create_graph_from_data(unsigned int num_nodes, unsigned int num_edges,
-		int *values, os_edge_t *edges)
+		int *values, os_edge_t *edges, int weighted)
 {
 	os_graph_t *graph;
+	size_t *cursor;
 
-	graph = malloc(sizeof(*graph));
-	DIE(graph == NULL, "mallloc");
+	graph = os_graph_alloc(num_nodes, num_edges);
 
-	graph->num_nodes = num_nodes;
-	graph->num_edges = num_edges;
-
-	graph->nodes = malloc(num_nodes * sizeof(os_node_t *));
-	DIE(graph->nodes == NULL, "malloc");
+	// Count pass: offsets[i + 1] holds the degree of node i
+	graph->offsets = os_arena_calloc(&graph->arena, num_nodes + 1, sizeof(*graph->offsets));
 
-	for (unsigned int i = 0; i < graph->num_nodes; i++) {
-		graph->nodes[i] = os_create_node(i, values[i]);
-		graph->nodes[i]->neighbours = malloc(graph->num_nodes * sizeof(unsigned int));
-		DIE(graph->nodes[i]->neighbours == NULL, "malloc");
-		graph->nodes[i]->num_neighbours = 0;
+	for (unsigned int i = 0; i < num_edges; i++) {
+		if (edges[i].src >= num_nodes || edges[i].dst >= num_nodes) {
+			log_error("Edge %u (%u, %u) out of range", i, edges[i].src, edges[i].dst);
+			destroy_graph(graph);
+			return NULL;
+		}
+		graph->offsets[edges[i].src + 1]++;
+		graph->offsets[edges[i].dst + 1]++;
 	}
 
-	for (unsigned int i = 0; i < graph->num_edges; i++) {
+	for (unsigned int i = 0; i < num_nodes; i++)
+		graph->offsets[i + 1] += graph->offsets[i];
+
+	// Fill pass: scatter both directions of every edge
+	graph->adj = os_arena_alloc(&graph->arena, 2 * (size_t)num_edges * sizeof(*graph->adj));
+	if (weighted)
+		graph->weights = os_arena_alloc(&graph->arena,
+				2 * (size_t)num_edges * sizeof(*graph->weights));
+
+	cursor = malloc(num_nodes * sizeof(*cursor));
+	DIE(cursor == NULL && num_nodes != 0, "malloc");
+	for (unsigned int i = 0; i < num_nodes; i++)
+		cursor[i] = graph->offsets[i];
+
+	for (unsigned int i = 0; i < num_edges; i++) {
 		unsigned int isrc, idst;
 
 		isrc = edges[i].src;
 		idst = edges[i].dst;
-		graph->nodes[isrc]->neighbours[graph->nodes[isrc]->num_neighbours++] = idst;
-		graph->nodes[idst]->neighbours[graph->nodes[idst]->num_neighbours++] = isrc;
+		if (weighted) {
+			graph->weights[cursor[isrc]] = edges[i].weight;
+			graph->weights[cursor[idst]] = edges[i].weight;
+		}
+		graph->adj[cursor[isrc]++] = idst;
+		graph->adj[cursor[idst]++] = isrc;
 	}
 
-	graph->visited = malloc(graph->num_nodes * sizeof(*graph->visited));
-	DIE(graph->visited == NULL, "malloc");
+	free(cursor);
 
-	for (unsigned int i = 0; i < graph->num_nodes; i++)
-		graph->visited[i] = NOT_VISITED;
+	os_graph_alloc_nodes(graph, NULL);
+	memcpy(graph->info, values, num_nodes * sizeof(*graph->info));
 
 	return graph;
 }
 
-os_graph_t *create_graph_from_file(FILE *file)
+/*
+ * Parse the "num_nodes num_edges [w]" header and the node values. A "w"
+ * token means every edge line carries a third number, its weight. Node
+ * values are integers, so it can't be mistaken for one.
+ */
+int *parse_graph_nodes(os_scanner_t *sc, unsigned int *num_nodes, unsigned int *num_edges,
+		int *weighted)
 {
-	unsigned int num_nodes, num_edges;
-	unsigned int i;
 	int *nodes;
-	os_edge_t *edges;
-	os_graph_t *graph = NULL;
 
-	if (fscanf(file, "%d %d", &num_nodes, &num_edges) == 0) {
-		log_error("Can't read from file");
-		goto out;
+	if (os_scan_uint(sc, num_nodes) < 0 || os_scan_uint(sc, num_edges) < 0) {
+		log_error("Malformed graph header at byte %zu", os_scan_offset(sc));
+		return NULL;
 	}
 
-	nodes = malloc(num_nodes * sizeof(int));
-	DIE(nodes == NULL, "malloc");
-	for (i = 0; i < num_nodes; i++) {
-		if (fscanf(file, "%d", &nodes[i]) == 0) {
-			log_error("Can't read from file");
-			goto free_nodes;
+	os_scan_skip_space(sc);
+	*weighted = sc->pos < sc->end && *sc->pos == 'w' &&
+		(sc->pos + 1 == sc->end || os_scan_is_space(sc->pos[1]));
+	if (*weighted)
+		sc->pos++;
+
+	nodes = malloc(*num_nodes * sizeof(int));
+	DIE(nodes == NULL && *num_nodes != 0, "malloc");
+	for (unsigned int i = 0; i < *num_nodes; i++) {
+		if (os_scan_int(sc, &nodes[i]) < 0) {
+			log_error("Malformed node value %u at byte %zu", i, os_scan_offset(sc));
+			free(nodes);
+			return NULL;
 		}
 	}
 
+	return nodes;
+}
+
+os_graph_t *create_graph_from_buffer(const char *data, size_t size)
+{
+	os_scanner_t sc;
+	unsigned int num_nodes, num_edges;
+	unsigned int i;
+	int *nodes, weighted;
+	os_edge_t *edges;
+	os_graph_t *graph = NULL;
+
+	os_scan_init(&sc, data, size);
+
+	nodes = parse_graph_nodes(&sc, &num_nodes, &num_edges, &weighted);
+	if (nodes == NULL)
+		goto out;
+
 	edges = malloc(num_edges * sizeof(os_edge_t));
-	DIE(edges == NULL, "malloc");
+	DIE(edges == NULL && num_edges != 0, "malloc");
 	for (i = 0; i < num_edges; ++i) {
-		if (fscanf(file, "%d %d", &edges[i].src, &edges[i].dst) == 0) {
-			log_error("Can't read from file");
+		if (os_scan_uint(&sc, &edges[i].src) < 0 || os_scan_uint(&sc, &edges[i].dst) < 0 ||
+		    (weighted && os_scan_uint(&sc, &edges[i].weight) < 0)) {
+			log_error("Malformed edge %u at byte %zu", i, os_scan_offset(&sc));
 			goto free_edges;
 		}
 	}
 
-	graph = create_graph_from_data(num_nodes, num_edges, nodes, edges);
+	os_scan_skip_space(&sc);
+	if (sc.pos != sc.end) {
+		log_error("Trailing data at byte %zu", os_scan_offset(&sc));
+		goto free_edges;
+	}
+
+	graph = create_graph_from_data(num_nodes, num_edges, nodes, edges, weighted);
 
 free_edges:
 	free(edges);
-free_nodes:
 	free(nodes);
 out:
 	return graph;
 }
 
+os_graph_t *create_graph_from_file(FILE *file)
+{
+	os_input_t in;
+	os_graph_t *graph;
+	size_t size;
+	double start = os_time_seconds();
+
+	if (os_input_open(file, &in) < 0)
+		return NULL;
+	size = in.size;
+
+	if (is_graph_binary(in.data, in.size))
+		graph = create_graph_from_binary(&in, getenv("OS_GRAPH_VERIFY") != NULL);
+	else
+		graph = create_graph_from_buffer(in.data, in.size);
+	if (graph != NULL) {
+		graph->load_bytes = size;
+		graph->load_time = os_time_seconds() - start;
+	}
+
+	os_input_close(&in);
+
+	return graph;
+}
+
+void destroy_graph(os_graph_t *graph)
+{
+	os_arena_t arena = graph->arena;
+
+	free(graph->visited);
+	free(graph->visited_bits);
+	os_input_close(&graph->backing);
+
+	// The graph itself lives in the arena
+	os_arena_destroy(&arena);
+}
+
+/* Replace the visited array with a bitset, 32 times smaller. */
+void os_graph_use_visited_bitset(os_graph_t *graph)
+{
+	size_t words = graph->num_nodes / OS_VISITED_BITS + 1;
+
+	graph->visited_bits = calloc(words, sizeof(*graph->visited_bits));
+	DIE(graph->visited_bits == NULL, "calloc");
+
+	for (unsigned int i = 0; i < graph->num_nodes; i++) {
+		if (atomic_load_explicit(&graph->visited[i], memory_order_relaxed) != NOT_VISITED)
+			graph->visited_bits[i / OS_VISITED_BITS] |= 1u << (i % OS_VISITED_BITS);
+	}
+
+	free(graph->visited);
+	graph->visited = NULL;
+}
+
+/* Forget every visit, so that the graph can be traversed again. */
+void os_graph_reset_visited(os_graph_t *graph)
+{
+	if (graph->visited_bits != NULL)
+		memset((void *)graph->visited_bits, 0,
+			(graph->num_nodes / OS_VISITED_BITS + 1) * sizeof(*graph->visited_bits));
+	else
+		memset((void *)graph->visited, 0, graph->num_nodes * sizeof(*graph->visited));
+}
+
+/* Binary format functions */
+static size_t binary_info_size(uint64_t num_nodes)
+{
+	return (num_nodes * sizeof(int32_t) + 7) & ~(size_t)7;
+}
+
+static size_t binary_payload_size(uint64_t num_nodes, uint64_t num_edges, int weighted)
+{
+	return binary_info_size(num_nodes) + (num_nodes + 1) * sizeof(uint64_t) +
+		(weighted ? 2 : 1) * 2 * num_edges * sizeof(uint32_t);
+}
+
+/* FNV-1a, folding in 64-bit words instead of single bytes. */
+static uint64_t binary_checksum(uint64_t hash, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+	uint64_t word;
+
+	for (; size >= sizeof(word); size -= sizeof(word), p += sizeof(word)) {
+		memcpy(&word, p, sizeof(word));
+		hash = (hash ^ word) * 0x100000001b3ULL;
+	}
+	for (; size > 0; size--, p++)
+		hash = (hash ^ *p) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+#define CHECKSUM_SEED	0xcbf29ce484222325ULL
+
+int is_graph_binary(const char *data, size_t size)
+{
+	return size >= sizeof(os_graph_header_t) &&
+		memcmp(data, OS_GRAPH_MAGIC, sizeof(OS_GRAPH_MAGIC)) == 0;
+}
+
+/*
+ * Create a graph whose arrays point straight into the binary image in, which
+ * then belongs to the graph. The header and the offsets are always checked,
+ * so every neighbour list lies within the adjacency array. The checksum and
+ * the node ids in the lists, which take reading the whole file, are only
+ * validated if verify is set: skipping them is unsafe on untrusted files,
+ * whose out of range ids would be read past the end of the node arrays.
+ */
+os_graph_t *create_graph_from_binary(os_input_t *in, int verify)
+{
+	const os_graph_header_t *header = (const os_graph_header_t *)in->data;
+	const char *payload = in->data + sizeof(*header);
+	os_graph_t *graph;
+
+	if (sizeof(size_t) != sizeof(uint64_t) || sizeof(unsigned int) != sizeof(uint32_t)) {
+		log_error("Binary graphs are not supported on this platform");
+		return NULL;
+	}
+
+	if (header->version != OS_GRAPH_VERSION) {
+		log_error("Unsupported binary graph version or byte order");
+		return NULL;
+	}
+
+	if (header->flags & ~(OS_GRAPH_F_CHECKSUM | OS_GRAPH_F_WEIGHTS)) {
+		log_error("Unsupported binary graph flags %#x", header->flags);
+		return NULL;
+	}
+
+	if (header->num_nodes > UINT_MAX || header->num_edges > UINT_MAX ||
+	    in->size - sizeof(*header) != binary_payload_size(header->num_nodes, header->num_edges,
+			header->flags & OS_GRAPH_F_WEIGHTS)) {
+		log_error("Binary graph size doesn't match its header");
+		return NULL;
+	}
+
+	graph = os_graph_alloc(header->num_nodes, header->num_edges);
+
+	graph->offsets = (size_t *)(payload + binary_info_size(graph->num_nodes));
+	graph->adj = (unsigned int *)(graph->offsets + graph->num_nodes + 1);
+	if (header->flags & OS_GRAPH_F_WEIGHTS)
+		graph->weights = graph->adj + 2 * (size_t)graph->num_edges;
+
+	if (graph->offsets[0] != 0 || graph->offsets[graph->num_nodes] != 2 * (size_t)graph->num_edges) {
+		log_error("Corrupted binary graph offsets");
+		goto free_graph;
+	}
+
+	for (unsigned int i = 0; i < graph->num_nodes; i++) {
+		if (graph->offsets[i] > graph->offsets[i + 1]) {
+			log_error("Corrupted binary graph offsets");
+			goto free_graph;
+		}
+	}
+
+	if (verify) {
+		uint64_t checksum = binary_checksum(CHECKSUM_SEED, payload, in->size - sizeof(*header));
+
+		if ((header->flags & OS_GRAPH_F_CHECKSUM) && checksum != header->checksum) {
+			log_error("Binary graph checksum mismatch");
+			goto free_graph;
+		}
+
+		for (size_t i = 0; i < 2 * (size_t)graph->num_edges; i++) {
+			if (graph->adj[i] >= graph->num_nodes) {
+				log_error("Binary graph neighbour %zu out of range", i);
+				goto free_graph;
+			}
+		}
+	}
+
+	// Values are used in place, like the adjacency
+	os_graph_alloc_nodes(graph, (int *)payload);
+
+	graph->backing = *in;
+	memset(in, 0, sizeof(*in));
+
+	return graph;
+
+free_graph:
+	destroy_graph(graph);
+	return NULL;
+}
+
+int write_graph_binary(os_graph_t *graph, FILE *file)
+{
+	os_graph_header_t header = {
+		.magic = OS_GRAPH_MAGIC,
+		.version = OS_GRAPH_VERSION,
+		.flags = OS_GRAPH_F_CHECKSUM | (graph->weights != NULL ? OS_GRAPH_F_WEIGHTS : 0),
+		.num_nodes = graph->num_nodes,
+		.num_edges = graph->num_edges,
+	};
+	size_t info_size = binary_info_size(graph->num_nodes);
+	size_t offsets_size = (graph->num_nodes + 1) * sizeof(*graph->offsets);
+	size_t adj_size = 2 * (size_t)graph->num_edges * sizeof(*graph->adj);
+	int32_t *info;
+	uint64_t checksum = CHECKSUM_SEED;
+
+	info = calloc(info_size / sizeof(*info) + 1, sizeof(*info));
+	DIE(info == NULL, "calloc");
+	memcpy(info, graph->info, graph->num_nodes * sizeof(*info));
+
+	checksum = binary_checksum(checksum, info, info_size);
+	checksum = binary_checksum(checksum, graph->offsets, offsets_size);
+	checksum = binary_checksum(checksum, graph->adj, adj_size);
+	if (graph->weights != NULL)
+		checksum = binary_checksum(checksum, graph->weights, adj_size);
+	header.checksum = checksum;
+
+	if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+	    fwrite(info, 1, info_size, file) != info_size ||
+	    fwrite(graph->offsets, 1, offsets_size, file) != offsets_size ||
+	    fwrite(graph->adj, 1, adj_size, file) != adj_size ||
+	    (graph->weights != NULL &&
+	     fwrite(graph->weights, 1, adj_size, file) != adj_size)) {
+		log_error("Can't write binary graph");
+		free(info);
+		return -1;
+	}
+
+	free(info);
+	return 0;
+}
+
+/*
+ * Parse a comma separated list of input node ids, such as "0,17,42", into
+ * a new array of *count nodes. Return NULL if the list is malformed or
+ * names a node that isn't in graph.
+ */
+unsigned int *parse_start_nodes(os_graph_t *graph, const char *list, unsigned int *count)
+{
+	unsigned int *nodes;
+	unsigned int n = 1;
+	const char *p = list;
+	char *end;
+
+	for (const char *c = list; *c != '\0'; c++)
+		n += (*c == ',');
+
+	nodes = malloc(n * sizeof(*nodes));
+	DIE(nodes == NULL, "malloc");
+
+	for (unsigned int i = 0; i < n; i++) {
+		unsigned long id;
+
+		errno = 0;
+		id = strtoul(p, &end, 10);
+		if (end == p || errno != 0 || (*end != ',' && *end != '\0')) {
+			log_error("Invalid start node list \"%s\"", list);
+			goto free_nodes;
+		}
+		if (id >= graph->num_nodes) {
+			log_error("Start node %lu out of range, graph has %u nodes",
+				id, graph->num_nodes);
+			goto free_nodes;
+		}
+		nodes[i] = os_graph_node_of(graph, id);
+		p = end + 1;
+	}
+
+	*count = n;
+	return nodes;
+
+free_nodes:
+	free(nodes);
+	return NULL;
+}
+
+/*
+ * Write one "node component sum" line per node, where component is the id
+ * of the smallest node in the component and sum is indexed by component.
+ * Lines and ids follow the input numbering, even after a reorder.
+ */
+int write_graph_components(os_graph_t *graph, const unsigned int *comp,
+		const long long *sum, FILE *file)
+{
+	unsigned int *name = NULL;
+	int rc = 0;
+
+	// Components are named after their smallest node, in input ids
+	if (graph->old_id != NULL) {
+		name = malloc(graph->num_nodes * sizeof(*name));
+		DIE(name == NULL && graph->num_nodes != 0, "malloc");
+		memset(name, 0xff, graph->num_nodes * sizeof(*name));
+		for (unsigned int v = 0; v < graph->num_nodes; v++)
+			if (graph->old_id[v] < name[comp[v]])
+				name[comp[v]] = graph->old_id[v];
+	}
+
+	for (unsigned int i = 0; i < graph->num_nodes && rc == 0; i++) {
+		unsigned int c = comp[os_graph_node_of(graph, i)];
+
+		if (fprintf(file, "%u %u %lld\n", i, name != NULL ? name[c] : c, sum[c]) < 0)
+			rc = -1;
+	}
+
+	free(name);
+	return rc;
+}
+
+/* Write one "node distance" line per reached node, in input order. */
+int write_graph_distances(os_graph_t *graph, const unsigned long long *dist, FILE *file)
+{
+	for (unsigned int i = 0; i < graph->num_nodes; i++) {
+		unsigned long long d = dist[os_graph_node_of(graph, i)];
+
+		if (d == OS_GRAPH_DIST_INF)
+			continue;
+		if (fprintf(file, "%u %llu\n", i, d) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Write one "node rank" line per node, in input order. */
+int write_graph_ranks(os_graph_t *graph, const double *rank, FILE *file)
+{
+	for (unsigned int i = 0; i < graph->num_nodes; i++)
+		if (fprintf(file, "%u %.10e\n", i, rank[os_graph_node_of(graph, i)]) < 0)
+			return -1;
+
+	return 0;
+}
+
+void print_load_stats(os_graph_t *graph)
+{
+	double mbytes = graph->load_bytes / 1e6;
+
+	log_info("Loaded %zu bytes in %.3f ms (%.1f MB/s)", graph->load_bytes,
+		graph->load_time * 1e3,
+		graph->load_time > 0 ? mbytes / graph->load_time : 0.0);
+}
+
 void print_graph(os_graph_t *graph)
 {
 	for (unsigned int i = 0; i < graph->num_nodes; i++) {
 		printf("[%d]: ", i);
-		for (unsigned int j = 0; j < graph->nodes[i]->num_neighbours; j++)
-			printf("%d ", graph->nodes[i]->neighbours[j]);
+		unsigned int *neighbours = os_graph_neighbours(graph, i);
+
+		for (unsigned int j = 0; j < os_graph_degree(graph, i); j++)
+			printf("%d ", neighbours[j]);
 		printf("\n");
 	}
 }
@@ -3,36 +3,241 @@
 #ifndef __OS_GRAPH_H__
 #define __OS_GRAPH_H__	1
 
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
-typedef struct os_node_t {
-	unsigned int id;
-	int info;
+#include "os_arena.h"
+#include "os_input.h"
 
-	unsigned int num_neighbours;
-	unsigned int *neighbours;
-} os_node_t;
+typedef enum os_visit_state_t {
+	NOT_VISITED = 0,
+	PROCESSING = 1,
+	DONE = 2
+} os_visit_state_t;
 
 typedef struct os_graph_t {
 	unsigned int num_nodes;
 	unsigned int num_edges;
 
-	os_node_t **nodes;
-	enum {
-		NOT_VISITED = 0,
-		PROCESSING = 1,
-		DONE = 2
-	} *visited;
+	/*
+	 * Nodes are stored as parallel arrays indexed by node id: info holds
+	 * their values and the degree of node i is offsets[i + 1] - offsets[i].
+	 */
+	int *info;
+
+	/*
+	 * Compressed sparse row adjacency.
+	 * Neighbours of node i are adj[offsets[i]] ... adj[offsets[i + 1] - 1],
+	 * so offsets has num_nodes + 1 entries and adj has 2 * num_edges.
+	 */
+	size_t *offsets;
+	unsigned int *adj;
+	/* Weight of the edge in the same slot of adj, NULL if all weigh 1. */
+	unsigned int *weights;
+
+	/*
+	 * Visit state of every node, claimed with a single CAS. After
+	 * os_graph_use_visited_bitset() it is NULL and visited_bits holds one
+	 * bit per node instead, set once the node is claimed; DONE is not
+	 * tracked in that case.
+	 */
+	_Atomic os_visit_state_t *visited;
+	_Atomic unsigned int *visited_bits;
+
+	/*
+	 * Set once nodes were relabelled by os_graph_reorder(): old_id maps
+	 * node ids to the ids of the input, new_id the other way round. Both
+	 * are NULL for graphs in input order.
+	 */
+	unsigned int *old_id;
+	unsigned int *new_id;
+
+	/* Input size and parse time of the last load, for throughput reports. */
+	size_t load_bytes;
+	double load_time;
+
+	/*
+	 * Input the graph arrays point into, for graphs loaded from the
+	 * binary format. Empty if the graph owns its arrays.
+	 */
+	os_input_t backing;
+
+	/*
+	 * Holds the graph itself, its nodes and the arrays it owns, all freed
+	 * at once by destroy_graph(). The visit state is allocated separately
+	 * since os_graph_use_visited_bitset() replaces it.
+	 */
+	os_arena_t arena;
 } os_graph_t;
 
+/*
+ * Binary graph format, in host byte order:
+ *   os_graph_header_t
+ *   int32_t  info[num_nodes]
+ *   padding up to a multiple of 8 bytes
+ *   uint64_t offsets[num_nodes + 1]
+ *   uint32_t adj[2 * num_edges]
+ *   uint32_t weights[2 * num_edges], only with OS_GRAPH_F_WEIGHTS
+ * The checksum covers everything after the header.
+ */
+#define OS_GRAPH_MAGIC		"OSGRAPH"
+#define OS_GRAPH_VERSION	1
+
+#define OS_GRAPH_F_CHECKSUM	(1u << 0)
+#define OS_GRAPH_F_WEIGHTS	(1u << 1)
+
+/* Distance of nodes that were not reached. */
+#define OS_GRAPH_DIST_INF	((unsigned long long)-1)
+
+typedef struct os_graph_header_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint64_t num_nodes;
+	uint64_t num_edges;
+	uint64_t checksum;
+} os_graph_header_t;
+
 typedef struct os_edge_t {
 	unsigned int src, dst;
+	/* Only read for weighted graphs. */
+	unsigned int weight;
 } os_edge_t;
 
-os_node_t *os_create_node(unsigned int id, int info);
+static inline int os_graph_info(const os_graph_t *graph, unsigned int idx)
+{
+	return graph->info[idx];
+}
+
+/*
+ * Sum of the values of nodes [first, last). A plain loop over contiguous
+ * ints, which compilers turn into SIMD adds from -O3 on.
+ */
+static inline long long os_graph_info_sum(const os_graph_t *graph, unsigned int first,
+		unsigned int last)
+{
+	const int *info = graph->info;
+	long long sum = 0;
+
+	for (unsigned int i = first; i < last; i++)
+		sum += info[i];
+
+	return sum;
+}
+
+static inline unsigned int os_graph_degree(const os_graph_t *graph, unsigned int idx)
+{
+	return graph->offsets[idx + 1] - graph->offsets[idx];
+}
+
+static inline unsigned int *os_graph_neighbours(const os_graph_t *graph, unsigned int idx)
+{
+	return graph->adj + graph->offsets[idx];
+}
+
+/* Weights of the edges to os_graph_neighbours(), NULL if they all weigh 1. */
+static inline unsigned int *os_graph_weights(const os_graph_t *graph, unsigned int idx)
+{
+	return graph->weights != NULL ? graph->weights + graph->offsets[idx] : NULL;
+}
+
+/* Node holding the node of the input numbered id. */
+static inline unsigned int os_graph_node_of(const os_graph_t *graph, unsigned int id)
+{
+	return graph->new_id != NULL ? graph->new_id[id] : id;
+}
+
+/* Id in the input of node idx, which is what output should show. */
+static inline unsigned int os_graph_input_id(const os_graph_t *graph, unsigned int idx)
+{
+	return graph->old_id != NULL ? graph->old_id[idx] : idx;
+}
+
+#define OS_VISITED_BITS		(8 * sizeof(unsigned int))
+
+static inline int os_graph_is_visited(os_graph_t *graph, unsigned int idx)
+{
+	if (graph->visited_bits != NULL)
+		return (atomic_load_explicit(&graph->visited_bits[idx / OS_VISITED_BITS],
+					memory_order_relaxed) >> (idx % OS_VISITED_BITS)) & 1;
+
+	return atomic_load_explicit(&graph->visited[idx], memory_order_relaxed) != NOT_VISITED;
+}
+
+/*
+ * Atomically move a node from NOT_VISITED to PROCESSING.
+ * Return 1 if the calling thread claimed the node, 0 if it was already taken.
+ */
+static inline int os_graph_try_visit(os_graph_t *graph, unsigned int idx)
+{
+	os_visit_state_t expected = NOT_VISITED;
+
+	if (graph->visited_bits != NULL) {
+		unsigned int mask = 1u << (idx % OS_VISITED_BITS);
+
+		return !(atomic_fetch_or_explicit(&graph->visited_bits[idx / OS_VISITED_BITS],
+					mask, memory_order_relaxed) & mask);
+	}
+
+	// Cheap read first, so that already visited nodes don't bounce the line
+	if (atomic_load_explicit(&graph->visited[idx], memory_order_relaxed) != NOT_VISITED)
+		return 0;
+
+	return atomic_compare_exchange_strong_explicit(&graph->visited[idx], &expected,
+			PROCESSING, memory_order_relaxed, memory_order_relaxed);
+}
+
+_Static_assert(ATOMIC_INT_LOCK_FREE == 2 &&
+		sizeof(_Atomic os_visit_state_t) == sizeof(int) &&
+		_Alignof(_Atomic os_visit_state_t) == _Alignof(int),
+		"visit states must be laid out as ints");
+
+/*
+ * Visit states as an int array, for the bulk kernels of os_simd.h, NULL if
+ * they are tracked in a bitset. A lock-free atomic int is a plain int in
+ * memory, which the kernels read without synchronization.
+ */
+static inline const int *os_graph_visit_states(const os_graph_t *graph)
+{
+	return (const int *)graph->visited;
+}
+
+static inline void os_graph_mark_done(os_graph_t *graph, unsigned int idx)
+{
+	if (graph->visited != NULL)
+		atomic_store_explicit(&graph->visited[idx], DONE, memory_order_relaxed);
+}
+
+os_graph_t *os_graph_alloc(unsigned int num_nodes, unsigned int num_edges);
+void os_graph_alloc_nodes(os_graph_t *graph, int *info);
 os_graph_t *create_graph_from_data(unsigned int num_nodes, unsigned int num_edges,
-		int *values, os_edge_t *edges);
+		int *values, os_edge_t *edges, int weighted);
+int *parse_graph_nodes(os_scanner_t *sc, unsigned int *num_nodes, unsigned int *num_edges,
+		int *weighted);
+os_graph_t *create_graph_from_buffer(const char *data, size_t size);
 os_graph_t *create_graph_from_file(FILE *file);
+void destroy_graph(os_graph_t *graph);
+void os_graph_use_visited_bitset(os_graph_t *graph);
+void os_graph_reset_visited(os_graph_t *graph);
+
+int is_graph_binary(const char *data, size_t size);
+os_graph_t *create_graph_from_binary(os_input_t *in, int verify);
+int write_graph_binary(os_graph_t *graph, FILE *file);
+
+/* Multi-threaded loaders, implemented on top of the threadpool. */
+struct os_threadpool;
+
+os_graph_t *create_graph_from_data_parallel(unsigned int num_nodes, unsigned int num_edges,
+		int *values, os_edge_t *edges, int weighted, struct os_threadpool *tp);
+os_graph_t *create_graph_from_file_parallel(FILE *file, struct os_threadpool *tp);
 void print_graph(os_graph_t *graph);
+unsigned int *parse_start_nodes(os_graph_t *graph, const char *list, unsigned int *count);
+int write_graph_components(os_graph_t *graph, const unsigned int *comp,
+		const long long *sum, FILE *file);
+int write_graph_distances(os_graph_t *graph, const unsigned long long *dist, FILE *file);
+int write_graph_ranks(os_graph_t *graph, const double *rank, FILE *file);
+void print_load_stats(os_graph_t *graph);
 
 #endif
@@ -0,0 +1,523 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Multi-threaded graph ingestion.
+ *
+ * The edge section of the input is split into newline aligned chunks that
+ * are parsed on the threadpool workers. Node degrees are counted per chunk,
+ * turned into CSR offsets with a blocked prefix sum, and edges are then
+ * scattered into the adjacency array through per-node cursors.
+ *
+ * When a degree histogram per chunk fits in about the size of the adjacency
+ * array, every chunk gets private, prefix-summed cursors: no atomics are
+ * needed and neighbours end up in input order, exactly as with the serial
+ * loader. Otherwise all chunks share one histogram updated with atomic
+ * increments; scatter order then depends on scheduling, so every neighbour
+ * list is sorted at the end to make the result deterministic. Edge weights,
+ * if any, travel along with their neighbour.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "os_graph.h"
+#include "os_input.h"
+#include "os_threadpool.h"
+#include "os_time.h"
+#include "log/log.h"
+#include "utils.h"
+
+/* Inputs smaller than this are parsed by the serial loader. */
+#define PARALLEL_MIN_BYTES	(1024 * 1024)
+/* Work items created for every worker, to even out load imbalance. */
+#define CHUNKS_PER_THREAD	4
+/* Neighbour lists up to this length are sorted by insertion sort. */
+#define INSERTION_SORT_MAX	16
+/* Weighted neighbour lists up to this length are sorted without malloc(). */
+#define WEIGHTED_SORT_LOCAL	256
+
+typedef struct ingest_ctx {
+	os_graph_t *graph;
+	int *values;
+	int weighted;
+	size_t *block_sums;
+
+	/* Per-chunk histograms, num_chunks rows of num_nodes, or NULL. */
+	unsigned int *hist;
+	unsigned int num_chunks;
+	/* Shared histogram, used when hist is NULL. */
+	_Atomic unsigned int *degree;
+} ingest_ctx_t;
+
+/* Slice of the edge list, either parsed from text or borrowed from the caller. */
+typedef struct edge_chunk {
+	ingest_ctx_t *ctx;
+	const char *begin, *end;
+	os_edge_t *edges;
+	unsigned int num_edges;
+	unsigned int *cursor;
+	int error;
+} edge_chunk_t;
+
+/* Range of node ids [first, last). */
+typedef struct node_range {
+	ingest_ctx_t *ctx;
+	unsigned int index;
+	unsigned int first, last;
+} node_range_t;
+
+static int count_edges(edge_chunk_t *chunk)
+{
+	unsigned int num_nodes = chunk->ctx->graph->num_nodes;
+	unsigned int *hist = chunk->cursor;
+
+	for (unsigned int i = 0; i < chunk->num_edges; i++) {
+		os_edge_t *e = &chunk->edges[i];
+
+		if (e->src >= num_nodes || e->dst >= num_nodes)
+			return -1;
+		if (hist != NULL) {
+			hist[e->src]++;
+			hist[e->dst]++;
+		} else {
+			atomic_fetch_add_explicit(&chunk->ctx->degree[e->src], 1, memory_order_relaxed);
+			atomic_fetch_add_explicit(&chunk->ctx->degree[e->dst], 1, memory_order_relaxed);
+		}
+	}
+
+	return 0;
+}
+
+static void parse_and_count(void *arg)
+{
+	edge_chunk_t *chunk = arg;
+	os_scanner_t sc;
+	size_t capacity;
+
+	// Every edge line takes at least four bytes ("0 0\n")
+	capacity = (chunk->end - chunk->begin) / 4 + 1;
+	chunk->edges = malloc(capacity * sizeof(*chunk->edges));
+	DIE(chunk->edges == NULL, "malloc");
+
+	os_scan_init(&sc, chunk->begin, chunk->end - chunk->begin);
+	while (1) {
+		os_edge_t *e = &chunk->edges[chunk->num_edges];
+
+		os_scan_skip_space(&sc);
+		if (sc.pos == sc.end)
+			break;
+		if (chunk->num_edges == capacity ||
+		    os_scan_uint(&sc, &e->src) < 0 || os_scan_uint(&sc, &e->dst) < 0 ||
+		    (chunk->ctx->weighted && os_scan_uint(&sc, &e->weight) < 0)) {
+			chunk->error = 1;
+			return;
+		}
+		chunk->num_edges++;
+	}
+
+	if (count_edges(chunk) < 0)
+		chunk->error = 1;
+}
+
+static void count_only(void *arg)
+{
+	edge_chunk_t *chunk = arg;
+
+	if (count_edges(chunk) < 0)
+		chunk->error = 1;
+}
+
+static unsigned int node_degree(ingest_ctx_t *ctx, unsigned int idx)
+{
+	unsigned int num_nodes = ctx->graph->num_nodes;
+	unsigned int degree = 0;
+
+	if (ctx->hist == NULL)
+		return atomic_load_explicit(&ctx->degree[idx], memory_order_relaxed);
+
+	for (unsigned int c = 0; c < ctx->num_chunks; c++)
+		degree += ctx->hist[(size_t)c * num_nodes + idx];
+	return degree;
+}
+
+static void sum_degrees(void *arg)
+{
+	node_range_t *range = arg;
+	size_t sum = 0;
+
+	for (unsigned int i = range->first; i < range->last; i++)
+		sum += node_degree(range->ctx, i);
+	range->ctx->block_sums[range->index] = sum;
+}
+
+/*
+ * Write offsets for the range and turn the histograms into cursors: the
+ * private cursor of a chunk starts after the slots of all previous chunks,
+ * the shared one is reset to zero.
+ */
+static void write_offsets(void *arg)
+{
+	node_range_t *range = arg;
+	ingest_ctx_t *ctx = range->ctx;
+	unsigned int num_nodes = ctx->graph->num_nodes;
+	size_t offset = ctx->block_sums[range->index];
+
+	for (unsigned int i = range->first; i < range->last; i++) {
+		ctx->graph->offsets[i] = offset;
+
+		if (ctx->hist == NULL) {
+			offset += atomic_load_explicit(&ctx->degree[i], memory_order_relaxed);
+			atomic_store_explicit(&ctx->degree[i], 0, memory_order_relaxed);
+			continue;
+		}
+
+		for (unsigned int c = 0; c < ctx->num_chunks; c++) {
+			unsigned int *slot = &ctx->hist[(size_t)c * num_nodes + i];
+			unsigned int count = *slot;
+
+			*slot = offset - ctx->graph->offsets[i];
+			offset += count;
+		}
+	}
+}
+
+static void scatter_edges(void *arg)
+{
+	edge_chunk_t *chunk = arg;
+	os_graph_t *graph = chunk->ctx->graph;
+	unsigned int *adj = graph->adj;
+	unsigned int *weights = graph->weights;
+	size_t *offsets = graph->offsets;
+	unsigned int *cursor = chunk->cursor;
+	_Atomic unsigned int *shared = chunk->ctx->degree;
+
+	for (unsigned int i = 0; i < chunk->num_edges; i++) {
+		unsigned int src = chunk->edges[i].src;
+		unsigned int dst = chunk->edges[i].dst;
+		size_t s, d;
+
+		if (cursor != NULL) {
+			s = offsets[src] + cursor[src]++;
+			d = offsets[dst] + cursor[dst]++;
+		} else {
+			s = offsets[src] +
+				atomic_fetch_add_explicit(&shared[src], 1, memory_order_relaxed);
+			d = offsets[dst] +
+				atomic_fetch_add_explicit(&shared[dst], 1, memory_order_relaxed);
+		}
+
+		adj[s] = dst;
+		adj[d] = src;
+		if (weights != NULL) {
+			weights[s] = chunk->edges[i].weight;
+			weights[d] = chunk->edges[i].weight;
+		}
+	}
+}
+
+static void insertion_sort(unsigned int *v, size_t n)
+{
+	for (size_t i = 1; i < n; i++) {
+		unsigned int key = v[i];
+		size_t j = i;
+
+		for (; j > 0 && v[j - 1] > key; j--)
+			v[j] = v[j - 1];
+		v[j] = key;
+	}
+}
+
+/*
+ * Quicksort specialised for node ids, much cheaper than qsort() with a
+ * comparison callback. Recurse on the smaller side to bound stack depth.
+ */
+static void sort_neighbours(unsigned int *v, size_t n)
+{
+	while (n > INSERTION_SORT_MAX) {
+		unsigned int a = v[0], b = v[n / 2], c = v[n - 1], pivot, tmp;
+		size_t i = 0, j = n - 1;
+
+		pivot = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+		while (1) {
+			while (v[i] < pivot)
+				i++;
+			while (v[j] > pivot)
+				j--;
+			if (i >= j)
+				break;
+			tmp = v[i];
+			v[i++] = v[j];
+			v[j--] = tmp;
+		}
+
+		if (j + 1 < n - j - 1) {
+			sort_neighbours(v, j + 1);
+			v += j + 1;
+			n -= j + 1;
+		} else {
+			sort_neighbours(v + j + 1, n - j - 1);
+			n = j + 1;
+		}
+	}
+
+	insertion_sort(v, n);
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Sort the neighbours of a node by id, then weight, through keys packing
+ * both, so that parallel edges come out in a fixed order too.
+ */
+static void sort_weighted_neighbours(unsigned int *v, unsigned int *w, size_t n)
+{
+	unsigned long long local[WEIGHTED_SORT_LOCAL];
+	unsigned long long *keys = local;
+
+	if (n < 2)
+		return;
+
+	if (n > WEIGHTED_SORT_LOCAL) {
+		keys = malloc(n * sizeof(*keys));
+		DIE(keys == NULL, "malloc");
+	}
+
+	for (size_t i = 0; i < n; i++)
+		keys[i] = (unsigned long long)v[i] << 32 | w[i];
+	qsort(keys, n, sizeof(*keys), &compare_keys);
+	for (size_t i = 0; i < n; i++) {
+		v[i] = keys[i] >> 32;
+		w[i] = (unsigned int)keys[i];
+	}
+
+	if (keys != local)
+		free(keys);
+}
+
+static void finish_nodes(void *arg)
+{
+	node_range_t *range = arg;
+	os_graph_t *graph = range->ctx->graph;
+
+	for (unsigned int i = range->first; i < range->last; i++) {
+		if (range->ctx->hist == NULL && graph->weights != NULL)
+			sort_weighted_neighbours(os_graph_neighbours(graph, i),
+					os_graph_weights(graph, i), os_graph_degree(graph, i));
+		else if (range->ctx->hist == NULL)
+			sort_neighbours(os_graph_neighbours(graph, i), os_graph_degree(graph, i));
+
+		graph->info[i] = range->ctx->values[i];
+	}
+}
+
+static node_range_t *split_nodes(ingest_ctx_t *ctx, unsigned int count)
+{
+	unsigned int num_nodes = ctx->graph->num_nodes;
+	node_range_t *ranges;
+
+	ranges = malloc(count * sizeof(*ranges));
+	DIE(ranges == NULL, "malloc");
+
+	for (unsigned int i = 0; i < count; i++) {
+		ranges[i].ctx = ctx;
+		ranges[i].index = i;
+		ranges[i].first = (unsigned long long)num_nodes * i / count;
+		ranges[i].last = (unsigned long long)num_nodes * (i + 1) / count;
+	}
+
+	return ranges;
+}
+
+/*
+ * Build the CSR graph from edge chunks whose edges are already available
+ * (count_action == count_only) or still have to be parsed.
+ * Return NULL if any chunk fails.
+ */
+static os_graph_t *build_graph(unsigned int num_nodes, unsigned int num_edges, int *values,
+		int weighted, edge_chunk_t *chunks, unsigned int num_chunks,
+		void (*count_action)(void *), os_threadpool_t *tp)
+{
+	ingest_ctx_t ctx = { .values = values, .weighted = weighted, .num_chunks = num_chunks };
+	unsigned int num_ranges = tp->num_threads * CHUNKS_PER_THREAD;
+	node_range_t *ranges;
+	size_t total;
+	unsigned long long parsed = 0;
+	os_graph_t *graph;
+
+	graph = os_graph_alloc(num_nodes, num_edges);
+	ctx.graph = graph;
+
+	if ((size_t)num_chunks * num_nodes <= 2 * (size_t)num_edges) {
+		ctx.hist = calloc((size_t)num_chunks * num_nodes, sizeof(*ctx.hist));
+		DIE(ctx.hist == NULL && num_nodes != 0, "calloc");
+	} else {
+		ctx.degree = calloc(num_nodes + 1, sizeof(*ctx.degree));
+		DIE(ctx.degree == NULL, "calloc");
+	}
+
+	for (unsigned int i = 0; i < num_chunks; i++) {
+		chunks[i].ctx = &ctx;
+		chunks[i].cursor = ctx.hist ? ctx.hist + (size_t)i * num_nodes : NULL;
+	}
+	run_parallel(tp, count_action, chunks, sizeof(*chunks), num_chunks);
+
+	for (unsigned int i = 0; i < num_chunks; i++) {
+		if (chunks[i].error)
+			goto fail;
+		parsed += chunks[i].num_edges;
+	}
+
+	if (parsed != num_edges)
+		goto fail;
+
+	// Blocked exclusive prefix sum of the degrees
+	graph->offsets = os_arena_alloc(&graph->arena, (num_nodes + 1) * sizeof(*graph->offsets));
+	ctx.block_sums = malloc(num_ranges * sizeof(*ctx.block_sums));
+	DIE(ctx.block_sums == NULL, "malloc");
+
+	ranges = split_nodes(&ctx, num_ranges);
+	run_parallel(tp, &sum_degrees, ranges, sizeof(*ranges), num_ranges);
+	total = 0;
+	for (unsigned int i = 0; i < num_ranges; i++) {
+		size_t block = ctx.block_sums[i];
+
+		ctx.block_sums[i] = total;
+		total += block;
+	}
+	graph->offsets[num_nodes] = total;
+	run_parallel(tp, &write_offsets, ranges, sizeof(*ranges), num_ranges);
+
+	graph->adj = os_arena_alloc(&graph->arena, total * sizeof(*graph->adj));
+	if (weighted)
+		graph->weights = os_arena_alloc(&graph->arena, total * sizeof(*graph->weights));
+	run_parallel(tp, &scatter_edges, chunks, sizeof(*chunks), num_chunks);
+
+	os_graph_alloc_nodes(graph, NULL);
+	run_parallel(tp, &finish_nodes, ranges, sizeof(*ranges), num_ranges);
+
+	free(ranges);
+	free(ctx.block_sums);
+	free(ctx.hist);
+	free(ctx.degree);
+
+	return graph;
+
+fail:
+	free(ctx.hist);
+	free(ctx.degree);
+	destroy_graph(graph);
+	return NULL;
+}
+
+os_graph_t *create_graph_from_data_parallel(unsigned int num_nodes, unsigned int num_edges,
+		int *values, os_edge_t *edges, int weighted, os_threadpool_t *tp)
+{
+	unsigned int num_chunks = tp->num_threads * CHUNKS_PER_THREAD;
+	edge_chunk_t *chunks;
+	os_graph_t *graph;
+
+	chunks = calloc(num_chunks, sizeof(*chunks));
+	DIE(chunks == NULL, "calloc");
+
+	for (unsigned int i = 0; i < num_chunks; i++) {
+		unsigned int first = (unsigned long long)num_edges * i / num_chunks;
+		unsigned int last = (unsigned long long)num_edges * (i + 1) / num_chunks;
+
+		chunks[i].edges = edges + first;
+		chunks[i].num_edges = last - first;
+	}
+
+	graph = build_graph(num_nodes, num_edges, values, weighted, chunks, num_chunks,
+			&count_only, tp);
+	if (graph == NULL)
+		log_error("Edge out of range");
+
+	free(chunks);
+
+	return graph;
+}
+
+/* Move p forward to the start of the next line. */
+static const char *next_line(const char *p, const char *end)
+{
+	while (p < end && *p != '\n')
+		p++;
+	return p < end ? p + 1 : end;
+}
+
+os_graph_t *create_graph_from_file_parallel(FILE *file, os_threadpool_t *tp)
+{
+	os_input_t in;
+	os_scanner_t sc;
+	unsigned int num_nodes, num_edges, num_chunks;
+	edge_chunk_t *chunks;
+	os_graph_t *graph = NULL;
+	const char *p;
+	size_t size, length;
+	int *values, weighted;
+	double start = os_time_seconds();
+
+	if (os_input_open(file, &in) < 0)
+		return NULL;
+	size = in.size;
+
+	if (is_graph_binary(in.data, in.size)) {
+		graph = create_graph_from_binary(&in, getenv("OS_GRAPH_VERIFY") != NULL);
+		goto out;
+	}
+
+	if (in.size < PARALLEL_MIN_BYTES || tp->num_threads < 2) {
+		graph = create_graph_from_buffer(in.data, in.size);
+		goto out;
+	}
+
+	os_scan_init(&sc, in.data, in.size);
+	values = parse_graph_nodes(&sc, &num_nodes, &num_edges, &weighted);
+	if (values == NULL)
+		goto close;
+
+	length = sc.end - sc.pos;
+	num_chunks = tp->num_threads * CHUNKS_PER_THREAD;
+	chunks = calloc(num_chunks, sizeof(*chunks));
+	DIE(chunks == NULL, "calloc");
+
+	p = sc.pos;
+	for (unsigned int i = 0; i < num_chunks; i++) {
+		chunks[i].begin = p;
+		if (i == num_chunks - 1)
+			p = sc.end;
+		else if (p < sc.pos + length * (i + 1) / num_chunks)
+			p = next_line(sc.pos + length * (i + 1) / num_chunks, sc.end);
+		chunks[i].end = p;
+	}
+
+	graph = build_graph(num_nodes, num_edges, values, weighted, chunks, num_chunks,
+			&parse_and_count, tp);
+
+	for (unsigned int i = 0; i < num_chunks; i++)
+		free(chunks[i].edges);
+	free(chunks);
+	free(values);
+
+	// Edges that don't sit one per line can't be chunked; let the serial
+	// parser handle them and report errors at the right byte offset.
+	if (graph == NULL)
+		graph = create_graph_from_buffer(in.data, in.size);
+
+out:
+	if (graph != NULL) {
+		graph->load_bytes = size;
+		graph->load_time = os_time_seconds() - start;
+	}
+close:
+	os_input_close(&in);
+
+	return graph;
+}
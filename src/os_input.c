@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "os_input.h"
+#include "log/log.h"
+#include "utils.h"
+
+#define READ_CHUNK	(1 << 16)
+
+/* Map the rest of a regular file. Return -1 if the file can't be mapped. */
+static int input_map(FILE *file, os_input_t *in)
+{
+	struct stat st;
+	off_t pos;
+	int fd = fileno(file);
+
+	if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return -1;
+
+	pos = ftello(file);
+	if (pos < 0 || pos > st.st_size)
+		return -1;
+
+	in->size = st.st_size - pos;
+	if (st.st_size == 0) {
+		in->data = "";
+		return 0;
+	}
+
+	in->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (in->map == MAP_FAILED) {
+		in->map = NULL;
+		return -1;
+	}
+	in->map_size = st.st_size;
+	madvise(in->map, in->map_size, MADV_SEQUENTIAL);
+
+	in->data = (const char *)in->map + pos;
+	return 0;
+}
+
+/* Slurp a stream that can't be mapped into a growing heap buffer. */
+static int input_read(FILE *file, os_input_t *in)
+{
+	size_t capacity = READ_CHUNK, n;
+
+	in->heap = malloc(capacity);
+	DIE(in->heap == NULL, "malloc");
+
+	while ((n = fread(in->heap + in->size, 1, capacity - in->size, file)) > 0) {
+		in->size += n;
+		if (in->size == capacity) {
+			capacity *= 2;
+			in->heap = realloc(in->heap, capacity);
+			DIE(in->heap == NULL, "realloc");
+		}
+	}
+
+	if (ferror(file)) {
+		log_error("Can't read from file");
+		free(in->heap);
+		in->heap = NULL;
+		return -1;
+	}
+
+	in->data = in->heap;
+	return 0;
+}
+
+int os_input_open(FILE *file, os_input_t *in)
+{
+	memset(in, 0, sizeof(*in));
+
+	if (input_map(file, in) == 0)
+		return 0;
+
+	in->size = 0;
+	return input_read(file, in);
+}
+
+void os_input_close(os_input_t *in)
+{
+	if (in->map != NULL)
+		munmap(in->map, in->map_size);
+	free(in->heap);
+	memset(in, 0, sizeof(*in));
+}
@@ -0,0 +1,129 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __OS_INPUT_H__
+#define __OS_INPUT_H__	1
+
+#include <stddef.h>
+#include <stdio.h>
+#include <limits.h>
+
+/*
+ * Read-only view of a whole input stream.
+ * Regular files are mmap()ed, anything else (pipes, terminals) is read
+ * into a heap buffer.
+ */
+typedef struct os_input_t {
+	const char *data;
+	size_t size;
+
+	void *map;
+	size_t map_size;
+	char *heap;
+} os_input_t;
+
+int os_input_open(FILE *file, os_input_t *in);
+void os_input_close(os_input_t *in);
+
+/* Cursor used to parse whitespace separated integers from an input. */
+typedef struct os_scanner_t {
+	const char *start;
+	const char *pos;
+	const char *end;
+} os_scanner_t;
+
+static inline void os_scan_init(os_scanner_t *sc, const char *data, size_t size)
+{
+	sc->start = data;
+	sc->pos = data;
+	sc->end = data + size;
+}
+
+/* Byte offset of the cursor, for error messages. */
+static inline size_t os_scan_offset(const os_scanner_t *sc)
+{
+	return sc->pos - sc->start;
+}
+
+static inline int os_scan_is_space(char c)
+{
+	return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static inline void os_scan_skip_space(os_scanner_t *sc)
+{
+	while (sc->pos < sc->end && os_scan_is_space(*sc->pos))
+		sc->pos++;
+}
+
+/*
+ * Parse the next integer, with an optional sign, into value.
+ * The number must be followed by whitespace or by the end of the input.
+ * Return 0 on success, -1 on end of input, malformed input or if the
+ * value is outside [min, max].
+ */
+static inline int os_scan_long(os_scanner_t *sc, long long min, long long max,
+		long long *value)
+{
+	const char *p;
+	unsigned long long acc = 0, limit;
+	int negative = 0;
+
+	os_scan_skip_space(sc);
+	p = sc->pos;
+	if (p == sc->end)
+		return -1;
+
+	if (*p == '-' || *p == '+') {
+		negative = (*p == '-');
+		p++;
+	}
+
+	limit = negative ? (unsigned long long)LLONG_MAX + 1 : LLONG_MAX;
+	if (p == sc->end || (unsigned char)(*p - '0') > 9)
+		return -1;
+
+	do {
+		unsigned int digit = *p - '0';
+
+		if (acc > (limit - digit) / 10)
+			return -1;
+		acc = acc * 10 + digit;
+		p++;
+	} while (p < sc->end && (unsigned char)(*p - '0') <= 9);
+
+	if (p < sc->end && !os_scan_is_space(*p))
+		return -1;
+
+	if (negative)
+		*value = acc == limit ? LLONG_MIN : -(long long)acc;
+	else
+		*value = (long long)acc;
+
+	if (*value < min || *value > max)
+		return -1;
+
+	sc->pos = p;
+	return 0;
+}
+
+static inline int os_scan_int(os_scanner_t *sc, int *value)
+{
+	long long v;
+
+	if (os_scan_long(sc, INT_MIN, INT_MAX, &v) < 0)
+		return -1;
+	*value = (int)v;
+	return 0;
+}
+
+static inline int os_scan_uint(os_scanner_t *sc, unsigned int *value)
+{
+	long long v;
+
+	if (os_scan_long(sc, 0, UINT_MAX, &v) < 0)
+		return -1;
+	*value = (unsigned int)v;
+	return 0;
+}
+
+#endif
@@ -0,0 +1,88 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Pull-based PageRank over the threadpool.
+ *
+ * Every node sums the contributions (rank over degree) of its neighbours
+ * from the previous iteration, so each one only writes its own entries
+ * and no atomics are needed. Iterations are run as one job of contiguous
+ * node blocks; their partial sums are reduced in block order afterwards,
+ * which keeps the result independent of the number of threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "os_pagerank.h"
+#include "os_threadpool.h"
+#include "log/log.h"
+#include "utils.h"
+
+typedef struct pagerank_block {
+	os_graph_t *graph;
+	os_pagerank_state_t *state;
+	unsigned int first, last;
+	double error;
+	double dangling;
+} pagerank_block_t;
+
+static void run_block(void *arg)
+{
+	pagerank_block_t *block = arg;
+
+	block->error = os_pagerank_block(block->graph, block->state,
+			block->first, block->last, &block->dangling);
+}
+
+void os_pagerank(os_graph_t *graph, const os_pagerank_params_t *params,
+		os_threadpool_t *tp, os_pagerank_result_t *result)
+{
+	unsigned int n = graph->num_nodes;
+	unsigned int num_blocks = (n + OS_PAGERANK_BLOCK - 1) / OS_PAGERANK_BLOCK;
+	os_pagerank_state_t st;
+	pagerank_block_t *blocks;
+	double dangling, error = 0;
+	unsigned int it;
+
+	dangling = os_pagerank_init(graph, &st, params->damping);
+
+	blocks = malloc((num_blocks + 1) * sizeof(*blocks));
+	DIE(blocks == NULL, "malloc");
+	for (unsigned int i = 0; i < num_blocks; i++) {
+		blocks[i].graph = graph;
+		blocks[i].state = &st;
+		blocks[i].first = i * OS_PAGERANK_BLOCK;
+		blocks[i].last = i == num_blocks - 1 ? n : (i + 1) * OS_PAGERANK_BLOCK;
+	}
+
+	for (it = 0; it < params->max_iterations && n != 0; ) {
+		os_pagerank_set_base(&st, n, dangling);
+		run_parallel(tp, &run_block, blocks, sizeof(*blocks), num_blocks);
+
+		error = 0;
+		dangling = 0;
+		for (unsigned int i = 0; i < num_blocks; i++) {
+			error += blocks[i].error;
+			dangling += blocks[i].dangling;
+		}
+		st.cur ^= 1;
+		it++;
+
+		if (error < params->tolerance)
+			break;
+	}
+
+	result->rank = st.rank[st.cur];
+	result->iterations = it;
+	result->error = error;
+
+	free(st.rank[st.cur ^ 1]);
+	free(st.contrib[0]);
+	free(st.contrib[1]);
+	free(blocks);
+}
+
+void os_pagerank_result_destroy(os_pagerank_result_t *result)
+{
+	free(result->rank);
+}
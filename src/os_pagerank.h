@@ -0,0 +1,143 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __OS_PAGERANK_H__
+#define __OS_PAGERANK_H__	1
+
+#include <stdlib.h>
+
+#include "os_graph.h"
+#include "utils.h"
+
+#define OS_PAGERANK_DAMPING		0.85
+/* Stop once the ranks moved by less than this in total (L1 norm). */
+#define OS_PAGERANK_TOLERANCE		1e-6
+#define OS_PAGERANK_MAX_ITERATIONS	100
+
+/*
+ * Nodes per block. Partial sums are reduced block by block in a fixed
+ * order, so ranks don't depend on how blocks are spread over threads.
+ */
+#define OS_PAGERANK_BLOCK		4096
+
+typedef struct os_pagerank_params_t {
+	double damping;
+	double tolerance;
+	unsigned int max_iterations;
+} os_pagerank_params_t;
+
+/*
+ * Double-buffered ranks: an iteration reads rank[cur] and contrib[cur],
+ * the rank divided by the degree, and writes the other pair.
+ */
+typedef struct os_pagerank_state_t {
+	double *rank[2];
+	double *contrib[2];
+	unsigned int cur;
+	double damping;
+	/* Rank every node gets before its neighbours' share. */
+	double base;
+} os_pagerank_state_t;
+
+typedef struct os_pagerank_result_t {
+	/* Per node, summing to 1. */
+	double *rank;
+	unsigned int iterations;
+	double error;
+} os_pagerank_result_t;
+
+/*
+ * One pull iteration over nodes [first, last). Return the L1 change and,
+ * in *dangling, the rank of nodes without neighbours, which is spread
+ * evenly over all nodes in the next iteration.
+ */
+static inline double os_pagerank_block(const os_graph_t *graph, const os_pagerank_state_t *st,
+		unsigned int first, unsigned int last, double *dangling)
+{
+	const double *rank = st->rank[st->cur];
+	const double *contrib = st->contrib[st->cur];
+	double *rank_next = st->rank[st->cur ^ 1];
+	double *contrib_next = st->contrib[st->cur ^ 1];
+	double error = 0, lost = 0;
+
+	for (unsigned int v = first; v < last; v++) {
+		const unsigned int *neighbours = os_graph_neighbours(graph, v);
+		unsigned int degree = os_graph_degree(graph, v);
+		double acc[4] = { 0, 0, 0, 0 };
+		double r, diff;
+		unsigned int i = 0;
+
+		// Independent lanes, so that gathers and adds can overlap
+		for (; i + 4 <= degree; i += 4) {
+			acc[0] += contrib[neighbours[i]];
+			acc[1] += contrib[neighbours[i + 1]];
+			acc[2] += contrib[neighbours[i + 2]];
+			acc[3] += contrib[neighbours[i + 3]];
+		}
+		for (; i < degree; i++)
+			acc[0] += contrib[neighbours[i]];
+
+		r = st->base + st->damping * ((acc[0] + acc[1]) + (acc[2] + acc[3]));
+		diff = r - rank[v];
+		error += diff < 0 ? -diff : diff;
+
+		rank_next[v] = r;
+		if (degree != 0) {
+			contrib_next[v] = r / degree;
+		} else {
+			contrib_next[v] = 0;
+			lost += r;
+		}
+	}
+
+	*dangling = lost;
+	return error;
+}
+
+/*
+ * Allocate the buffers of st and start from a uniform distribution. Return
+ * the rank held by nodes without neighbours.
+ */
+static inline double os_pagerank_init(const os_graph_t *graph, os_pagerank_state_t *st,
+		double damping)
+{
+	unsigned int n = graph->num_nodes;
+	double lost = 0;
+
+	for (unsigned int i = 0; i < 2; i++) {
+		st->rank[i] = malloc((n + 1) * sizeof(*st->rank[i]));
+		st->contrib[i] = malloc((n + 1) * sizeof(*st->contrib[i]));
+		DIE(st->rank[i] == NULL || st->contrib[i] == NULL, "malloc");
+	}
+	st->cur = 0;
+	st->damping = damping;
+
+	for (unsigned int v = 0; v < n; v++) {
+		unsigned int degree = os_graph_degree(graph, v);
+
+		st->rank[0][v] = 1.0 / n;
+		st->contrib[0][v] = degree != 0 ? st->rank[0][v] / degree : 0;
+		if (degree == 0)
+			lost += st->rank[0][v];
+	}
+
+	return lost;
+}
+
+/* Set the base rank of the next iteration from the dangling rank. */
+static inline void os_pagerank_set_base(os_pagerank_state_t *st, unsigned int num_nodes,
+		double dangling)
+{
+	st->base = ((1 - st->damping) + st->damping * dangling) / num_nodes;
+}
+
+struct os_threadpool;
+
+/*
+ * Pull-based PageRank, every iteration split in blocks of
+ * OS_PAGERANK_BLOCK nodes run on tp, which must be idle.
+ */
+void os_pagerank(os_graph_t *graph, const os_pagerank_params_t *params,
+		struct os_threadpool *tp, os_pagerank_result_t *result);
+void os_pagerank_result_destroy(os_pagerank_result_t *result);
+
+#endif
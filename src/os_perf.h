@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+/*
+ * Hardware cache counters of the calling process, through perf_event_open().
+ * Counters are inherited by threads created after os_perf_open(), so open
+ * them before the threadpool. Every call is a no-op if the kernel or the
+ * machine doesn't provide them.
+ */
+
+#ifndef __OS_PERF_H__
+#define __OS_PERF_H__	1
+
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+enum {
+	OS_PERF_CACHE_MISSES,
+	OS_PERF_CACHE_REFERENCES,
+	OS_PERF_NUM_COUNTERS
+};
+
+typedef struct os_perf_t {
+	int fd[OS_PERF_NUM_COUNTERS];
+} os_perf_t;
+
+static inline void os_perf_init(os_perf_t *perf)
+{
+	for (int i = 0; i < OS_PERF_NUM_COUNTERS; i++)
+		perf->fd[i] = -1;
+}
+
+/* Return 0 if every counter could be opened, -1 otherwise. */
+static inline int os_perf_open(os_perf_t *perf)
+{
+	static const unsigned long long config[OS_PERF_NUM_COUNTERS] = {
+		[OS_PERF_CACHE_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+		[OS_PERF_CACHE_REFERENCES] = PERF_COUNT_HW_CACHE_REFERENCES,
+	};
+	struct perf_event_attr attr;
+	int rc = 0;
+
+	for (int i = 0; i < OS_PERF_NUM_COUNTERS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = config[i];
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		perf->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (perf->fd[i] < 0)
+			rc = -1;
+	}
+
+	return rc;
+}
+
+static inline void os_perf_start(os_perf_t *perf)
+{
+	for (int i = 0; i < OS_PERF_NUM_COUNTERS; i++) {
+		if (perf->fd[i] < 0)
+			continue;
+		ioctl(perf->fd[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(perf->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+static inline void os_perf_stop(os_perf_t *perf)
+{
+	for (int i = 0; i < OS_PERF_NUM_COUNTERS; i++)
+		if (perf->fd[i] >= 0)
+			ioctl(perf->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+}
+
+/*
+ * Read the counts since os_perf_start() into count. Threads only add
+ * theirs once they exited, so read after joining them. Return -1 if any
+ * counter is unavailable.
+ */
+static inline int os_perf_read(os_perf_t *perf, unsigned long long count[OS_PERF_NUM_COUNTERS])
+{
+	for (int i = 0; i < OS_PERF_NUM_COUNTERS; i++) {
+		if (perf->fd[i] < 0 ||
+		    read(perf->fd[i], &count[i], sizeof(count[i])) != sizeof(count[i]))
+			return -1;
+	}
+
+	return 0;
+}
+
+static inline void os_perf_close(os_perf_t *perf)
+{
+	for (int i = 0; i < OS_PERF_NUM_COUNTERS; i++) {
+		if (perf->fd[i] >= 0)
+			close(perf->fd[i]);
+		perf->fd[i] = -1;
+	}
+}
+
+#endif
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __OS_REDUCE_H__
+#define __OS_REDUCE_H__	1
+
+#include <limits.h>
+
+/*
+ * Sum, minimum, maximum and count of a set of values. Values are node info
+ * ints and there are at most UINT_MAX nodes, so the 64-bit sum can't
+ * overflow. Integer reductions don't depend on the order values come in,
+ * so partial results merged in any order match a serial pass exactly.
+ */
+typedef struct os_reduction_t {
+	long long sum;
+	long long min;
+	long long max;
+	unsigned long long count;
+} os_reduction_t;
+
+static inline void os_reduction_init(os_reduction_t *r)
+{
+	r->sum = 0;
+	r->min = LLONG_MAX;
+	r->max = LLONG_MIN;
+	r->count = 0;
+}
+
+static inline void os_reduction_add(os_reduction_t *r, long long value)
+{
+	r->sum += value;
+	if (value < r->min)
+		r->min = value;
+	if (value > r->max)
+		r->max = value;
+	r->count++;
+}
+
+static inline void os_reduction_merge(os_reduction_t *r, const os_reduction_t *other)
+{
+	r->sum += other->sum;
+	if (other->min < r->min)
+		r->min = other->min;
+	if (other->max > r->max)
+		r->max = other->max;
+	r->count += other->count;
+}
+
+#endif
@@ -0,0 +1,292 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Node relabelling.
+ *
+ * Every order is computed as a permutation, old_id[new] = old, and the
+ * graph is then rebuilt in one transposition pass: walking nodes by new id
+ * and appending each one to the lists of its neighbours leaves every
+ * neighbour list sorted, since the graph is symmetric.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "os_reorder.h"
+#include "os_time.h"
+#include "log/log.h"
+#include "utils.h"
+
+int os_order_parse(const char *name, os_order_t *order)
+{
+	if (strcmp(name, "none") == 0)
+		*order = OS_ORDER_NONE;
+	else if (strcmp(name, "degree") == 0)
+		*order = OS_ORDER_DEGREE;
+	else if (strcmp(name, "rcm") == 0)
+		*order = OS_ORDER_RCM;
+	else if (strcmp(name, "bfs") == 0)
+		*order = OS_ORDER_BFS;
+	else
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Counting sort of the nodes by degree into perm, increasing or not, ties
+ * broken by id.
+ */
+static void sort_by_degree(const os_graph_t *graph, unsigned int *perm, int decreasing)
+{
+	unsigned int n = graph->num_nodes;
+	unsigned int max_degree = 0;
+	size_t *count;
+
+	for (unsigned int v = 0; v < n; v++)
+		if (os_graph_degree(graph, v) > max_degree)
+			max_degree = os_graph_degree(graph, v);
+
+	count = calloc((size_t)max_degree + 2, sizeof(*count));
+	DIE(count == NULL, "calloc");
+
+	for (unsigned int v = 0; v < n; v++) {
+		unsigned int d = os_graph_degree(graph, v);
+
+		count[(decreasing ? max_degree - d : d) + 1]++;
+	}
+	for (unsigned int d = 0; d <= max_degree; d++)
+		count[d + 1] += count[d];
+	for (unsigned int v = 0; v < n; v++) {
+		unsigned int d = os_graph_degree(graph, v);
+
+		perm[count[decreasing ? max_degree - d : d]++] = v;
+	}
+
+	free(count);
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Append the nodes reachable from root to perm, from *tail on, in BFS
+ * order. With by_degree, the new neighbours of every node are queued by
+ * increasing degree, as Cuthill-McKee does; keys is scratch space for
+ * them.
+ */
+static void bfs_order(const os_graph_t *graph, unsigned int root, unsigned char *seen,
+		unsigned int *perm, unsigned int *tail, uint64_t *keys, int by_degree)
+{
+	unsigned int head = *tail;
+
+	seen[root] = 1;
+	perm[(*tail)++] = root;
+
+	while (head != *tail) {
+		unsigned int v = perm[head++];
+		unsigned int *neighbours = os_graph_neighbours(graph, v);
+		unsigned int degree = os_graph_degree(graph, v);
+		unsigned int k = 0;
+
+		for (unsigned int i = 0; i < degree; i++) {
+			unsigned int u = neighbours[i];
+
+			if (seen[u])
+				continue;
+			seen[u] = 1;
+			if (by_degree)
+				keys[k++] = (uint64_t)os_graph_degree(graph, u) << 32 | u;
+			else
+				perm[(*tail)++] = u;
+		}
+
+		if (!by_degree)
+			continue;
+		qsort(keys, k, sizeof(*keys), &compare_keys);
+		for (unsigned int i = 0; i < k; i++)
+			perm[(*tail)++] = (unsigned int)keys[i];
+	}
+}
+
+/*
+ * BFS order from node 0, then from the first node left in id order. RCM
+ * instead starts every component from its node of least degree and
+ * reverses the whole order at the end (George and Liu, 1981).
+ */
+static void traversal_order(const os_graph_t *graph, unsigned int *perm, int rcm)
+{
+	unsigned int n = graph->num_nodes;
+	unsigned int *roots = NULL;
+	unsigned char *seen;
+	uint64_t *keys = NULL;
+	unsigned int tail = 0;
+
+	seen = calloc(n, sizeof(*seen));
+	DIE(seen == NULL && n != 0, "calloc");
+
+	if (rcm) {
+		roots = malloc(n * sizeof(*roots));
+		DIE(roots == NULL && n != 0, "malloc");
+		sort_by_degree(graph, roots, 0);
+
+		// A node never has more new neighbours than its degree
+		keys = malloc(((size_t)2 * graph->num_edges + 1) * sizeof(*keys));
+		DIE(keys == NULL, "malloc");
+	}
+
+	for (unsigned int i = 0; i < n; i++) {
+		unsigned int root = rcm ? roots[i] : i;
+
+		if (!seen[root])
+			bfs_order(graph, root, seen, perm, &tail, keys, rcm);
+	}
+
+	if (rcm) {
+		for (unsigned int i = 0; i < n / 2; i++) {
+			unsigned int tmp = perm[i];
+
+			perm[i] = perm[n - 1 - i];
+			perm[n - 1 - i] = tmp;
+		}
+	}
+
+	free(seen);
+	free(roots);
+	free(keys);
+}
+
+/*
+ * Rebuild graph with node i of the result being node old_id[i] of graph,
+ * new_id being the inverse permutation.
+ */
+static os_graph_t *permute_graph(os_graph_t *graph, const unsigned int *old_id,
+		const unsigned int *new_id)
+{
+	unsigned int n = graph->num_nodes;
+	os_graph_t *out;
+	size_t *cursor;
+
+	out = os_graph_alloc(n, graph->num_edges);
+
+	out->offsets = os_arena_alloc(&out->arena, (n + 1) * sizeof(*out->offsets));
+	out->offsets[0] = 0;
+	for (unsigned int i = 0; i < n; i++)
+		out->offsets[i + 1] = out->offsets[i] + os_graph_degree(graph, old_id[i]);
+
+	out->adj = os_arena_alloc(&out->arena, 2 * (size_t)graph->num_edges * sizeof(*out->adj));
+	if (graph->weights != NULL)
+		out->weights = os_arena_alloc(&out->arena,
+				2 * (size_t)graph->num_edges * sizeof(*out->weights));
+
+	cursor = malloc(n * sizeof(*cursor));
+	DIE(cursor == NULL && n != 0, "malloc");
+	memcpy(cursor, out->offsets, n * sizeof(*cursor));
+
+	for (unsigned int i = 0; i < n; i++) {
+		unsigned int *neighbours = os_graph_neighbours(graph, old_id[i]);
+		unsigned int *weights = os_graph_weights(graph, old_id[i]);
+		unsigned int degree = os_graph_degree(graph, old_id[i]);
+
+		for (unsigned int j = 0; j < degree; j++) {
+			unsigned int u = new_id[neighbours[j]];
+
+			if (weights != NULL)
+				out->weights[cursor[u]] = weights[j];
+			out->adj[cursor[u]++] = i;
+		}
+	}
+
+	free(cursor);
+
+	os_graph_alloc_nodes(out, NULL);
+	for (unsigned int i = 0; i < n; i++)
+		out->info[i] = os_graph_info(graph, old_id[i]);
+
+	out->old_id = os_arena_alloc(&out->arena, n * sizeof(*out->old_id));
+	out->new_id = os_arena_alloc(&out->arena, n * sizeof(*out->new_id));
+	// Relabelling twice still maps back to the input ids
+	for (unsigned int i = 0; i < n; i++) {
+		out->old_id[i] = os_graph_input_id(graph, old_id[i]);
+		out->new_id[out->old_id[i]] = i;
+	}
+
+	out->load_bytes = graph->load_bytes;
+	out->load_time = graph->load_time;
+
+	return out;
+}
+
+os_graph_t *os_graph_reorder(os_graph_t *graph, os_order_t order)
+{
+	static const char * const names[] = { "none", "degree", "rcm", "bfs" };
+	unsigned int n = graph->num_nodes;
+	unsigned int *perm, *inverse;
+	double start, elapsed;
+	double span_before = 0, span_after;
+	unsigned int max_before = 0, max_after;
+	int stats = getenv("OS_GRAPH_STATS") != NULL;
+	os_graph_t *out;
+
+	if (order == OS_ORDER_NONE)
+		return graph;
+
+	if (stats)
+		os_graph_edge_span(graph, &span_before, &max_before);
+
+	start = os_time_seconds();
+	perm = malloc(n * sizeof(*perm));
+	inverse = malloc(n * sizeof(*inverse));
+	DIE((perm == NULL || inverse == NULL) && n != 0, "malloc");
+
+	if (order == OS_ORDER_DEGREE)
+		sort_by_degree(graph, perm, 1);
+	else
+		traversal_order(graph, perm, order == OS_ORDER_RCM);
+
+	for (unsigned int i = 0; i < n; i++)
+		inverse[perm[i]] = i;
+
+	out = permute_graph(graph, perm, inverse);
+	free(perm);
+	free(inverse);
+	destroy_graph(graph);
+	elapsed = os_time_seconds() - start;
+
+	if (stats) {
+		os_graph_edge_span(out, &span_after, &max_after);
+		log_info("Reordered %u nodes by %s in %.3f ms, edge span %.1f -> %.1f average, "
+			"%u -> %u max", n, names[order], elapsed * 1e3,
+			span_before, span_after, max_before, max_after);
+	}
+
+	return out;
+}
+
+void os_graph_edge_span(const os_graph_t *graph, double *average, unsigned int *max)
+{
+	unsigned long long total = 0;
+	unsigned int largest = 0;
+
+	for (unsigned int v = 0; v < graph->num_nodes; v++) {
+		unsigned int *neighbours = os_graph_neighbours(graph, v);
+		unsigned int degree = os_graph_degree(graph, v);
+
+		for (unsigned int i = 0; i < degree; i++) {
+			unsigned int d = neighbours[i] > v ? neighbours[i] - v : v - neighbours[i];
+
+			total += d;
+			if (d > largest)
+				largest = d;
+		}
+	}
+
+	*average = graph->num_edges != 0 ? (double)total / (2.0 * graph->num_edges) : 0;
+	*max = largest;
+}
@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __OS_REORDER_H__
+#define __OS_REORDER_H__	1
+
+#include "os_graph.h"
+
+typedef enum os_order_t {
+	/* Keep the input numbering. */
+	OS_ORDER_NONE,
+	/* By decreasing degree, so that hubs share the first cache lines. */
+	OS_ORDER_DEGREE,
+	/* Reverse Cuthill-McKee, which keeps neighbours close to each other. */
+	OS_ORDER_RCM,
+	/* In the order a BFS from node 0 reaches nodes. */
+	OS_ORDER_BFS
+} os_order_t;
+
+/* Parse "none", "degree", "rcm" or "bfs". Return -1 for anything else. */
+int os_order_parse(const char *name, os_order_t *order);
+
+/*
+ * Relabel the nodes of graph in the given order. The result is a new graph
+ * with its info, adjacency and weights permuted, neighbour lists sorted by
+ * id and old_id / new_id set, so that output can still use input ids.
+ * graph itself is destroyed, unless order is OS_ORDER_NONE, in which case
+ * it is returned as is.
+ */
+os_graph_t *os_graph_reorder(os_graph_t *graph, os_order_t order);
+
+/*
+ * Average and largest id distance between the ends of an edge, a cheap
+ * proxy for how many cache lines a traversal of graph touches.
+ */
+void os_graph_edge_span(const os_graph_t *graph, double *average, unsigned int *max);
+
+#endif
@@ -0,0 +1,320 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * SIMD kernels over node id lists.
+ *
+ * Both kernels gather one 32-bit value per id: visit states for the
+ * filter, node values for the reduction. AVX2 compresses the surviving
+ * lanes with a permutation looked up from the comparison mask, AVX-512
+ * has a compressing store for it. Tails shorter than a vector go through
+ * the scalar code (AVX2) or masked loads (AVX-512).
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define OS_SIMD_X86	1
+#endif
+
+#include "os_simd.h"
+#include "log/log.h"
+#include "utils.h"
+
+typedef struct simd_ops {
+	unsigned int (*filter)(const int *state, const unsigned int *ids,
+			unsigned int count, unsigned int *out);
+	void (*reduce)(os_reduction_t *r, const int *info, const unsigned int *ids,
+			unsigned int count);
+} simd_ops_t;
+
+static unsigned int filter_scalar(const int *state, const unsigned int *ids,
+		unsigned int count, unsigned int *out)
+{
+	unsigned int n = 0;
+
+	for (unsigned int i = 0; i < count; i++) {
+		unsigned int id = ids[i];
+
+		if (__atomic_load_n(&state[id], __ATOMIC_RELAXED) == 0)
+			out[n++] = id;
+	}
+
+	return n;
+}
+
+static void reduce_scalar(os_reduction_t *r, const int *info, const unsigned int *ids,
+		unsigned int count)
+{
+	for (unsigned int i = 0; i < count; i++)
+		os_reduction_add(r, info[ids[i]]);
+}
+
+#ifdef OS_SIMD_X86
+
+/* Byte indices of the set lanes of every 8-bit mask, packed to the front. */
+static uint64_t compress_lut[256];
+
+static void init_compress_lut(void)
+{
+	for (unsigned int mask = 0; mask < 256; mask++) {
+		uint64_t entry = 0;
+		unsigned int n = 0;
+
+		for (unsigned int lane = 0; lane < 8; lane++)
+			if (mask & (1u << lane))
+				entry |= (uint64_t)lane << (8 * n++);
+		compress_lut[mask] = entry;
+	}
+}
+
+__attribute__((target("avx2")))
+static unsigned int filter_avx2(const int *state, const unsigned int *ids,
+		unsigned int count, unsigned int *out)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	unsigned int n = 0, i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		__m256i idx = _mm256_loadu_si256((const __m256i *)(ids + i));
+		__m256i st, perm;
+		unsigned int mask;
+
+		// Gather indices are signed
+		if (_mm256_movemask_ps(_mm256_castsi256_ps(idx)) != 0) {
+			n += filter_scalar(state, ids + i, 8, out + n);
+			continue;
+		}
+
+		st = _mm256_i32gather_epi32(state, idx, 4);
+		mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(st, zero)));
+		perm = _mm256_cvtepu8_epi32(_mm_cvtsi64_si128(compress_lut[mask]));
+
+		// Writes 8 lanes, but never past ids[i + 7]
+		_mm256_storeu_si256((__m256i *)(out + n), _mm256_permutevar8x32_epi32(idx, perm));
+		n += __builtin_popcount(mask);
+	}
+
+	return n + filter_scalar(state, ids + i, count - i, out + n);
+}
+
+__attribute__((target("avx2")))
+static void reduce_avx2(os_reduction_t *r, const int *info, const unsigned int *ids,
+		unsigned int count)
+{
+	__m256i sum = _mm256_setzero_si256();
+	__m256i min = _mm256_set1_epi32(INT_MAX);
+	__m256i max = _mm256_set1_epi32(INT_MIN);
+	os_reduction_t part;
+	long long lanes[4];
+	int mins[8], maxs[8];
+	unsigned int i = 0, done = 0;
+
+	os_reduction_init(&part);
+
+	for (; i + 8 <= count; i += 8) {
+		__m256i idx = _mm256_loadu_si256((const __m256i *)(ids + i));
+		__m256i v;
+
+		if (_mm256_movemask_ps(_mm256_castsi256_ps(idx)) != 0) {
+			reduce_scalar(&part, info, ids + i, 8);
+			continue;
+		}
+
+		v = _mm256_i32gather_epi32(info, idx, 4);
+		min = _mm256_min_epi32(min, v);
+		max = _mm256_max_epi32(max, v);
+		sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+		sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+		done += 8;
+	}
+	reduce_scalar(&part, info, ids + i, count - i);
+
+	_mm256_storeu_si256((__m256i *)lanes, sum);
+	_mm256_storeu_si256((__m256i *)mins, min);
+	_mm256_storeu_si256((__m256i *)maxs, max);
+	if (done != 0) {
+		part.sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		for (unsigned int k = 0; k < 8; k++) {
+			if (mins[k] < part.min)
+				part.min = mins[k];
+			if (maxs[k] > part.max)
+				part.max = maxs[k];
+		}
+		part.count += done;
+	}
+
+	os_reduction_merge(r, &part);
+}
+
+__attribute__((target("avx512f")))
+static unsigned int filter_avx512(const int *state, const unsigned int *ids,
+		unsigned int count, unsigned int *out)
+{
+	const __m512i zero = _mm512_setzero_si512();
+	const __m512i visited = _mm512_set1_epi32(1);
+	unsigned int n = 0;
+
+	for (unsigned int i = 0; i < count; i += 16) {
+		__mmask16 lanes = count - i >= 16 ? 0xffff : (1u << (count - i)) - 1;
+		__m512i idx = _mm512_maskz_loadu_epi32(lanes, ids + i);
+		__m512i st;
+		__mmask16 mask;
+
+		// Gather indices are signed
+		if (_mm512_cmplt_epi32_mask(idx, zero) != 0) {
+			n += filter_scalar(state, ids + i, count - i >= 16 ? 16 : count - i, out + n);
+			continue;
+		}
+
+		// Lanes past the end read as visited
+		st = _mm512_mask_i32gather_epi32(visited, lanes, idx, state, 4);
+		mask = _mm512_cmpeq_epi32_mask(st, zero);
+		_mm512_mask_compressstoreu_epi32(out + n, mask, idx);
+		n += __builtin_popcount(mask);
+	}
+
+	return n;
+}
+
+__attribute__((target("avx512f")))
+static void reduce_avx512(os_reduction_t *r, const int *info, const unsigned int *ids,
+		unsigned int count)
+{
+	const __m512i zero = _mm512_setzero_si512();
+	__m512i sum = _mm512_setzero_si512();
+	__m512i min = _mm512_set1_epi32(INT_MAX);
+	__m512i max = _mm512_set1_epi32(INT_MIN);
+	os_reduction_t part;
+	unsigned int done = 0;
+
+	os_reduction_init(&part);
+
+	for (unsigned int i = 0; i < count; i += 16) {
+		unsigned int width = count - i >= 16 ? 16 : count - i;
+		__mmask16 lanes = width == 16 ? 0xffff : (1u << width) - 1;
+		__m512i idx = _mm512_maskz_loadu_epi32(lanes, ids + i);
+		__m512i v;
+
+		if (_mm512_cmplt_epi32_mask(idx, zero) != 0) {
+			reduce_scalar(&part, info, ids + i, width);
+			continue;
+		}
+
+		// Lanes past the end gather 0, which min and max skip
+		v = _mm512_mask_i32gather_epi32(zero, lanes, idx, info, 4);
+		min = _mm512_mask_min_epi32(min, lanes, min, v);
+		max = _mm512_mask_max_epi32(max, lanes, max, v);
+		sum = _mm512_add_epi64(sum, _mm512_cvtepi32_epi64(_mm512_castsi512_si256(v)));
+		sum = _mm512_add_epi64(sum, _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(v, 1)));
+		done += width;
+	}
+
+	if (done != 0) {
+		part.sum += _mm512_reduce_add_epi64(sum);
+		if (_mm512_reduce_min_epi32(min) < part.min)
+			part.min = _mm512_reduce_min_epi32(min);
+		if (_mm512_reduce_max_epi32(max) > part.max)
+			part.max = _mm512_reduce_max_epi32(max);
+		part.count += done;
+	}
+
+	os_reduction_merge(r, &part);
+}
+
+#endif
+
+static const simd_ops_t simd_ops[] = {
+	[OS_SIMD_SCALAR] = { &filter_scalar, &reduce_scalar },
+#ifdef OS_SIMD_X86
+	[OS_SIMD_AVX2] = { &filter_avx2, &reduce_avx2 },
+	[OS_SIMD_AVX512] = { &filter_avx512, &reduce_avx512 },
+#endif
+};
+
+static const char * const simd_names[] = {
+	[OS_SIMD_SCALAR] = "scalar",
+	[OS_SIMD_AVX2] = "avx2",
+	[OS_SIMD_AVX512] = "avx512",
+};
+
+static pthread_once_t simd_once = PTHREAD_ONCE_INIT;
+static _Atomic os_simd_level_t simd_level;
+
+static int simd_supported(os_simd_level_t level)
+{
+#ifdef OS_SIMD_X86
+	__builtin_cpu_init();
+	if (level == OS_SIMD_AVX512)
+		return __builtin_cpu_supports("avx512f");
+	if (level == OS_SIMD_AVX2)
+		return __builtin_cpu_supports("avx2");
+#endif
+	return level == OS_SIMD_SCALAR;
+}
+
+static void simd_init(void)
+{
+	const char *name = getenv("OS_SIMD");
+	os_simd_level_t level = OS_SIMD_AVX512;
+
+#ifdef OS_SIMD_X86
+	init_compress_lut();
+#endif
+
+	while (!simd_supported(level))
+		level--;
+
+	if (name != NULL) {
+		os_simd_level_t wanted;
+
+		for (wanted = OS_SIMD_SCALAR; wanted <= OS_SIMD_AVX512; wanted++)
+			if (strcmp(name, simd_names[wanted]) == 0)
+				break;
+
+		if (wanted > OS_SIMD_AVX512 || !simd_supported(wanted))
+			log_error("OS_SIMD=%s is not supported, using %s", name, simd_names[level]);
+		else
+			level = wanted;
+	}
+
+	atomic_store(&simd_level, level);
+}
+
+os_simd_level_t os_simd_level(void)
+{
+	pthread_once(&simd_once, &simd_init);
+	return atomic_load_explicit(&simd_level, memory_order_relaxed);
+}
+
+const char *os_simd_name(os_simd_level_t level)
+{
+	return simd_names[level];
+}
+
+int os_simd_set_level(os_simd_level_t level)
+{
+	pthread_once(&simd_once, &simd_init);
+	if (!simd_supported(level))
+		return -1;
+
+	atomic_store(&simd_level, level);
+	return 0;
+}
+
+unsigned int os_simd_filter_unvisited(const int *state, const unsigned int *ids,
+		unsigned int count, unsigned int *out)
+{
+	return simd_ops[os_simd_level()].filter(state, ids, count, out);
+}
+
+void os_simd_reduce_info(os_reduction_t *r, const int *info, const unsigned int *ids,
+		unsigned int count)
+{
+	simd_ops[os_simd_level()].reduce(r, info, ids, count);
+}
@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __OS_SIMD_H__
+#define __OS_SIMD_H__	1
+
+#include "os_reduce.h"
+
+/*
+ * Bulk kernels over lists of node ids. Every kernel has a scalar version
+ * and AVX2 and AVX-512 ones, picked once at run time from what the CPU
+ * supports, or from $OS_SIMD (scalar, avx2 or avx512) to compare them.
+ * Ids must be below INT_MAX for the SIMD versions; blocks holding larger
+ * ones are handled by the scalar code.
+ */
+typedef enum os_simd_level_t {
+	OS_SIMD_SCALAR,
+	OS_SIMD_AVX2,
+	OS_SIMD_AVX512
+} os_simd_level_t;
+
+os_simd_level_t os_simd_level(void);
+const char *os_simd_name(os_simd_level_t level);
+/* Use level from now on. Return -1 if the CPU doesn't support it. */
+int os_simd_set_level(os_simd_level_t level);
+
+/*
+ * Copy to out, in order, the ids whose state is 0 (NOT_VISITED) and return
+ * how many there are. out may be ids itself. States are read without
+ * synchronization: an id a racing thread claims can still come out, one
+ * that was claimed before never does, so callers must claim what they get.
+ */
+unsigned int os_simd_filter_unvisited(const int *state, const unsigned int *ids,
+		unsigned int count, unsigned int *out);
+
+/* Add info[ids[i]] to r for every i below count. */
+void os_simd_reduce_info(os_reduction_t *r, const int *info, const unsigned int *ids,
+		unsigned int count);
+
+#endif
@@ -0,0 +1,371 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Delta-stepping SSSP over the threadpool.
+ *
+ * Tentative distances are lowered with a CAS. A node whose distance drops
+ * to d goes into bucket d / delta of the worker that lowered it, and all
+ * workers empty the lowest non-empty bucket together, with barriers
+ * between phases. Relaxing a bucket can refill it, it then takes more
+ * phases. Large deltas mean fewer phases but more nodes relaxed before
+ * their distance is final, delta 1 with unit weights is a plain BFS.
+ *
+ * Each worker only keeps a window of SSSP_WINDOW buckets from the current
+ * one, as a ring. Nodes beyond the window wait in a far list, filed into
+ * the ring once the window gets to them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "os_sssp.h"
+#include "os_threadpool.h"
+#include "log/log.h"
+#include "utils.h"
+
+/* Buckets in the ring of every worker. */
+#define SSSP_WINDOW		128
+/* Frontier entries grabbed at a time by a worker. */
+#define FRONTIER_CHUNK		64
+
+#define BUCKET_NONE		((unsigned long long)-1)
+
+typedef struct sssp_bin {
+	unsigned int *items;
+	size_t count;
+	size_t capacity;
+} sssp_bin_t;
+
+typedef struct sssp_ctx {
+	os_graph_t *graph;
+	unsigned int num_threads;
+	unsigned long long delta;
+	pthread_barrier_t barrier;
+	os_threadpool_t *tp;
+
+	_Atomic unsigned long long *dist;
+
+	/* Nodes of the current bucket, relaxed during a phase. */
+	unsigned int *frontier;
+	size_t frontier_size;
+	size_t frontier_capacity;
+	unsigned long long bucket;
+
+	int done;
+	unsigned int num_buckets;
+	unsigned int num_phases;
+
+	/* Reduced during a phase, reset by the serial sections. */
+	_Atomic unsigned long long next_bucket;
+	_Atomic size_t tail;
+	_Atomic size_t next_chunk;
+	_Atomic unsigned long long relaxations;
+} sssp_ctx_t;
+
+typedef struct sssp_thread {
+	sssp_ctx_t *ctx;
+	unsigned int tid;
+	sssp_bin_t ring[SSSP_WINDOW];
+	sssp_bin_t far;
+	/* Lowest bucket in far, or less if some entries went stale. */
+	unsigned long long far_min;
+	size_t offset;
+	unsigned long long relaxations;
+} sssp_thread_t;
+
+static void bin_push(sssp_bin_t *bin, unsigned int v)
+{
+	if (bin->count == bin->capacity) {
+		bin->capacity = bin->capacity ? 2 * bin->capacity : 64;
+		bin->items = realloc(bin->items, bin->capacity * sizeof(*bin->items));
+		DIE(bin->items == NULL, "realloc");
+	}
+	bin->items[bin->count++] = v;
+}
+
+static void push_node(sssp_thread_t *th, unsigned int v, unsigned long long dist)
+{
+	unsigned long long bucket = dist / th->ctx->delta;
+
+	if (bucket < th->ctx->bucket + SSSP_WINDOW) {
+		bin_push(&th->ring[bucket % SSSP_WINDOW], v);
+		return;
+	}
+
+	bin_push(&th->far, v);
+	if (bucket < th->far_min)
+		th->far_min = bucket;
+}
+
+static void relax_frontier(sssp_thread_t *th)
+{
+	sssp_ctx_t *ctx = th->ctx;
+	os_graph_t *graph = ctx->graph;
+	size_t first;
+
+	while ((first = atomic_fetch_add_explicit(&ctx->next_chunk, FRONTIER_CHUNK,
+					memory_order_relaxed)) < ctx->frontier_size) {
+		size_t last = first + FRONTIER_CHUNK < ctx->frontier_size ?
+			first + FRONTIER_CHUNK : ctx->frontier_size;
+
+		for (size_t k = first; k < last; k++) {
+			unsigned int u = ctx->frontier[k];
+			unsigned long long d = atomic_load_explicit(&ctx->dist[u], memory_order_relaxed);
+			unsigned int *neighbours = os_graph_neighbours(graph, u);
+			unsigned int *weights = os_graph_weights(graph, u);
+			unsigned int degree = os_graph_degree(graph, u);
+
+			// Already relaxed from an earlier bucket
+			if (d / ctx->delta < ctx->bucket)
+				continue;
+
+			for (unsigned int i = 0; i < degree; i++) {
+				unsigned int v = neighbours[i];
+				unsigned long long nd = d + (weights != NULL ? weights[i] : 1);
+				unsigned long long old = atomic_load_explicit(&ctx->dist[v],
+						memory_order_relaxed);
+
+				while (nd < old) {
+					if (atomic_compare_exchange_weak_explicit(&ctx->dist[v], &old, nd,
+								memory_order_relaxed, memory_order_relaxed)) {
+						push_node(th, v, nd);
+						th->relaxations++;
+						break;
+					}
+				}
+			}
+		}
+	}
+}
+
+/* Lowest non-empty bucket of the worker, BUCKET_NONE if it has none. */
+static unsigned long long local_next_bucket(sssp_thread_t *th)
+{
+	unsigned long long bucket = th->ctx->bucket;
+
+	for (unsigned long long b = bucket; b < bucket + SSSP_WINDOW; b++)
+		if (th->ring[b % SSSP_WINDOW].count != 0)
+			return b;
+
+	return th->far.count != 0 ? th->far_min : BUCKET_NONE;
+}
+
+static void atomic_min(_Atomic unsigned long long *var, unsigned long long value)
+{
+	unsigned long long old = atomic_load_explicit(var, memory_order_relaxed);
+
+	while (value < old &&
+	       !atomic_compare_exchange_weak_explicit(var, &old, value,
+			       memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+/* Move the far nodes the window now covers to the ring, drop stale ones. */
+static void refile_far(sssp_thread_t *th)
+{
+	sssp_ctx_t *ctx = th->ctx;
+	unsigned long long end = ctx->bucket + SSSP_WINDOW;
+	size_t kept = 0;
+
+	if (th->far_min >= end)
+		return;
+
+	th->far_min = BUCKET_NONE;
+	for (size_t i = 0; i < th->far.count; i++) {
+		unsigned int v = th->far.items[i];
+		unsigned long long bucket = atomic_load_explicit(&ctx->dist[v],
+				memory_order_relaxed) / ctx->delta;
+
+		if (bucket < ctx->bucket)
+			continue;
+		if (bucket < end) {
+			bin_push(&th->ring[bucket % SSSP_WINDOW], v);
+			continue;
+		}
+		th->far.items[kept++] = v;
+		if (bucket < th->far_min)
+			th->far_min = bucket;
+	}
+	th->far.count = kept;
+}
+
+/* Run by a single worker between two barriers. */
+static void choose_bucket(sssp_ctx_t *ctx)
+{
+	unsigned long long next = atomic_load(&ctx->next_bucket);
+
+	atomic_store(&ctx->next_bucket, BUCKET_NONE);
+	ctx->done = (next == BUCKET_NONE);
+	if (ctx->done)
+		return;
+
+	if (next != ctx->bucket)
+		ctx->num_buckets++;
+	ctx->num_phases++;
+	ctx->bucket = next;
+}
+
+/* Run by a single worker once every worker knows its offset in the frontier. */
+static void resize_frontier(sssp_ctx_t *ctx)
+{
+	ctx->frontier_size = atomic_load(&ctx->tail);
+	if (ctx->frontier_size > ctx->frontier_capacity) {
+		ctx->frontier_capacity = 2 * ctx->frontier_size;
+		free(ctx->frontier);
+		ctx->frontier = malloc(ctx->frontier_capacity * sizeof(*ctx->frontier));
+		DIE(ctx->frontier == NULL, "malloc");
+	}
+
+	atomic_store(&ctx->tail, 0);
+	atomic_store(&ctx->next_chunk, 0);
+}
+
+/* Wait for all workers, then let one of them run fn before any continues. */
+static void serial_section(sssp_ctx_t *ctx, void (*fn)(sssp_ctx_t *ctx))
+{
+	if (pthread_barrier_wait(&ctx->barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+		fn(ctx);
+	pthread_barrier_wait(&ctx->barrier);
+}
+
+static void sssp_worker(void *arg)
+{
+	sssp_thread_t *th = arg;
+	sssp_ctx_t *ctx = th->ctx;
+
+	while (1) {
+		sssp_bin_t *bin;
+
+		relax_frontier(th);
+		atomic_min(&ctx->next_bucket, local_next_bucket(th));
+		serial_section(ctx, &choose_bucket);
+
+		if (ctx->done)
+			break;
+
+		// Gather the bucket from every worker into the next frontier
+		refile_far(th);
+		bin = &th->ring[ctx->bucket % SSSP_WINDOW];
+		th->offset = atomic_fetch_add_explicit(&ctx->tail, bin->count,
+				memory_order_relaxed);
+		serial_section(ctx, &resize_frontier);
+
+		for (size_t i = 0; i < bin->count; i++)
+			ctx->frontier[th->offset + i] = bin->items[i];
+		bin->count = 0;
+		pthread_barrier_wait(&ctx->barrier);
+	}
+
+	atomic_fetch_add(&ctx->relaxations, th->relaxations);
+}
+
+/*
+ * Start the per-worker tasks from inside the pool. Each of them blocks on
+ * the phase barriers, so every worker ends up running exactly one.
+ */
+static void spawn_workers(void *arg)
+{
+	sssp_thread_t *threads = arg;
+	sssp_ctx_t *ctx = threads[0].ctx;
+
+	for (unsigned int i = 1; i < ctx->num_threads; i++)
+		enqueue_task(ctx->tp, create_task(&sssp_worker, &threads[i], NULL));
+	sssp_worker(&threads[0]);
+}
+
+/*
+ * The average edge weight over the average degree, at least 1: about one
+ * light edge per node, as suggested by Meyer and Sanders for random graphs.
+ */
+unsigned long long os_sssp_default_delta(os_graph_t *graph)
+{
+	size_t num_slots = 2 * (size_t)graph->num_edges;
+	unsigned long long total = 0, delta;
+
+	if (graph->weights == NULL || num_slots == 0)
+		return 1;
+
+	for (size_t i = 0; i < num_slots; i++)
+		total += graph->weights[i];
+
+	// (total / num_slots) / (num_slots / num_nodes)
+	delta = total / num_slots * graph->num_nodes / num_slots;
+
+	return delta > 0 ? delta : 1;
+}
+
+void os_sssp(os_graph_t *graph, const unsigned int *roots, unsigned int num_roots,
+		unsigned long long delta, os_threadpool_t *tp, os_sssp_result_t *result)
+{
+	unsigned int num_threads = tp->num_threads;
+	sssp_ctx_t ctx = {
+		.graph = graph,
+		.num_threads = num_threads,
+		.delta = delta != 0 ? delta : os_sssp_default_delta(graph),
+		.tp = tp,
+	};
+	sssp_thread_t *threads;
+
+	ctx.dist = malloc(graph->num_nodes * sizeof(*ctx.dist));
+	DIE(ctx.dist == NULL && graph->num_nodes != 0, "malloc");
+	for (unsigned int i = 0; i < graph->num_nodes; i++)
+		atomic_init(&ctx.dist[i], OS_GRAPH_DIST_INF);
+
+	ctx.frontier_capacity = num_roots + 1;
+	ctx.frontier = malloc(ctx.frontier_capacity * sizeof(*ctx.frontier));
+	DIE(ctx.frontier == NULL, "malloc");
+	atomic_init(&ctx.next_bucket, BUCKET_NONE);
+
+	// All the roots make up the first frontier, repeated ones only once
+	for (unsigned int i = 0; i < num_roots; i++) {
+		if (ctx.dist[roots[i]] == 0)
+			continue;
+		ctx.dist[roots[i]] = 0;
+		ctx.frontier[ctx.frontier_size++] = roots[i];
+	}
+	ctx.num_buckets = ctx.num_phases = 1;
+
+	threads = calloc(num_threads, sizeof(*threads));
+	DIE(threads == NULL, "calloc");
+	for (unsigned int i = 0; i < num_threads; i++) {
+		threads[i].ctx = &ctx;
+		threads[i].tid = i;
+		threads[i].far_min = BUCKET_NONE;
+	}
+
+	pthread_barrier_init(&ctx.barrier, NULL, num_threads);
+	threadpool_run(tp, create_task(&spawn_workers, threads, NULL));
+	pthread_barrier_destroy(&ctx.barrier);
+
+	result->dist = (unsigned long long *)ctx.dist;
+	result->num_buckets = ctx.num_buckets;
+	result->num_phases = ctx.num_phases;
+	result->relaxations = atomic_load(&ctx.relaxations);
+	result->num_reached = 0;
+	for (unsigned int i = 0; i < graph->num_nodes; i++)
+		result->num_reached += (result->dist[i] != OS_GRAPH_DIST_INF);
+
+	if (result->num_reached == graph->num_nodes) {
+		result->sum = os_graph_info_sum(graph, 0, graph->num_nodes);
+	} else {
+		result->sum = 0;
+		for (unsigned int i = 0; i < graph->num_nodes; i++)
+			result->sum += result->dist[i] != OS_GRAPH_DIST_INF ?
+				os_graph_info(graph, i) : 0;
+	}
+
+	for (unsigned int i = 0; i < num_threads; i++) {
+		for (unsigned int b = 0; b < SSSP_WINDOW; b++)
+			free(threads[i].ring[b].items);
+		free(threads[i].far.items);
+	}
+	free(threads);
+	free(ctx.frontier);
+}
+
+void os_sssp_result_destroy(os_sssp_result_t *result)
+{
+	free(result->dist);
+}
@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __OS_SSSP_H__
+#define __OS_SSSP_H__	1
+
+#include "os_graph.h"
+#include "os_threadpool.h"
+
+typedef struct os_sssp_result_t {
+	long long sum;
+	unsigned int num_reached;
+
+	/* Per node, OS_GRAPH_DIST_INF if not reached. */
+	unsigned long long *dist;
+
+	/* Buckets emptied, phases it took (a bucket can refill) and relaxations. */
+	unsigned int num_buckets;
+	unsigned int num_phases;
+	unsigned long long relaxations;
+} os_sssp_result_t;
+
+/*
+ * Delta-stepping single-source shortest paths (Meyer and Sanders, J.
+ * Algorithms 2003) from all of roots at once, run by one task per worker
+ * of tp, which must be idle. Edges of unweighted graphs weigh 1. A delta
+ * of 0 picks os_sssp_default_delta().
+ */
+void os_sssp(os_graph_t *graph, const unsigned int *roots, unsigned int num_roots,
+		unsigned long long delta, os_threadpool_t *tp, os_sssp_result_t *result);
+unsigned long long os_sssp_default_delta(os_graph_t *graph);
+void os_sssp_result_destroy(os_sssp_result_t *result);
+
+#endif
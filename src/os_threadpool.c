@@ -1,25 +1,137 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <errno.h>
 #include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #include "os_threadpool.h"
 #include "log/log.h"
 #include "utils.h"
 
-/* Create a task that would be executed by a thread. */
-os_task_t *create_task(void (*action)(void *), void *arg, void (*destroy_arg)(void *))
+/* Default idle policy, see dequeue_task(). */
+#define IDLE_SPIN_ROUNDS	256
+#define IDLE_YIELD_ROUNDS	16
+/* Default trace ring size of each worker, see init_trace(). */
+#define TRACE_EVENTS		(1u << 16)
+
+/* Worker run by the calling thread, NULL outside of any pool. */
+static __thread os_worker_t *current_worker;
+
+/* CPU of worker i is affinity_cpus[i % affinity_num_cpus], if any. */
+static int *affinity_cpus;
+static unsigned int affinity_num_cpus;
+
+typedef struct cpu_slot {
+	int cpu;
+	int package;
+	int core;
+	/* Rank of the core in its package and of the CPU among its siblings. */
+	int core_rank;
+	int smt;
+} cpu_slot_t;
+
+/*
+ * Get a task from the calling worker's slabs: first the local free list,
+ * then everything other threads gave back, then a new slab. Threads
+ * outside of any pool fall back to malloc().
+ */
+static os_task_t *alloc_task(void)
 {
+	os_worker_t *w = current_worker;
+	os_list_node_t *n;
 	os_task_t *t;
 
-	t = malloc(sizeof(*t));
-	DIE(t == NULL, "malloc");
+	if (w == NULL) {
+		t = malloc(sizeof(*t));
+		DIE(t == NULL, "malloc");
+		t->owner = NULL;
+		return t;
+	}
+
+	if (w->free_tasks == NULL)
+		w->free_tasks = atomic_exchange_explicit(&w->remote_free_tasks, NULL,
+				memory_order_acquire);
+
+	if (w->free_tasks == NULL) {
+		os_task_slab_t *slab = malloc(sizeof(*slab));
+
+		DIE(slab == NULL, "malloc");
+		slab->next = w->slabs;
+		w->slabs = slab;
+		for (unsigned int i = 0; i < OS_TASK_SLAB_SIZE; i++) {
+			slab->tasks[i].owner = w;
+			slab->tasks[i].list.next = w->free_tasks;
+			w->free_tasks = &slab->tasks[i].list;
+		}
+	}
+
+	n = w->free_tasks;
+	w->free_tasks = n->next;
+
+	return list_entry(n, os_task_t, list);
+}
+
+static void free_task(os_task_t *t)
+{
+	os_worker_t *owner = t->owner;
+	os_list_node_t *head;
+
+	if (owner == NULL) {
+		free(t);
+	} else if (owner == current_worker) {
+		t->list.next = owner->free_tasks;
+		owner->free_tasks = &t->list;
+	} else {
+		// Only the owner pops, and always the whole list, so no ABA
+		head = atomic_load_explicit(&owner->remote_free_tasks, memory_order_relaxed);
+		do {
+			t->list.next = head;
+		} while (!atomic_compare_exchange_weak_explicit(&owner->remote_free_tasks,
+					&head, &t->list, memory_order_release,
+					memory_order_relaxed));
+	}
+}
+
+/* Create a task that would be executed by a thread. */
+os_task_t *create_task(void (*action)(void *), void *arg, void (*destroy_arg)(void *))
+{
+	os_task_t *t = alloc_task();
 
 	t->action = action;		// the function
 	t->argument = arg;		// arguments for the function
 	t->destroy_arg = destroy_arg;	// destroy argument function
+	t->priority = OS_TASK_PRIO_NORMAL;
+	t->worker = OS_TASK_ANY_WORKER;
+
+	return t;
+}
+
+/*
+ * Create a task whose argument is a copy of the size bytes at arg, kept in
+ * the task itself: there's nothing to allocate or destroy separately.
+ */
+os_task_t *create_task_inline(void (*action)(void *), const void *arg, size_t size)
+{
+	os_task_t *t = alloc_task();
+
+	assert(size <= OS_TASK_INLINE_SIZE);
+	memcpy(t->inline_arg, arg, size);
+
+	t->action = action;
+	t->argument = t->inline_arg;
+	t->destroy_arg = NULL;
+	t->priority = OS_TASK_PRIO_NORMAL;
+	t->worker = OS_TASK_ANY_WORKER;
 
 	return t;
 }
@@ -29,175 +141,1149 @@ void destroy_task(os_task_t *t)
 {
 	if (t->destroy_arg != NULL)
 		t->destroy_arg(t->argument);
-	free(t);
+	free_task(t);
+}
+
+/* Set the priority of t, levels past OS_TASK_PRIO_LOW count as the lowest. */
+void set_task_priority(os_task_t *t, unsigned int priority)
+{
+	t->priority = priority < OS_TASK_PRIORITIES ? priority : OS_TASK_PRIO_LOW;
+}
+
+/*
+ * Ask for t to run on the given worker, or OS_TASK_ANY_WORKER. Only a hint:
+ * idle workers still take it when they run out of other work.
+ */
+void set_task_worker(os_task_t *t, unsigned int worker)
+{
+	t->worker = worker;
+}
+
+/*
+ * Prefer the worker owning item idx when count items are split into
+ * num_threads contiguous ranges, one per worker, so that tasks touching the
+ * same range keep its data warm in the same cache.
+ */
+void set_task_locality(os_task_t *t, os_threadpool_t *tp, unsigned long long idx,
+		unsigned long long count)
+{
+	t->worker = idx < count ? idx * tp->num_threads / count : OS_TASK_ANY_WORKER;
+}
+
+static long futex(_Atomic unsigned int *addr, int op, unsigned int val)
+{
+	return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static unsigned int hist_bucket(unsigned long long value)
+{
+	unsigned int bucket = value ? 64 - __builtin_clzll(value) : 0;
+
+	return bucket < OS_TP_HIST_BUCKETS ? bucket : OS_TP_HIST_BUCKETS - 1;
+}
+
+/*
+ * Lock m and, if s isn't NULL, account for it there. Only contended
+ * acquisitions are timed, the uncontended ones cost a trylock.
+ */
+static void lock_mutex(pthread_mutex_t *m, os_lock_stats_t *s)
+{
+	unsigned long long start, wait;
+
+	if (pthread_mutex_trylock(m) == 0) {
+		if (s != NULL)
+			s->acquired++;
+		return;
+	}
+
+	if (s == NULL) {
+		pthread_mutex_lock(m);
+		return;
+	}
+
+	start = now_ns();
+	pthread_mutex_lock(m);
+	wait = now_ns() - start;
+
+	s->acquired++;
+	s->contended++;
+	s->wait_ns += wait;
+	if (wait > s->max_wait_ns)
+		s->max_wait_ns = wait;
+	s->wait_hist[hist_bucket(wait)]++;
+}
+
+/* Wake w up if it is parked. Return 0 if it wasn't. */
+static int wake_worker(os_threadpool_t *tp, os_worker_t *w)
+{
+	os_worker_t *self = current_worker;
+	unsigned long long now;
+	int parked = 1;
+
+	if (atomic_load_explicit(&w->parked, memory_order_relaxed) == 0 ||
+			!atomic_compare_exchange_strong(&w->parked, &parked, 0))
+		return 0;
+
+	now = now_ns();
+	if (self != NULL && self->tp == tp)
+		os_trace_record(&self->trace, OS_TRACE_WAKE, now, now, w->id, 0);
+
+	atomic_store_explicit(&w->wake_time, now, memory_order_relaxed);
+	atomic_fetch_add(&w->park_epoch, 1);
+	futex(&w->park_epoch, FUTEX_WAKE_PRIVATE, 1);
+	atomic_fetch_add_explicit(&tp->futex_wakes, 1, memory_order_relaxed);
+
+	return 1;
+}
+
+/*
+ * Wake up to count parked workers after new work was published, or after
+ * shutdown, trying target first if it isn't NULL. Nothing happens, not
+ * even a syscall, while nobody sleeps.
+ */
+static void notify_workers(os_threadpool_t *tp, os_worker_t *target, unsigned int count)
+{
+	unsigned int n = tp->num_threads;
+	unsigned int start;
+
+	if (atomic_load(&tp->sleeping_threads) == 0)
+		return;
+
+	if (target != NULL && wake_worker(tp, target) && --count == 0)
+		return;
+
+	// Don't always pick on the first workers
+	start = current_worker != NULL ? current_worker->id + 1 : 0;
+	for (unsigned int i = 0; i < n && count != 0; i++)
+		count -= wake_worker(tp, &tp->workers[(start + i) % n]);
+}
+
+/*
+ * Put t on its shared queue, at the front in shared queue mode. self is
+ * the calling worker, NULL from outside the pool.
+ */
+static void push_shared(os_threadpool_t *tp, os_task_t *t, os_worker_t *self)
+{
+	os_list_node_t *head = &tp->head[t->priority];
+
+	lock_mutex(&tp->list_mutex, self != NULL ? &self->counters.list_lock : NULL);
+	if (tp->mode == OS_TP_SHARED_QUEUE)
+		list_add_tail(head->next, &t->list);
+	else
+		list_add_tail(head, &t->list);
+	atomic_fetch_add(&tp->enqueued_tasks[t->priority], 1);
+	pthread_mutex_unlock(&tp->list_mutex);
+}
+
+static void push_mailbox(os_worker_t *w, os_task_t *t, os_worker_t *self)
+{
+	lock_mutex(&w->mailbox_mutex, self != NULL ? &self->counters.mailbox_lock : NULL);
+	list_add_tail(&w->mailbox[t->priority], &t->list);
+	atomic_fetch_add(&w->mailbox_tasks[t->priority], 1);
+	pthread_mutex_unlock(&w->mailbox_mutex);
 }
 
-/* Put a new task to threadpool task queue. */
+/*
+ * Put a new task to threadpool task queue: the deque of the calling worker
+ * or, for tasks from outside the pool, the shared queue of its priority.
+ * Tasks meant for another worker go to its mailbox instead.
+ */
 void enqueue_task(os_threadpool_t *tp, os_task_t *t)
 {
+	os_worker_t *w = current_worker;
+	os_worker_t *target = NULL;
+
 	assert(tp != NULL);
 	assert(t != NULL);
 
-	pthread_mutex_lock(&tp->list_mutex);
+	if (w != NULL && w->tp != tp)
+		w = NULL;
+	if (t->worker != OS_TASK_ANY_WORKER)
+		target = &tp->workers[t->worker % tp->num_threads];
 
-	list_add_tail(tp->head.next, &t->list);
-	atomic_store(&tp->enqueued_tasks, 1);
+	// Tasks from outside the pool are few, time them all
+	if (w != NULL) {
+		w->counters.enqueued++;
+		t->enqueue_ns = w->counters.enqueued % OS_TP_SAMPLE_PERIOD == 0 ? now_ns() : 0;
+	} else {
+		atomic_fetch_add_explicit(&tp->external_enqueues, 1, memory_order_relaxed);
+		t->enqueue_ns = now_ns();
+	}
+	if (w != NULL && os_trace_enabled(&w->trace)) {
+		unsigned long long now = t->enqueue_ns ? t->enqueue_ns : now_ns();
 
-	pthread_cond_signal(&tp->list_signal);
-	pthread_mutex_unlock(&tp->list_mutex);
+		os_trace_record(&w->trace, OS_TRACE_ENQUEUE, now, now, t->worker, t->priority);
+	}
 
-	pthread_mutex_lock(&tp->enqueue_mutex);
-	pthread_cond_broadcast(&tp->enqueue_signal);
-	pthread_mutex_unlock(&tp->enqueue_mutex);
+	// Count the task before anyone can run it and finish it
+	atomic_fetch_add(&tp->pending_tasks, 1);
+
+	if (target != NULL && target != w) {
+		push_mailbox(target, t, w);
+	} else if (tp->mode == OS_TP_WORK_STEALING && w != NULL) {
+		// Fast path: task spawned by one of our workers
+		os_deque_push(&w->deque[t->priority], t);
+	} else {
+		push_shared(tp, t, w);
+	}
+
+	// Pairs with the fence after setting parked in dequeue_task()
+	atomic_thread_fence(memory_order_seq_cst);
+	notify_workers(tp, target, 1);
 }
 
 /*
- * Check if queue is empty.
- * This function should be called in a synchronized manner.
+ * Take a task of the given priority from the shared queue, if any. self is
+ * the calling worker, NULL from outside the pool.
  */
-static int queue_is_empty(os_threadpool_t *tp)
+static os_task_t *take_shared(os_threadpool_t *tp, unsigned int prio, os_worker_t *self)
 {
-	return list_empty(&tp->head);
+	os_task_t *t = NULL;
+
+	if (atomic_load_explicit(&tp->enqueued_tasks[prio], memory_order_relaxed) == 0)
+		return NULL;
+
+	lock_mutex(&tp->list_mutex, self != NULL ? &self->counters.list_lock : NULL);
+	if (!list_empty(&tp->head[prio])) {
+		t = list_entry(tp->head[prio].next, os_task_t, list);
+		list_del(&t->list);
+		atomic_fetch_sub(&tp->enqueued_tasks[prio], 1);
+	}
+	pthread_mutex_unlock(&tp->list_mutex);
+
+	return t;
+}
+
+/* Take a task of the given priority from the mailbox of w for worker self, if any. */
+static os_task_t *take_mailbox(os_worker_t *w, unsigned int prio, os_worker_t *self)
+{
+	os_task_t *t = NULL;
+
+	if (atomic_load_explicit(&w->mailbox_tasks[prio], memory_order_relaxed) == 0)
+		return NULL;
+
+	lock_mutex(&w->mailbox_mutex, &self->counters.mailbox_lock);
+	if (!list_empty(&w->mailbox[prio])) {
+		t = list_entry(w->mailbox[prio].next, os_task_t, list);
+		list_del(&t->list);
+		atomic_fetch_sub(&w->mailbox_tasks[prio], 1);
+	}
+	pthread_mutex_unlock(&w->mailbox_mutex);
+
+	return t;
+}
+
+/* Take a task from the own deque, skipping the fence if it is empty. */
+static os_task_t *take_local(os_worker_t *w, unsigned int prio)
+{
+	// Only the owner moves bottom and top never goes back, so a deque
+	// that looks empty to its owner is empty
+	if (os_deque_size(&w->deque[prio]) == 0)
+		return NULL;
+
+	return os_deque_take(&w->deque[prio]);
 }
 
 /*
- * Get a task from threadpool task queue.
- * Block if no task is available.
- * Return NULL if work is complete, i.e. no task will become available,
- * i.e. all threads are going to block.
+ * Try to steal from the other workers, starting with a random victim:
+ * their deques, priority by priority, then as a last resort the tasks
+ * waiting in their mailboxes.
  */
+static os_task_t *ws_steal(os_worker_t *w)
+{
+	os_threadpool_t *tp = w->tp;
+	unsigned int start, n = tp->num_threads;
+
+	if (n < 2)
+		return NULL;
+
+	// xorshift32
+	w->seed ^= w->seed << 13;
+	w->seed ^= w->seed >> 17;
+	w->seed ^= w->seed << 5;
+	start = w->seed % n;
+
+	for (unsigned int prio = 0; prio < OS_TASK_PRIORITIES; prio++) {
+		if (tp->mode != OS_TP_WORK_STEALING)
+			break;
+
+		for (unsigned int i = 0; i < n; i++) {
+			os_worker_t *victim = &tp->workers[(start + i) % n];
+			void *t;
+
+			if (victim == w || os_deque_size(&victim->deque[prio]) == 0)
+				continue;
 
-os_task_t *dequeue_task(os_threadpool_t *tp)
+			while ((t = os_deque_steal(&victim->deque[prio])) == OS_DEQUE_ABORT)
+				w->counters.steal_aborts++;
+
+			if (t != NULL) {
+				w->counters.steals++;
+				return t;
+			}
+		}
+	}
+
+	for (unsigned int prio = 0; prio < OS_TASK_PRIORITIES; prio++) {
+		for (unsigned int i = 0; i < n; i++) {
+			os_worker_t *victim = &tp->workers[(start + i) % n];
+			os_task_t *t;
+
+			if (victim != w && (t = take_mailbox(victim, prio, w)) != NULL) {
+				w->counters.mailbox_steals++;
+				return t;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Highest priority first, and within a priority the worker's own deque,
+ * then its mailbox, then the shared queue. Only then steal.
+ */
+static os_task_t *find_task(os_threadpool_t *tp, os_worker_t *w)
 {
-	os_task_t *t = NULL;
+	os_task_t *t;
 
-	// Wait for the first enqueue to happen
-	// When it happens all the threads waiting will escape, and they'll block
-	// at the next mutex
-	pthread_mutex_lock(&tp->enqueue_mutex);
-	while (!atomic_load(&tp->enqueued_tasks)) {
-		// Increase the number of waiting threads
-		pthread_mutex_lock(&tp->waiting_mutex);
-		atomic_fetch_add(&tp->waiting_threads, 1);
-		pthread_mutex_unlock(&tp->waiting_mutex);
+	for (unsigned int prio = 0; prio < OS_TASK_PRIORITIES; prio++) {
+		if (tp->mode == OS_TP_WORK_STEALING && (t = take_local(w, prio)) != NULL) {
+			w->counters.local++;
+			return t;
+		}
+		if ((t = take_mailbox(w, prio, w)) != NULL) {
+			w->counters.mailbox++;
+			return t;
+		}
+		if ((t = take_shared(tp, prio, w)) != NULL) {
+			w->counters.shared++;
+			return t;
+		}
+	}
 
-		pthread_cond_wait(&tp->enqueue_signal, &tp->enqueue_mutex);
-		atomic_fetch_sub(&tp->waiting_threads, 1);
+	return ws_steal(w);
+}
 
-		break;
+/*
+ * Get a task for worker w, idling while there is nothing to run: poll with
+ * cpu_relax() for up to the worker's spin budget, then with sched_yield(),
+ * then park on the worker's futex. The budget grows when spinning pays off
+ * and shrinks when the worker ends up parking anyway. Only workers take
+ * tasks, as run_task() accounts for the job's pending tasks and parking
+ * needs a futex of the worker. Return NULL when the pool is shutting down.
+ */
+static os_task_t *dequeue_task(os_worker_t *w)
+{
+	os_threadpool_t *tp = w->tp;
+	unsigned int budget = w->spin_budget;
+	unsigned int epoch;
+	unsigned long long park_start = 0;
+	os_task_t *t;
+	int parked, woken;
+
+	for (unsigned int i = 0; i < budget; i++) {
+		t = find_task(tp, w);
+		if (t != NULL || atomic_load(&tp->shutdown)) {
+			w->spin_budget = 2 * w->spin_budget + 1;
+			if (w->spin_budget > tp->idle.spin_rounds)
+				w->spin_budget = tp->idle.spin_rounds;
+			return t;
+		}
+		cpu_relax();
 	}
-	pthread_mutex_unlock(&tp->enqueue_mutex);
 
-	// Wait until something is enqueued
-	pthread_mutex_lock(&tp->list_mutex);
-	while (queue_is_empty(tp)) {
-		atomic_fetch_add(&tp->waiting_threads, 1);
+	for (unsigned int i = 0; i < tp->idle.yield_rounds; i++) {
+		t = find_task(tp, w);
+		if (t != NULL || atomic_load(&tp->shutdown))
+			return t;
+		sched_yield();
+	}
+
+	w->spin_budget /= 2;
+
+	while (1) {
+		// Announce ourselves before the last check, so that any enqueue
+		// we miss sees us parked and bumps the epoch.
+		epoch = atomic_load(&w->park_epoch);
+		atomic_store(&w->parked, 1);
+		atomic_fetch_add(&tp->sleeping_threads, 1);
+		atomic_thread_fence(memory_order_seq_cst);
 
-		// If all threads are waiting here, then it is done
-		if (atomic_load(&tp->waiting_threads) == tp->num_threads) {
-			pthread_cond_broadcast(&tp->list_signal);
-			pthread_mutex_unlock(&tp->list_mutex);
-			return NULL;
+		t = find_task(tp, w);
+		if (t != NULL || atomic_load(&tp->shutdown)) {
+			atomic_store(&w->parked, 0);
+			atomic_fetch_sub(&tp->sleeping_threads, 1);
+			return t;
 		}
 
-		pthread_cond_wait(&tp->list_signal, &tp->list_mutex);
+		if (os_trace_enabled(&w->trace))
+			park_start = now_ns();
+
+		// Fails at once if the epoch moved since we read it
+		futex(&w->park_epoch, FUTEX_WAIT_PRIVATE, epoch);
+		// Whoever woke us cleared parked, a spurious wakeup did not
+		parked = 1;
+		woken = !atomic_compare_exchange_strong(&w->parked, &parked, 0);
+		atomic_fetch_sub(&tp->sleeping_threads, 1);
+
+		if (os_trace_enabled(&w->trace))
+			os_trace_record(&w->trace, OS_TRACE_PARK, park_start, now_ns(), woken, 0);
 
-		// If the thread recieved a signal, then it could be a signal
-		// to leave the program, sent from if block from above
-		if (atomic_load(&tp->waiting_threads) == tp->num_threads) {
-			pthread_mutex_unlock(&tp->list_mutex);
-			return NULL;
+		w->stats.parks++;
+		if (woken) {
+			unsigned long long latency = now_ns() -
+				atomic_load_explicit(&w->wake_time, memory_order_relaxed);
+
+			w->stats.wakeups++;
+			w->stats.wake_latency_ns += latency;
+			if (latency > w->stats.max_wake_latency_ns)
+				w->stats.max_wake_latency_ns = latency;
 		}
+	}
+}
 
-		atomic_fetch_sub(&tp->waiting_threads, 1);
+/* Tasks waiting in the queues w takes from. */
+static unsigned long long queued_tasks(os_threadpool_t *tp, os_worker_t *w)
+{
+	unsigned long long n = 0;
+
+	for (unsigned int prio = 0; prio < OS_TASK_PRIORITIES; prio++) {
+		n += os_deque_size(&w->deque[prio]);
+		n += atomic_load_explicit(&w->mailbox_tasks[prio], memory_order_relaxed);
+		n += atomic_load_explicit(&tp->enqueued_tasks[prio], memory_order_relaxed);
 	}
-	t = list_entry(tp->head.next, os_task_t, list);
-	list_del(tp->head.next);
-	pthread_mutex_unlock(&tp->list_mutex);
 
-	return t;
+	return n;
+}
+
+/*
+ * Run t on w, which took it at start, then wake the waiter of the job if
+ * it was the last pending task. The counters of w are updated before that,
+ * so they are complete once the job is. Return when t ended.
+ */
+static unsigned long long run_task(os_worker_t *w, os_task_t *t, unsigned long long start)
+{
+	os_threadpool_t *tp = w->tp;
+	os_worker_stats_t *c = &w->counters;
+	void (*action)(void *) = t->action;
+	unsigned long long end;
+
+	if (t->enqueue_ns != 0)
+		c->latency_hist[hist_bucket(start - t->enqueue_ns)]++;
+	if (c->tasks % OS_TP_SAMPLE_PERIOD == 0)
+		c->queue_depth_hist[hist_bucket(queued_tasks(tp, w))]++;
+
+	t->action(t->argument);
+	destroy_task(t);
+
+	end = now_ns();
+	c->tasks++;
+	c->busy_ns += end - start;
+	os_trace_record(&w->trace, OS_TRACE_TASK, start, end, (uintptr_t)action, 0);
+
+	if (atomic_fetch_sub(&tp->pending_tasks, 1) == 1) {
+		pthread_mutex_lock(&tp->done_mutex);
+		tp->jobs_done++;
+		pthread_cond_broadcast(&tp->done_signal);
+		pthread_mutex_unlock(&tp->done_mutex);
+	}
+
+	return end;
 }
 
 /* Loop function for threads */
 static void *thread_loop_function(void *arg)
 {
-	os_threadpool_t *tp = (os_threadpool_t *) arg;
+	os_worker_t *w = (os_worker_t *) arg;
+	unsigned long long idle_since = now_ns();
+
+	current_worker = w;
 
 	while (1) {
 		os_task_t *t;
+		unsigned long long start;
 
-		t = dequeue_task(tp);
+		t = dequeue_task(w);
+		start = now_ns();
+		w->counters.idle_ns += start - idle_since;
 		if (t == NULL)
 			break;
-		t->action(t->argument);
-		destroy_task(t);
+		idle_since = run_task(w, t, start);
 	}
 
 	return NULL;
 }
 
-/* Wait completion of all threads. This is to be called by the main thread. */
+/*
+ * Wait until every task enqueued so far, and everything they spawned, is
+ * done. The workers stay around for the next job. Must not be called from
+ * a worker of tp.
+ */
 void wait_for_completion(os_threadpool_t *tp)
 {
-	/* Join all worker threads. */
-	for (unsigned int i = 0; i < tp->num_threads; i++)
-		pthread_join(tp->threads[i], NULL);
+	pthread_mutex_lock(&tp->done_mutex);
+	while (atomic_load(&tp->pending_tasks) != 0)
+		pthread_cond_wait(&tp->done_signal, &tp->done_mutex);
+	pthread_mutex_unlock(&tp->done_mutex);
+
+	/* The workers are idle: combine and reset their partial reductions. */
+	tp->reduction = tp->external_acc;
+	os_reduction_init(&tp->external_acc);
+	for (unsigned int i = 0; i < tp->num_threads; i++) {
+		os_reduction_merge(&tp->reduction, &tp->workers[i].acc);
+		os_reduction_init(&tp->workers[i].acc);
+	}
+}
+
+/* Run a job: root and all the tasks it spawns. */
+void threadpool_run(os_threadpool_t *tp, os_task_t *root)
+{
+	enqueue_task(tp, root);
+	wait_for_completion(tp);
+}
+
+static os_reduction_t *reduce_begin(os_threadpool_t *tp)
+{
+	os_worker_t *w = current_worker;
+
+	if (w != NULL && w->tp == tp)
+		return &w->acc;
+
+	pthread_mutex_lock(&tp->reduce_mutex);
+	return &tp->external_acc;
+}
+
+static void reduce_end(os_threadpool_t *tp, os_reduction_t *acc)
+{
+	if (acc == &tp->external_acc)
+		pthread_mutex_unlock(&tp->reduce_mutex);
+}
+
+/*
+ * Fold a partial reduction into the pool's result. From a worker of tp this
+ * only touches the worker's own accumulator, tasks that report many values
+ * should still reduce them locally first.
+ */
+void threadpool_reduce(os_threadpool_t *tp, const os_reduction_t *partial)
+{
+	os_reduction_t *acc = reduce_begin(tp);
+
+	os_reduction_merge(acc, partial);
+	reduce_end(tp, acc);
+}
+
+void threadpool_reduce_value(os_threadpool_t *tp, long long value)
+{
+	os_reduction_t *acc = reduce_begin(tp);
+
+	os_reduction_add(acc, value);
+	reduce_end(tp, acc);
+}
+
+static int read_topology(int cpu, const char *name)
+{
+	char path[128];
+	FILE *file;
+	int id = 0;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+	file = fopen(path, "r");
+	if (file == NULL)
+		return 0;
+	if (fscanf(file, "%d", &id) != 1)
+		id = 0;
+	fclose(file);
+
+	return id;
+}
+
+static int compare_compact(const void *a, const void *b)
+{
+	const cpu_slot_t *x = a, *y = b;
+
+	if (x->package != y->package)
+		return x->package - y->package;
+	if (x->core_rank != y->core_rank)
+		return x->core_rank - y->core_rank;
+	if (x->smt != y->smt)
+		return x->smt - y->smt;
+	return x->cpu - y->cpu;
+}
+
+static int compare_scatter(const void *a, const void *b)
+{
+	const cpu_slot_t *x = a, *y = b;
+
+	if (x->smt != y->smt)
+		return x->smt - y->smt;
+	if (x->core_rank != y->core_rank)
+		return x->core_rank - y->core_rank;
+	if (x->package != y->package)
+		return x->package - y->package;
+	return x->cpu - y->cpu;
+}
+
+/*
+ * Pin the workers of every pool created from now on, following policy over
+ * the CPUs this process is allowed to run on. Not thread safe, call it
+ * before creating any pool.
+ */
+void set_threadpool_affinity(os_affinity_t policy)
+{
+	cpu_set_t allowed;
+	cpu_slot_t *slots;
+	unsigned int n = 0;
+
+	free(affinity_cpus);
+	affinity_cpus = NULL;
+	affinity_num_cpus = 0;
+
+	if (policy == OS_AFFINITY_NONE)
+		return;
+
+	DIE(sched_getaffinity(0, sizeof(allowed), &allowed) < 0, "sched_getaffinity");
+
+	slots = malloc(CPU_COUNT(&allowed) * sizeof(*slots));
+	DIE(slots == NULL, "malloc");
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &allowed))
+			continue;
+		slots[n].cpu = cpu;
+		slots[n].package = read_topology(cpu, "physical_package_id");
+		slots[n].core = read_topology(cpu, "core_id");
+		n++;
+	}
+
+	// CPUs come in increasing order, so earlier ones are lower siblings
+	for (unsigned int i = 0; i < n; i++) {
+		slots[i].core_rank = 0;
+		slots[i].smt = 0;
+		for (unsigned int j = 0; j < n; j++) {
+			if (slots[j].package != slots[i].package)
+				continue;
+			if (slots[j].core == slots[i].core) {
+				slots[i].smt += (j < i);
+				continue;
+			}
+			// Count distinct cores with a lower id, by their first CPU
+			if (slots[j].core < slots[i].core) {
+				unsigned int k;
+
+				for (k = 0; k < j; k++)
+					if (slots[k].package == slots[j].package &&
+							slots[k].core == slots[j].core)
+						break;
+				slots[i].core_rank += (k == j);
+			}
+		}
+	}
+
+	qsort(slots, n, sizeof(*slots),
+		policy == OS_AFFINITY_COMPACT ? &compare_compact : &compare_scatter);
+
+	affinity_cpus = malloc(n * sizeof(*affinity_cpus));
+	DIE(affinity_cpus == NULL, "malloc");
+	for (unsigned int i = 0; i < n; i++)
+		affinity_cpus[i] = slots[i].cpu;
+	affinity_num_cpus = n;
+
+	free(slots);
+}
+
+unsigned int get_num_online_cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? n : 1;
+}
+
+static void pin_worker(os_threadpool_t *tp, unsigned int i)
+{
+	cpu_set_t set;
+	int rc;
+
+	if (affinity_num_cpus == 0)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(affinity_cpus[i % affinity_num_cpus], &set);
+	rc = pthread_setaffinity_np(tp->threads[i], sizeof(set), &set);
+	if (rc != 0)
+		log_warn("pthread_setaffinity_np: %s", strerror(rc));
+}
+
+/*
+ * Default idle policy: spinning only helps if the workers have CPUs of
+ * their own, skip it when they outnumber the online CPUs. $OS_TP_SPIN and
+ * $OS_TP_YIELD override the defaults.
+ */
+static void init_idle_policy(os_threadpool_t *tp, unsigned int num_threads)
+{
+	const char *spin = getenv("OS_TP_SPIN");
+	const char *yield = getenv("OS_TP_YIELD");
+
+	tp->idle.spin_rounds = num_threads > get_num_online_cpus() ? 0 : IDLE_SPIN_ROUNDS;
+	tp->idle.yield_rounds = IDLE_YIELD_ROUNDS;
+
+	if (spin != NULL)
+		tp->idle.spin_rounds = strtoul(spin, NULL, 0);
+	if (yield != NULL)
+		tp->idle.yield_rounds = strtoul(yield, NULL, 0);
+}
+
+/*
+ * Change how idle workers wait for work. Takes effect the next time each
+ * worker runs out of work.
+ */
+void threadpool_set_idle_policy(os_threadpool_t *tp, unsigned int spin_rounds,
+		unsigned int yield_rounds)
+{
+	tp->idle.spin_rounds = spin_rounds;
+	tp->idle.yield_rounds = yield_rounds;
+}
+
+/* Sum of the idle statistics of all workers. Only exact while tp is idle. */
+void threadpool_get_idle_stats(os_threadpool_t *tp, os_idle_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	for (unsigned int i = 0; i < tp->num_threads; i++) {
+		const os_idle_stats_t *w = &tp->workers[i].stats;
+
+		stats->parks += w->parks;
+		stats->wakeups += w->wakeups;
+		stats->wake_latency_ns += w->wake_latency_ns;
+		if (w->max_wake_latency_ns > stats->max_wake_latency_ns)
+			stats->max_wake_latency_ns = w->max_wake_latency_ns;
+	}
+	stats->futex_wakes = atomic_load(&tp->futex_wakes);
+}
+
+/*
+ * Counters of one worker. Only exact while tp is idle: a job's counters are
+ * complete once wait_for_completion() returned, except for the idle time
+ * since its last task, which is added when the worker gets the next one.
+ */
+void threadpool_get_worker_stats(os_threadpool_t *tp, unsigned int worker,
+		os_worker_stats_t *stats)
+{
+	*stats = tp->workers[worker].counters;
+}
+
+static void add_hist(unsigned long long *sum, const unsigned long long *hist)
+{
+	for (unsigned int i = 0; i < OS_TP_HIST_BUCKETS; i++)
+		sum[i] += hist[i];
+}
+
+static void add_lock_stats(os_lock_stats_t *sum, const os_lock_stats_t *s)
+{
+	sum->acquired += s->acquired;
+	sum->contended += s->contended;
+	sum->wait_ns += s->wait_ns;
+	if (s->max_wait_ns > sum->max_wait_ns)
+		sum->max_wait_ns = s->max_wait_ns;
+	add_hist(sum->wait_hist, s->wait_hist);
+}
+
+/* Counters of all workers added up, same caveats as for a single one. */
+void threadpool_get_stats(os_threadpool_t *tp, os_worker_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	for (unsigned int i = 0; i < tp->num_threads; i++) {
+		const os_worker_stats_t *w = &tp->workers[i].counters;
+
+		stats->tasks += w->tasks;
+		stats->busy_ns += w->busy_ns;
+		stats->idle_ns += w->idle_ns;
+		stats->enqueued += w->enqueued;
+		stats->local += w->local;
+		stats->mailbox += w->mailbox;
+		stats->shared += w->shared;
+		stats->steals += w->steals;
+		stats->mailbox_steals += w->mailbox_steals;
+		stats->steal_aborts += w->steal_aborts;
+		add_lock_stats(&stats->list_lock, &w->list_lock);
+		add_lock_stats(&stats->mailbox_lock, &w->mailbox_lock);
+		add_hist(stats->queue_depth_hist, w->queue_depth_hist);
+		add_hist(stats->latency_hist, w->latency_hist);
+	}
+}
+
+static void dump_stats(FILE *file, const char *name, const os_worker_stats_t *s)
+{
+	unsigned long long total_ns = s->busy_ns + s->idle_ns;
+
+	fprintf(file, "%s: %llu tasks, busy %.3f ms, idle %.3f ms (%.1f%% busy), %llu enqueued\n",
+		name, s->tasks, s->busy_ns / 1e6, s->idle_ns / 1e6,
+		total_ns ? 100.0 * s->busy_ns / total_ns : 0.0, s->enqueued);
+	fprintf(file, "  taken: %llu local, %llu mailbox, %llu shared, %llu stolen "
+		"(%llu aborted), %llu from other mailboxes\n",
+		s->local, s->mailbox, s->shared, s->steals, s->steal_aborts, s->mailbox_steals);
+	fprintf(file, "  list_mutex: %llu acquired, %llu contended, %.1f us waited, %.1f us max\n",
+		s->list_lock.acquired, s->list_lock.contended,
+		s->list_lock.wait_ns / 1e3, s->list_lock.max_wait_ns / 1e3);
+	fprintf(file, "  mailbox_mutex: %llu acquired, %llu contended, %.1f us waited, %.1f us max\n",
+		s->mailbox_lock.acquired, s->mailbox_lock.contended,
+		s->mailbox_lock.wait_ns / 1e3, s->mailbox_lock.max_wait_ns / 1e3);
+}
+
+/* Print the non-empty buckets of hist as "[low, high) count". */
+static void dump_hist(FILE *file, const char *name, const unsigned long long *hist)
+{
+	fprintf(file, "%s:", name);
+	for (unsigned int i = 0; i < OS_TP_HIST_BUCKETS; i++) {
+		if (hist[i] == 0)
+			continue;
+		if (i == 0)
+			fprintf(file, " [0] %llu", hist[i]);
+		else if (i == OS_TP_HIST_BUCKETS - 1)
+			fprintf(file, " [%llu, -) %llu", 1ULL << (i - 1), hist[i]);
+		else
+			fprintf(file, " [%llu, %llu) %llu", 1ULL << (i - 1), 1ULL << i, hist[i]);
+	}
+	fprintf(file, "\n");
+}
+
+/* Print the counters of every worker, their total and its histograms. */
+void threadpool_dump_stats(os_threadpool_t *tp, FILE *file)
+{
+	os_worker_stats_t total;
+	unsigned long long jobs;
+	char name[32];
+
+	pthread_mutex_lock(&tp->done_mutex);
+	jobs = tp->jobs_done;
+	pthread_mutex_unlock(&tp->done_mutex);
+
+	fprintf(file, "threadpool: %u workers, %llu jobs, %llu tasks enqueued from outside\n",
+		tp->num_threads, jobs, atomic_load(&tp->external_enqueues));
+
+	for (unsigned int i = 0; i < tp->num_threads; i++) {
+		snprintf(name, sizeof(name), "worker %u", i);
+		dump_stats(file, name, &tp->workers[i].counters);
+	}
+
+	threadpool_get_stats(tp, &total);
+	dump_stats(file, "total", &total);
+	dump_hist(file, "list_mutex wait (ns)", total.list_lock.wait_hist);
+	dump_hist(file, "mailbox_mutex wait (ns)", total.mailbox_lock.wait_hist);
+	dump_hist(file, "task latency (ns)", total.latency_hist);
+	dump_hist(file, "queue depth", total.queue_depth_hist);
+}
+
+static void write_trace_event(FILE *file, const os_trace_event_t *e,
+		unsigned long long epoch, int pid, unsigned int tid)
+{
+	double ts = (e->start - epoch) / 1e3;
+	double dur = (e->end - e->start) / 1e3;
+
+	switch (e->type) {
+	case OS_TRACE_TASK:
+		fprintf(file, ",\n{\"ph\": \"X\", \"name\": \"task\", \"pid\": %d, \"tid\": %u, "
+			"\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"action\": \"%#llx\"}}",
+			pid, tid, ts, dur, e->arg);
+		break;
+	case OS_TRACE_PARK:
+		fprintf(file, ",\n{\"ph\": \"X\", \"name\": \"parked\", \"pid\": %d, \"tid\": %u, "
+			"\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"woken\": %llu}}",
+			pid, tid, ts, dur, e->arg);
+		break;
+	case OS_TRACE_ENQUEUE:
+		fprintf(file, ",\n{\"ph\": \"i\", \"s\": \"t\", \"name\": \"enqueue\", "
+			"\"pid\": %d, \"tid\": %u, \"ts\": %.3f, "
+			"\"args\": {\"worker\": %d, \"priority\": %u}}",
+			pid, tid, ts, (int)(unsigned int)e->arg, e->aux);
+		break;
+	case OS_TRACE_WAKE:
+		fprintf(file, ",\n{\"ph\": \"i\", \"s\": \"t\", \"name\": \"wake\", "
+			"\"pid\": %d, \"tid\": %u, \"ts\": %.3f, \"args\": {\"worker\": %llu}}",
+			pid, tid, ts, e->arg);
+		break;
+	}
+}
+
+/*
+ * Write the events the workers recorded as Chrome trace event JSON, one
+ * track per worker. Task actions are given by address. Only call it once
+ * the workers are gone. Return -1 if writing failed.
+ */
+int threadpool_write_trace(os_threadpool_t *tp, FILE *file)
+{
+	int pid = getpid();
+
+	fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+	fprintf(file, "{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": %d, "
+		"\"args\": {\"name\": \"threadpool\"}}", pid);
+
+	for (unsigned int i = 0; i < tp->num_threads; i++) {
+		const os_trace_ring_t *ring = &tp->workers[i].trace;
+
+		fprintf(file, ",\n{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": %d, "
+			"\"tid\": %u, \"args\": {\"name\": \"worker %u\"}}", pid, i, i);
+
+		if (ring->count > ring->size)
+			log_warn("Worker %u overwrote its first %llu trace events", i,
+				ring->count - ring->size);
+
+		for (unsigned long long j = 0; j < os_trace_kept(ring); j++)
+			write_trace_event(file, os_trace_event(ring, j), tp->trace_epoch, pid, i);
+	}
+
+	fprintf(file, "\n]}\n");
+
+	return ferror(file) || fflush(file) != 0 ? -1 : 0;
+}
+
+/*
+ * Tracing is off unless $OS_TP_TRACE names a file, which destroy_threadpool()
+ * writes the trace to; chrome://tracing and Perfetto open it. Each worker
+ * keeps its last $OS_TP_TRACE_EVENTS events. Return that number, 0 if off.
+ */
+static unsigned long long init_trace(os_threadpool_t *tp)
+{
+	const char *path = getenv("OS_TP_TRACE");
+	const char *events = getenv("OS_TP_TRACE_EVENTS");
+	unsigned long long size = TRACE_EVENTS;
+
+	tp->trace_path = NULL;
+	tp->trace_epoch = now_ns();
+
+	if (path == NULL || *path == '\0')
+		return 0;
+
+	tp->trace_path = strdup(path);
+	DIE(tp->trace_path == NULL, "strdup");
+	if (events != NULL && strtoull(events, NULL, 0) != 0)
+		size = strtoull(events, NULL, 0);
+
+	return size;
+}
+
+static void write_trace(os_threadpool_t *tp)
+{
+	FILE *file = fopen(tp->trace_path, "w");
+
+	if (file == NULL) {
+		log_error("Can't write trace to %s: %s", tp->trace_path, strerror(errno));
+		return;
+	}
+
+	if (threadpool_write_trace(tp, file) < 0)
+		log_error("Can't write trace to %s", tp->trace_path);
+	fclose(file);
 }
 
 /* Create a new threadpool. */
-os_threadpool_t *create_threadpool(unsigned int num_threads)
+os_threadpool_t *create_threadpool_mode(unsigned int num_threads, os_threadpool_mode_t mode)
 {
 	os_threadpool_t *tp = NULL;
+	unsigned long long trace_events;
 	int rc;
 
 	tp = malloc(sizeof(*tp));
 	DIE(tp == NULL, "malloc");
 
-	list_init(&tp->head);
+	tp->mode = mode;
+	for (unsigned int i = 0; i < OS_TASK_PRIORITIES; i++) {
+		list_init(&tp->head[i]);
+		atomic_store(&tp->enqueued_tasks[i], 0);
+	}
 
 	/* Synchronization data initialization */
-	atomic_store(&tp->waiting_threads, 0);
-	atomic_store(&tp->enqueued_tasks, 0);
-
 	pthread_mutex_init(&tp->list_mutex, NULL);
-	pthread_mutex_init(&tp->list_signal_mutex, NULL);
-	pthread_cond_init(&tp->list_signal, NULL);
 
-	pthread_mutex_init(&tp->enqueue_mutex, NULL);
-	pthread_cond_init(&tp->enqueue_signal, NULL);
+	atomic_store(&tp->pending_tasks, 0);
+	atomic_store(&tp->shutdown, 0);
+	pthread_mutex_init(&tp->done_mutex, NULL);
+	pthread_cond_init(&tp->done_signal, NULL);
+	tp->jobs_done = 0;
+
+	atomic_store(&tp->sleeping_threads, 0);
+	atomic_store(&tp->futex_wakes, 0);
+	atomic_store(&tp->external_enqueues, 0);
+	init_idle_policy(tp, num_threads);
 
-	pthread_mutex_init(&tp->waiting_mutex, NULL);
+	trace_events = init_trace(tp);
+
+	pthread_mutex_init(&tp->reduce_mutex, NULL);
+	os_reduction_init(&tp->external_acc);
+	os_reduction_init(&tp->reduction);
 
 	tp->num_threads = num_threads;
+	tp->workers = aligned_alloc(OS_CACHE_LINE, num_threads * sizeof(*tp->workers));
+	DIE(tp->workers == NULL, "aligned_alloc");
+	for (unsigned int i = 0; i < num_threads; ++i) {
+		os_worker_t *w = &tp->workers[i];
+
+		for (unsigned int j = 0; j < OS_TASK_PRIORITIES; j++) {
+			os_deque_init(&w->deque[j]);
+			list_init(&w->mailbox[j]);
+			atomic_init(&w->mailbox_tasks[j], 0);
+		}
+		pthread_mutex_init(&w->mailbox_mutex, NULL);
+		atomic_init(&w->parked, 0);
+		atomic_init(&w->park_epoch, 0);
+		atomic_init(&w->wake_time, 0);
+		tp->workers[i].tp = tp;
+		tp->workers[i].id = i;
+		tp->workers[i].seed = 2654435761u * (i + 1);
+		tp->workers[i].slabs = NULL;
+		tp->workers[i].free_tasks = NULL;
+		atomic_init(&tp->workers[i].remote_free_tasks, NULL);
+		os_reduction_init(&tp->workers[i].acc);
+		tp->workers[i].spin_budget = tp->idle.spin_rounds;
+		memset(&tp->workers[i].stats, 0, sizeof(tp->workers[i].stats));
+		memset(&tp->workers[i].counters, 0, sizeof(tp->workers[i].counters));
+		os_trace_init(&tp->workers[i].trace, trace_events);
+	}
+
 	tp->threads = malloc(num_threads * sizeof(*tp->threads));
 	DIE(tp->threads == NULL, "malloc");
 	for (unsigned int i = 0; i < num_threads; ++i) {
-		rc = pthread_create(&tp->threads[i], NULL, &thread_loop_function, (void *) tp);
-		DIE(rc < 0, "pthread_create");
+		rc = pthread_create(&tp->threads[i], NULL, &thread_loop_function,
+				(void *) &tp->workers[i]);
+		// Returns the error instead of setting errno, which DIE reports
+		errno = rc;
+		DIE(rc != 0, "pthread_create");
+		pin_worker(tp, i);
 	}
 
 	return tp;
 }
 
-/* Destroy a threadpool. Assume all threads have been joined. */
+os_threadpool_t *create_threadpool(unsigned int num_threads)
+{
+	return create_threadpool_mode(num_threads, OS_TP_SHARED_QUEUE);
+}
+
+/* Stop and join the workers, then destroy the threadpool. */
 void destroy_threadpool(os_threadpool_t *tp)
 {
+	atomic_store(&tp->shutdown, 1);
+
+	atomic_thread_fence(memory_order_seq_cst);
+	notify_workers(tp, NULL, UINT_MAX);
+
+	for (unsigned int i = 0; i < tp->num_threads; i++)
+		pthread_join(tp->threads[i], NULL);
+
+	if (getenv("OS_TP_STATS") != NULL)
+		threadpool_dump_stats(tp, stderr);
+	if (tp->trace_path != NULL)
+		write_trace(tp);
+
 	pthread_mutex_destroy(&tp->list_mutex);
-	pthread_mutex_destroy(&tp->list_signal_mutex);
-	pthread_cond_destroy(&tp->list_signal);
 
-	pthread_mutex_destroy(&tp->enqueue_mutex);
-	pthread_cond_destroy(&tp->enqueue_signal);
+	pthread_mutex_destroy(&tp->done_mutex);
+	pthread_cond_destroy(&tp->done_signal);
+
 
-	pthread_mutex_destroy(&tp->waiting_mutex);
+	pthread_mutex_destroy(&tp->reduce_mutex);
 
 	os_list_node_t *n, *p;
 
-	list_for_each_safe(n, p, &tp->head) {
-		list_del(n);
-		destroy_task(list_entry(n, os_task_t, list));
+	for (unsigned int j = 0; j < OS_TASK_PRIORITIES; j++) {
+		list_for_each_safe(n, p, &tp->head[j]) {
+			list_del(n);
+			destroy_task(list_entry(n, os_task_t, list));
+		}
+	}
+
+	for (unsigned int i = 0; i < tp->num_threads; i++) {
+		os_worker_t *w = &tp->workers[i];
+		os_task_t *t;
+
+		for (unsigned int j = 0; j < OS_TASK_PRIORITIES; j++) {
+			while ((t = os_deque_take(&w->deque[j])) != NULL)
+				destroy_task(t);
+			os_deque_destroy(&w->deque[j]);
+
+			list_for_each_safe(n, p, &w->mailbox[j]) {
+				list_del(n);
+				destroy_task(list_entry(n, os_task_t, list));
+			}
+		}
+		pthread_mutex_destroy(&w->mailbox_mutex);
+	}
+
+	// Tasks are only ever recycled, their memory goes away with the slabs
+	for (unsigned int i = 0; i < tp->num_threads; i++) {
+		os_task_slab_t *slab = tp->workers[i].slabs;
+
+		while (slab != NULL) {
+			os_task_slab_t *next = slab->next;
+
+			free(slab);
+			slab = next;
+		}
 	}
 
+	for (unsigned int i = 0; i < tp->num_threads; i++)
+		os_trace_destroy(&tp->workers[i].trace);
+	free(tp->trace_path);
+
+	free(tp->workers);
 	free(tp->threads);
 	free(tp);
 }
+
+typedef struct parallel_job {
+	os_threadpool_t *tp;
+	void (*action)(void *arg);
+	char *args;
+	size_t arg_size;
+	unsigned int count;
+} parallel_job_t;
+
+/*
+ * Root task of a parallel run. Enqueueing from a worker goes to its own
+ * deque without locking, and idle workers steal from there.
+ */
+static void spawn_items(void *arg)
+{
+	parallel_job_t *job = arg;
+
+	for (unsigned int i = 1; i < job->count; i++)
+		enqueue_task(job->tp, create_task(job->action,
+					job->args + i * job->arg_size, NULL));
+	job->action(job->args);
+}
+
+/*
+ * Run action on each of the count items of the args array, each arg_size
+ * bytes long, as one job on tp. Return when all are done.
+ */
+void run_parallel(os_threadpool_t *tp, void (*action)(void *),
+		void *args, size_t arg_size, unsigned int count)
+{
+	parallel_job_t job = {
+		.tp = tp,
+		.action = action,
+		.args = args,
+		.arg_size = arg_size,
+		.count = count,
+	};
+
+	if (count == 0)
+		return;
+
+	threadpool_run(tp, create_task(&spawn_items, &job, NULL));
+}
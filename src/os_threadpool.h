@@ -3,54 +3,273 @@
 #ifndef __OS_THREADPOOL_H__
 #define __OS_THREADPOOL_H__	1
 
+#ifndef _XOPEN_SOURCE
 #define _XOPEN_SOURCE 600
+#endif
 #include <pthread.h>
+#include <stdio.h>
 #include <stdatomic.h>
 #include "os_list.h"
+#include "os_deque.h"
+#include "os_reduce.h"
+#include "os_trace.h"
 
 #define OS_TASK_FIRST_MEMBER argument
 
+/* Arguments up to this size can be stored in the task itself. */
+#define OS_TASK_INLINE_SIZE	32
+/* Tasks carved out of one slab by a worker. */
+#define OS_TASK_SLAB_SIZE	256
+
+/*
+ * Task priorities, 0 being the most urgent. A worker runs everything it
+ * can find at one level before looking at the next one.
+ */
+#define OS_TASK_PRIORITIES	4
+#define OS_TASK_PRIO_HIGH	0
+#define OS_TASK_PRIO_NORMAL	1
+#define OS_TASK_PRIO_LOW	(OS_TASK_PRIORITIES - 1)
+
+/* No preferred worker, the task goes wherever it is enqueued. */
+#define OS_TASK_ANY_WORKER	((unsigned int)-1)
+
+struct os_worker_t;
+
 typedef struct {
 	void *argument;
 	void (*action)(void *arg);
 	void (*destroy_arg)(void *arg);
 	os_list_node_t list;
+	/* Worker whose slab holds the task, NULL if it came from malloc(). */
+	struct os_worker_t *owner;
+	/* Scheduling hints, see set_task_priority() and set_task_worker(). */
+	unsigned int priority;
+	unsigned int worker;
+	/* When a sampled task was enqueued, 0 for the others. */
+	unsigned long long enqueue_ns;
+	unsigned char inline_arg[OS_TASK_INLINE_SIZE] __attribute__((aligned(16)));
 } os_task_t;
 
+typedef struct os_task_slab_t {
+	struct os_task_slab_t *next;
+	os_task_t tasks[OS_TASK_SLAB_SIZE];
+} os_task_slab_t;
+
+typedef enum os_threadpool_mode_t {
+	/* Shared queues, one per priority, protected by list_mutex. */
+	OS_TP_SHARED_QUEUE = 0,
+	/*
+	 * Per-worker deques. Tasks enqueued by a worker go to its own deque
+	 * without locking, idle workers steal from random victims. Tasks
+	 * enqueued from outside the pool go through the shared queue.
+	 */
+	OS_TP_WORK_STEALING,
+} os_threadpool_mode_t;
+
+typedef enum os_affinity_t {
+	/* Leave placement to the scheduler. */
+	OS_AFFINITY_NONE = 0,
+	/* Fill one package core by core, SMT siblings next to each other. */
+	OS_AFFINITY_COMPACT,
+	/* Spread over packages and cores before doubling up on SMT siblings. */
+	OS_AFFINITY_SCATTER,
+} os_affinity_t;
+
+/* How an idle worker waits for work, see dequeue_task(). */
+typedef struct os_idle_policy_t {
+	/* Polls with a pause instruction in between, before yielding. */
+	unsigned int spin_rounds;
+	/* Polls with sched_yield() in between, before parking. */
+	unsigned int yield_rounds;
+} os_idle_policy_t;
+
+typedef struct os_idle_stats_t {
+	/* FUTEX_WAIT calls, and how many of them ended with a wakeup. */
+	unsigned long long parks;
+	unsigned long long wakeups;
+	/* FUTEX_WAKE calls, made only while some worker is parked. */
+	unsigned long long futex_wakes;
+	/* From the FUTEX_WAKE call to the woken worker running again. */
+	unsigned long long wake_latency_ns;
+	unsigned long long max_wake_latency_ns;
+} os_idle_stats_t;
+
+/*
+ * Histograms count values by power of two: bucket 0 holds 0, bucket i
+ * values in [2^(i-1), 2^i) and the last one everything larger.
+ */
+#define OS_TP_HIST_BUCKETS	32
+/* One task out of this many is timestamped for the histograms. */
+#define OS_TP_SAMPLE_PERIOD	64
+
+typedef struct os_lock_stats_t {
+	/* Acquisitions, and how many found the mutex taken. */
+	unsigned long long acquired;
+	unsigned long long contended;
+	/* Time spent blocked in contended acquisitions. */
+	unsigned long long wait_ns;
+	unsigned long long max_wait_ns;
+	unsigned long long wait_hist[OS_TP_HIST_BUCKETS];
+} os_lock_stats_t;
+
+/*
+ * What a worker did. Only the worker writes them, next to its other
+ * private fields, away from the cache lines other threads write. Counters
+ * are exact, the depth and latency histograms sample one task out of
+ * OS_TP_SAMPLE_PERIOD. Locks taken outside of the pool aren't accounted for.
+ */
+typedef struct os_worker_stats_t {
+	unsigned long long tasks;
+	/* Time running tasks, and between them, from the worker's start. */
+	unsigned long long busy_ns;
+	unsigned long long idle_ns;
+	unsigned long long enqueued;
+	/* Tasks taken from the own deque, the own mailbox, the shared queue. */
+	unsigned long long local;
+	unsigned long long mailbox;
+	unsigned long long shared;
+	/* Tasks taken from other workers' deques, and from their mailboxes. */
+	unsigned long long steals;
+	unsigned long long mailbox_steals;
+	/* Steals that lost a race for the top of a deque and were retried. */
+	unsigned long long steal_aborts;
+	os_lock_stats_t list_lock;
+	os_lock_stats_t mailbox_lock;
+	/* Tasks queued where the worker takes them from, when it takes one. */
+	unsigned long long queue_depth_hist[OS_TP_HIST_BUCKETS];
+	/* From enqueue_task() to the task starting, in ns. */
+	unsigned long long latency_hist[OS_TP_HIST_BUCKETS];
+} os_worker_stats_t;
+
+struct os_threadpool;
+
+typedef struct os_worker_t {
+	/* One deque per priority, only used in work stealing mode. */
+	os_deque_t deque[OS_TASK_PRIORITIES];
+	struct os_threadpool *tp;
+	unsigned int id;
+	unsigned int seed;
+
+	/*
+	 * Task allocator: slabs owned by this worker, tasks it freed itself
+	 * and, on their own cache line, tasks freed by any other thread.
+	 */
+	os_task_slab_t *slabs;
+	os_list_node_t *free_tasks;
+
+	/* Partial reduction of the values reported by this worker's tasks. */
+	os_reduction_t acc;
+
+	/* Current spin rounds, adapted between 0 and the policy's. */
+	unsigned int spin_budget;
+	os_idle_stats_t stats;
+	os_worker_stats_t counters;
+	/* Events of this worker, only recorded when tracing, see OS_TP_TRACE. */
+	os_trace_ring_t trace;
+	_Atomic(os_list_node_t *) remote_free_tasks __attribute__((aligned(OS_CACHE_LINE)));
+
+	/*
+	 * Tasks other threads want this worker to run, one list per priority.
+	 * Other workers only take them when they have nothing else to do.
+	 */
+	pthread_mutex_t mailbox_mutex __attribute__((aligned(OS_CACHE_LINE)));
+	_Atomic unsigned int mailbox_tasks[OS_TASK_PRIORITIES];
+	os_list_node_t mailbox[OS_TASK_PRIORITIES];
+
+	/*
+	 * Eventcount the worker parks on: it sets parked and sleeps on the
+	 * park_epoch futex, whoever clears parked bumps the epoch and wakes it.
+	 */
+	_Atomic int parked __attribute__((aligned(OS_CACHE_LINE)));
+	_Atomic unsigned int park_epoch;
+	_Atomic unsigned long long wake_time;
+} __attribute__((aligned(OS_CACHE_LINE))) os_worker_t;
+
 typedef struct os_threadpool {
+	os_threadpool_mode_t mode;
 	unsigned int num_threads;
 	pthread_t *threads;
+	os_worker_t *workers;
 
 	/* Synchronization data */
-	_Atomic unsigned int enqueued_tasks;
-	_Atomic unsigned int waiting_threads;
 	pthread_mutex_t list_mutex;
-	pthread_mutex_t waiting_mutex;
+	/* Tasks in each shared queue, lets workers skip list_mutex when empty. */
+	_Atomic unsigned int enqueued_tasks[OS_TASK_PRIORITIES];
 
-	pthread_cond_t list_signal;
-	pthread_mutex_t list_signal_mutex;
+	/*
+	 * Heads of the queues used to store tasks, one per priority.
+	 * First item is head[i].next, if head[i].next != &head[i] (i.e. if
+	 * queue is not empty).
+	 * Last item is head[i].prev, if head[i].prev != &head[i] (i.e. if
+	 * queue is not empty).
+	 */
+	os_list_node_t head[OS_TASK_PRIORITIES];
 
-	pthread_cond_t enqueue_signal;
-	pthread_mutex_t enqueue_mutex;
+	/*
+	 * Tasks enqueued but not finished yet. The pool is idle when it drops
+	 * to 0, which is what wait_for_completion() waits for. Workers only
+	 * exit once shutdown is set by destroy_threadpool().
+	 */
+	_Atomic unsigned int pending_tasks;
+	_Atomic int shutdown;
+	pthread_mutex_t done_mutex;
+	pthread_cond_t done_signal;
+	/* Number of times the pool went idle, i.e. of jobs completed. */
+	unsigned long long jobs_done;
 
 	/*
-	 * Head of queue used to store tasks.
-	 * First item is head.next, if head.next != head (i.e. if queue
-	 * is not empty).
-	 * Last item is head.prev, if head.prev != head (i.e. if queue
-	 * is not empty).
+	 * Parked workers, see os_worker_t. Enqueues only look for one to wake
+	 * while sleeping_threads != 0.
 	 */
-	os_list_node_t head;
+	os_idle_policy_t idle;
+	_Atomic unsigned int sleeping_threads;
+	_Atomic unsigned long long futex_wakes;
+	/* Tasks enqueued from outside the pool. */
+	_Atomic unsigned long long external_enqueues;
+
+	/* Where to write the workers' traces at shutdown, NULL if not tracing. */
+	char *trace_path;
+	unsigned long long trace_epoch;
+
+	/*
+	 * Values reported from outside the pool, and the reduction over all
+	 * workers of the last job, set by wait_for_completion().
+	 */
+	pthread_mutex_t reduce_mutex;
+	os_reduction_t external_acc;
+	os_reduction_t reduction;
 } os_threadpool_t;
 
 os_task_t *create_task(void (*f)(void *), void *arg, void (*destroy_arg)(void *));
+os_task_t *create_task_inline(void (*f)(void *), const void *arg, size_t size);
 void destroy_task(os_task_t *t);
+void set_task_priority(os_task_t *t, unsigned int priority);
+void set_task_worker(os_task_t *t, unsigned int worker);
+void set_task_locality(os_task_t *t, os_threadpool_t *tp, unsigned long long idx,
+		unsigned long long count);
 
 os_threadpool_t *create_threadpool(unsigned int num_threads);
+os_threadpool_t *create_threadpool_mode(unsigned int num_threads, os_threadpool_mode_t mode);
 void destroy_threadpool(os_threadpool_t *tp);
+void set_threadpool_affinity(os_affinity_t policy);
+void threadpool_set_idle_policy(os_threadpool_t *tp, unsigned int spin_rounds,
+		unsigned int yield_rounds);
+void threadpool_get_idle_stats(os_threadpool_t *tp, os_idle_stats_t *stats);
+void threadpool_get_worker_stats(os_threadpool_t *tp, unsigned int worker,
+		os_worker_stats_t *stats);
+void threadpool_get_stats(os_threadpool_t *tp, os_worker_stats_t *stats);
+void threadpool_dump_stats(os_threadpool_t *tp, FILE *file);
+int threadpool_write_trace(os_threadpool_t *tp, FILE *file);
+unsigned int get_num_online_cpus(void);
 
 void enqueue_task(os_threadpool_t *q, os_task_t *t);
-os_task_t *dequeue_task(os_threadpool_t *tp);
 void wait_for_completion(os_threadpool_t *tp);
+void threadpool_run(os_threadpool_t *tp, os_task_t *root);
+
+void threadpool_reduce(os_threadpool_t *tp, const os_reduction_t *partial);
+void threadpool_reduce_value(os_threadpool_t *tp, long long value);
+
+void run_parallel(os_threadpool_t *tp, void (*action)(void *),
+		void *args, size_t arg_size, unsigned int count);
 
 #endif
@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __OS_TIME_H__
+#define __OS_TIME_H__	1
+
+#include <time.h>
+
+/* Monotonic wall clock time, in seconds. */
+static inline double os_time_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#endif
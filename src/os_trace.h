@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+/*
+ * Ring of timestamped events, owned by a single thread which records into
+ * it without locking. It is allocated and touched up front, so recording
+ * never allocates nor faults; once it is full, new events overwrite the
+ * oldest ones. Reading it is only safe once the owner is done with it.
+ */
+
+#ifndef __OS_TRACE_H__
+#define __OS_TRACE_H__	1
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+typedef enum os_trace_type_t {
+	/* Spans from start to end. */
+	OS_TRACE_TASK,
+	OS_TRACE_PARK,
+	/* Instants, end is start. */
+	OS_TRACE_ENQUEUE,
+	OS_TRACE_WAKE,
+} os_trace_type_t;
+
+typedef struct os_trace_event_t {
+	unsigned long long start;
+	unsigned long long end;
+	/* Meaning depends on the type, see the recording code. */
+	unsigned long long arg;
+	unsigned int aux;
+	unsigned int type;
+} os_trace_event_t;
+
+typedef struct os_trace_ring_t {
+	os_trace_event_t *events;
+	/* A power of two, 0 if tracing is off. */
+	unsigned long long size;
+	/* Events recorded so far, the last size of them are kept. */
+	unsigned long long count;
+} os_trace_ring_t;
+
+/* Set up ring for size events, rounded up to a power of two, 0 for none. */
+static inline void os_trace_init(os_trace_ring_t *ring, unsigned long long size)
+{
+	ring->events = NULL;
+	ring->size = 0;
+	ring->count = 0;
+
+	if (size == 0)
+		return;
+
+	ring->size = 1;
+	while (ring->size < size)
+		ring->size *= 2;
+
+	ring->events = malloc(ring->size * sizeof(*ring->events));
+	DIE(ring->events == NULL, "malloc");
+	memset(ring->events, 0, ring->size * sizeof(*ring->events));
+}
+
+static inline void os_trace_destroy(os_trace_ring_t *ring)
+{
+	free(ring->events);
+	ring->events = NULL;
+	ring->size = 0;
+}
+
+static inline int os_trace_enabled(const os_trace_ring_t *ring)
+{
+	return ring->size != 0;
+}
+
+static inline void os_trace_record(os_trace_ring_t *ring, os_trace_type_t type,
+		unsigned long long start, unsigned long long end,
+		unsigned long long arg, unsigned int aux)
+{
+	os_trace_event_t *e;
+
+	if (ring->size == 0)
+		return;
+
+	e = &ring->events[ring->count++ & (ring->size - 1)];
+	e->start = start;
+	e->end = end;
+	e->arg = arg;
+	e->aux = aux;
+	e->type = type;
+}
+
+/* Number of events still in ring. */
+static inline unsigned long long os_trace_kept(const os_trace_ring_t *ring)
+{
+	return ring->count < ring->size ? ring->count : ring->size;
+}
+
+/* The i-th oldest event still in ring, i below os_trace_kept(). */
+static inline const os_trace_event_t *os_trace_event(const os_trace_ring_t *ring,
+		unsigned long long i)
+{
+	return &ring->events[(ring->count - os_trace_kept(ring) + i) & (ring->size - 1)];
+}
+
+#endif
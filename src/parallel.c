@@ -1,115 +1,651 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <time.h>
 
+#include "os_bfs.h"
+#include "os_cc.h"
+#include "os_dyncc.h"
 #include "os_graph.h"
+#include "os_pagerank.h"
+#include "os_perf.h"
+#include "os_reorder.h"
+#include "os_simd.h"
+#include "os_sssp.h"
 #include "os_threadpool.h"
+#include "os_time.h"
 #include "log/log.h"
 #include "utils.h"
 
-#define NUM_THREADS		4
 #define STARTING_NODE	0
+/* Default number of node ids carried by one task, 0 for one task per node. */
+#define DEFAULT_BATCH_SIZE	64
+/* With -p, nodes of at least this many times the average degree are hubs. */
+#define HUB_DEGREE_FACTOR	8
+/* Neighbours filtered by one call of the SIMD kernel. */
+#define CLAIM_BLOCK		64
+
+/* Claimed node ids processed by one task, ids[0 .. count). */
+typedef struct node_batch {
+	unsigned int count;
+	unsigned int ids[];
+} node_batch_t;
+
+/* Counters of the last SSSP run, logged for every bucket width of -d. */
+typedef struct sssp_stats {
+	unsigned int num_buckets;
+	unsigned int num_phases;
+	unsigned long long relaxations;
+} sssp_stats_t;
 
-static _Atomic int sum;
 static os_graph_t *graph;
 static os_threadpool_t *tp;
+static unsigned int batch_size = DEFAULT_BATCH_SIZE;
+static unsigned int num_threads;
+static unsigned int num_runs = 1;
+static unsigned int *start_nodes;
+static unsigned int num_start_nodes;
+static int use_hints;
+static unsigned int hub_degree;
+static sssp_stats_t sssp_stats;
+
+static void parallel_process_node(void *idx_arg);
+static node_batch_t *create_batch(void);
+static void destroy_batch(void *batch);
+static void parallel_process_batch(void *batch);
+static void seed_start_nodes(void *unused);
+static void enqueue_node_task(os_task_t *t, unsigned int idx);
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-b] [-p] [-g batch_size] [-e engine] [-o output] [-t threads]\n"
+		"       [-s nodes] [-a affinity] [-n runs] [-d deltas] [-i iterations]\n"
+		"       [-r tolerance] [-R order] [-u updates] input_file\n", name);
+	fprintf(stderr, "  -b  track visited nodes in a bitset (1 bit per node)\n");
+	fprintf(stderr, "  -p  run tasks of hub nodes first, on the worker owning their range\n");
+	fprintf(stderr, "  -g  node ids per task, 0 for one task per node (default %d)\n",
+		DEFAULT_BATCH_SIZE);
+	fprintf(stderr, "  -e  traversal engine: flood (default), bfs, cc, sssp or pagerank\n");
+	fprintf(stderr, "  -o  write \"node level parent\" lines to output (bfs only),\n");
+	fprintf(stderr, "      \"node distance\" lines to output (sssp only)\n");
+	fprintf(stderr, "      or \"node component sum\" / \"node rank\" lines instead of stdout\n"
+		"      (cc and pagerank)\n");
+	fprintf(stderr, "  -t  worker threads, or $OS_NUM_THREADS (default: online CPUs)\n");
+	fprintf(stderr, "  -s  comma separated start nodes, or $OS_START_NODES (default %d)\n",
+		STARTING_NODE);
+	fprintf(stderr, "  -a  worker pinning: none (default), compact or scatter, or $OS_AFFINITY\n");
+	fprintf(stderr, "  -n  repeat the traversal on the same pool (flood, bfs and sssp only)\n");
+	fprintf(stderr, "  -d  comma separated bucket widths to time in turn (sssp only,\n"
+		"      default: the average edge weight over the average degree)\n");
+	fprintf(stderr, "  -i  maximum PageRank iterations (default %d)\n",
+		OS_PAGERANK_MAX_ITERATIONS);
+	fprintf(stderr, "  -r  PageRank convergence threshold on the L1 change (default %g)\n",
+		OS_PAGERANK_TOLERANCE);
+	fprintf(stderr, "  -R  relabel nodes after loading: none (default), degree, rcm or bfs,\n"
+		"      or $OS_GRAPH_ORDER; ids in input and output are unchanged\n");
+	fprintf(stderr, "  -u  apply the edge and value updates of a file after the components\n"
+		"      are found and print its queries' sums; -o then gets the final\n"
+		"      components (cc only)\n");
+	exit(EXIT_FAILURE);
+}
+
+/* Task per node or batch flood fill from the start nodes, return the sum. */
+static long long run_flood(int report)
+{
+	threadpool_run(tp, create_task(&seed_start_nodes, NULL, NULL));
+
+	if (report && getenv("OS_GRAPH_STATS") != NULL)
+		log_info("Reduced %llu nodes: sum %lld, min %lld, max %lld",
+			tp->reduction.count, tp->reduction.sum,
+			tp->reduction.min, tp->reduction.max);
+
+	return tp->reduction.sum;
+}
+
+/* Level-synchronous BFS engine, see os_bfs.c. */
+static long long run_bfs(const char *output, int report)
+{
+	os_bfs_result_t result;
+	long long sum;
+	FILE *file;
+
+	os_bfs(graph, start_nodes, num_start_nodes, tp, &result);
+
+	if (report && getenv("OS_GRAPH_STATS") != NULL)
+		log_info("BFS reached %u nodes in %u levels (%u top-down, %u bottom-up steps)",
+			result.num_reached, result.num_levels,
+			result.top_down_steps, result.bottom_up_steps);
+
+	if (report && output != NULL) {
+		file = fopen(output, "w");
+		DIE(file == NULL, "fopen");
+		DIE(os_bfs_write_result(&result, graph, file) < 0, "fprintf");
+		DIE(fclose(file) != 0, "fclose");
+	}
+
+	sum = result.sum;
+	os_bfs_result_destroy(&result);
+
+	return sum;
+}
+
+/* Delta-stepping shortest paths from the start nodes, see os_sssp.c. */
+static long long run_sssp(const char *output, int report, unsigned long long delta)
+{
+	os_sssp_result_t result;
+	long long sum;
+	FILE *file;
+
+	os_sssp(graph, start_nodes, num_start_nodes, delta, tp, &result);
+
+	if (report && getenv("OS_GRAPH_STATS") != NULL)
+		log_info("SSSP reached %u nodes through %u buckets in %u phases, %llu relaxations",
+			result.num_reached, result.num_buckets, result.num_phases,
+			result.relaxations);
+
+	if (report && output != NULL) {
+		file = fopen(output, "w");
+		DIE(file == NULL, "fopen");
+		DIE(write_graph_distances(graph, result.dist, file) < 0, "fprintf");
+		DIE(fclose(file) != 0, "fclose");
+	}
+
+	sum = result.sum;
+	sssp_stats.num_buckets = result.num_buckets;
+	sssp_stats.num_phases = result.num_phases;
+	sssp_stats.relaxations = result.relaxations;
+	os_sssp_result_destroy(&result);
+
+	return sum;
+}
+
+/*
+ * Parse the comma separated list of bucket widths given to -d into a new
+ * array of *count. Return NULL if it is malformed.
+ */
+static unsigned long long *parse_deltas(const char *list, unsigned int *count)
+{
+	unsigned long long *deltas;
+	unsigned int n = 1;
+	const char *p = list;
+	char *end;
+
+	for (const char *c = list; *c != '\0'; c++)
+		n += (*c == ',');
+
+	deltas = malloc(n * sizeof(*deltas));
+	DIE(deltas == NULL, "malloc");
+
+	for (unsigned int i = 0; i < n; i++) {
+		errno = 0;
+		deltas[i] = strtoull(p, &end, 10);
+		if (end == p || errno != 0 || deltas[i] == 0 || (*end != ',' && *end != '\0')) {
+			log_error("Invalid delta list \"%s\"", list);
+			free(deltas);
+			return NULL;
+		}
+		p = end + 1;
+	}
+
+	*count = n;
+	return deltas;
+}
+
+/* Connected components over the whole graph, see os_cc.c. */
+static void run_cc(const char *output, const char *updates)
+{
+	os_cc_result_t result;
+	FILE *file = stdout;
+
+	os_cc(graph, tp, &result);
+
+	if (getenv("OS_GRAPH_STATS") != NULL)
+		log_info("Found %u connected components", result.num_components);
+
+	if (updates != NULL) {
+		if (os_dyncc_run_file(graph, result.comp, updates, output) < 0)
+			exit(EXIT_FAILURE);
+		os_cc_result_destroy(&result);
+		return;
+	}
+
+	if (output != NULL) {
+		file = fopen(output, "w");
+		DIE(file == NULL, "fopen");
+	}
+	DIE(write_graph_components(graph, result.comp, result.sum, file) < 0, "fprintf");
+	if (output != NULL)
+		DIE(fclose(file) != 0, "fclose");
+
+	os_cc_result_destroy(&result);
+}
+
+/* PageRank over the whole graph, see os_pagerank.c. */
+static void run_pagerank(const char *output, const os_pagerank_params_t *params)
+{
+	os_pagerank_result_t result;
+	FILE *file = stdout;
+	double start = os_time_seconds(), elapsed;
+
+	os_pagerank(graph, params, tp, &result);
+	elapsed = os_time_seconds() - start;
+
+	if (getenv("OS_GRAPH_STATS") != NULL)
+		log_info("PageRank: %u iterations in %.3f ms (%.0f per second), L1 change %g",
+			result.iterations, elapsed * 1e3,
+			elapsed > 0 ? result.iterations / elapsed : 0.0, result.error);
 
-// Mutex used to read and write to visited array of the graph
-pthread_mutex_t visited_mutex;
+	if (output != NULL) {
+		file = fopen(output, "w");
+		DIE(file == NULL, "fopen");
+	}
+	DIE(write_graph_ranks(graph, result.rank, file) < 0, "fprintf");
+	if (output != NULL)
+		DIE(fclose(file) != 0, "fclose");
+
+	os_pagerank_result_destroy(&result);
+}
 
-static void *get_uint(unsigned int integer);
-static void destory_uint(void *heap_uint);
-static void parallel_process_node(void *heap_uint);
+static int parse_affinity(const char *name, os_affinity_t *policy)
+{
+	if (strcmp(name, "none") == 0)
+		*policy = OS_AFFINITY_NONE;
+	else if (strcmp(name, "compact") == 0)
+		*policy = OS_AFFINITY_COMPACT;
+	else if (strcmp(name, "scatter") == 0)
+		*policy = OS_AFFINITY_SCATTER;
+	else
+		return -1;
+
+	return 0;
+}
 
 int main(int argc, char *argv[])
 {
 	FILE *input_file;
+	const char *engine = "flood";
+	const char *output = NULL;
+	const char *updates = NULL;
+	const char *threads = getenv("OS_NUM_THREADS");
+	const char *starts = getenv("OS_START_NODES");
+	const char *affinity = getenv("OS_AFFINITY");
+	const char *order_name = getenv("OS_GRAPH_ORDER");
+	os_affinity_t policy = OS_AFFINITY_NONE;
+	os_order_t order = OS_ORDER_NONE;
+	os_perf_t perf;
+	unsigned long long count[OS_PERF_NUM_COUNTERS];
+	const char *delta_list = NULL;
+	unsigned long long *deltas = NULL;
+	unsigned int num_deltas = 1;
+	os_pagerank_params_t pr = {
+		.damping = OS_PAGERANK_DAMPING,
+		.tolerance = OS_PAGERANK_TOLERANCE,
+		.max_iterations = OS_PAGERANK_MAX_ITERATIONS,
+	};
+	int use_bitset = 0;
+	long long sum = 0;
+	double start;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:bd:g:e:i:n:o:pr:R:s:t:u:")) != -1) {
+		switch (opt) {
+		case 'b':
+			use_bitset = 1;
+			break;
+		case 'p':
+			use_hints = 1;
+			break;
+		case 'd':
+			delta_list = optarg;
+			break;
+		case 'i':
+			pr.max_iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			pr.tolerance = strtod(optarg, NULL);
+			break;
+		case 'R':
+			order_name = optarg;
+			break;
+		case 'g':
+			batch_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			engine = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 't':
+			threads = optarg;
+			break;
+		case 's':
+			starts = optarg;
+			break;
+		case 'a':
+			affinity = optarg;
+			break;
+		case 'n':
+			num_runs = strtoul(optarg, NULL, 0);
+			break;
+		case 'u':
+			updates = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (strcmp(engine, "flood") != 0 && strcmp(engine, "bfs") != 0 &&
+			strcmp(engine, "cc") != 0 && strcmp(engine, "sssp") != 0 &&
+			strcmp(engine, "pagerank") != 0)
+		usage(argv[0]);
+
+	if (delta_list != NULL && (strcmp(engine, "sssp") != 0 ||
+				(deltas = parse_deltas(delta_list, &num_deltas)) == NULL))
+		usage(argv[0]);
+
+	if (updates != NULL && strcmp(engine, "cc") != 0)
+		usage(argv[0]);
+
+	if (optind != argc - 1 || num_runs == 0)
+		usage(argv[0]);
 
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s input_file\n", argv[0]);
-		exit(EXIT_FAILURE);
+	num_threads = get_num_online_cpus();
+	if (threads != NULL) {
+		char *end;
+
+		num_threads = strtoul(threads, &end, 10);
+		if (*threads == '\0' || *end != '\0' || num_threads == 0)
+			usage(argv[0]);
 	}
 
-	input_file = fopen(argv[1], "r");
+	if (affinity != NULL && parse_affinity(affinity, &policy) < 0)
+		usage(argv[0]);
+	set_threadpool_affinity(policy);
+
+	if (order_name != NULL && os_order_parse(order_name, &order) < 0)
+		usage(argv[0]);
+
+	// Workers only inherit counters opened before they start
+	os_perf_init(&perf);
+	if (getenv("OS_GRAPH_STATS") != NULL && os_perf_open(&perf) < 0)
+		log_info("Cache counters unavailable");
+
+	// One pool serves the load and every traversal after it
+	tp = create_threadpool_mode(num_threads, OS_TP_WORK_STEALING);
+
+	input_file = fopen(argv[optind], "r");
 	DIE(input_file == NULL, "fopen");
 
-	graph = create_graph_from_file(input_file);
+	graph = create_graph_from_file_parallel(input_file, tp);
+	DIE(graph == NULL, "create_graph_from_file_parallel");
 
-	// Synchronization mechanisms initialization
-	pthread_mutex_init(&visited_mutex, NULL);
-	atomic_store(&sum, 0);
+	graph = os_graph_reorder(graph, order);
 
-	tp = create_threadpool(NUM_THREADS);
+	if (starts != NULL) {
+		start_nodes = parse_start_nodes(graph, starts, &num_start_nodes);
+		if (start_nodes == NULL)
+			exit(EXIT_FAILURE);
+	} else {
+		start_nodes = malloc(sizeof(*start_nodes));
+		DIE(start_nodes == NULL, "malloc");
+		start_nodes[0] = os_graph_node_of(graph, STARTING_NODE);
+		num_start_nodes = 1;
+	}
 
-	// Create the first task
-	void *starting_node = get_uint(STARTING_NODE);
+	if (getenv("OS_GRAPH_STATS") != NULL) {
+		print_load_stats(graph);
+		log_info("SIMD kernels: %s", os_simd_name(os_simd_level()));
+	}
 
-	graph->visited[STARTING_NODE] = PROCESSING;
-	os_task_t *first_task = create_task(&parallel_process_node, starting_node, &destory_uint);
+	os_perf_start(&perf);
 
-	enqueue_task(tp, first_task);
+	if (strcmp(engine, "cc") == 0) {
+		run_cc(output, updates);
+		goto out;
+	}
 
-	wait_for_completion(tp);
-	destroy_threadpool(tp);
+	if (strcmp(engine, "pagerank") == 0) {
+		run_pagerank(output, &pr);
+		goto out;
+	}
+
+	if (use_bitset)
+		os_graph_use_visited_bitset(graph);
+
+	if (graph->num_nodes != 0)
+		hub_degree = HUB_DEGREE_FACTOR * (2ULL * graph->num_edges / graph->num_nodes);
+	if (hub_degree == 0)
+		hub_degree = 1;
+
+	// Every delta of a sweep is timed on its own, the last run reports
+	for (unsigned int d = 0; d < num_deltas; d++) {
+		unsigned long long delta = deltas != NULL ? deltas[d] : 0;
+		double elapsed;
+
+		start = os_time_seconds();
+		for (unsigned int i = 0; i < num_runs; i++) {
+			int last = (i == num_runs - 1 && d == num_deltas - 1);
+
+			if (strcmp(engine, "bfs") == 0) {
+				sum = run_bfs(output, last);
+			} else if (strcmp(engine, "sssp") == 0) {
+				sum = run_sssp(output, last, delta);
+			} else {
+				if (i != 0 || d != 0)
+					os_graph_reset_visited(graph);
+				sum = run_flood(last);
+			}
+		}
+		elapsed = os_time_seconds() - start;
+
+		if (num_deltas > 1)
+			log_info("delta %llu: %.3f ms per run, %u buckets in %u phases, %llu relaxations",
+				delta, elapsed * 1e3 / num_runs, sssp_stats.num_buckets,
+				sssp_stats.num_phases, sssp_stats.relaxations);
+		else if (num_runs > 1 && getenv("OS_GRAPH_STATS") != NULL)
+			log_info("%u traversals in %.3f ms (%.0f per second, %.2f ns per edge)",
+				num_runs, elapsed * 1e3, elapsed > 0 ? num_runs / elapsed : 0.0,
+				graph->num_edges ? elapsed * 1e9 / num_runs / (2.0 * graph->num_edges) :
+				0.0);
+	}
 
-	// Synchronization mechanisms destruction
-	pthread_mutex_destroy(&visited_mutex);
+	printf("%lld", sum);
 
-	printf("%d", sum);
+out:
+	os_perf_stop(&perf);
+	if (getenv("OS_GRAPH_STATS") != NULL) {
+		os_idle_stats_t idle;
+
+		threadpool_get_idle_stats(tp, &idle);
+		log_info("Idle workers: %llu parks, %llu woken by %llu futex wakes, "
+			"wake latency %.1f us average, %.1f us max",
+			idle.parks, idle.wakeups, idle.futex_wakes,
+			idle.wakeups ? idle.wake_latency_ns / 1e3 / idle.wakeups : 0.0,
+			idle.max_wake_latency_ns / 1e3);
+	}
+
+	destroy_threadpool(tp);
+
+	if (os_perf_read(&perf, count) == 0)
+		log_info("Traversal: %llu cache misses out of %llu references (%.2f%%)",
+			count[OS_PERF_CACHE_MISSES], count[OS_PERF_CACHE_REFERENCES],
+			count[OS_PERF_CACHE_REFERENCES] ? 100.0 * count[OS_PERF_CACHE_MISSES] /
+			count[OS_PERF_CACHE_REFERENCES] : 0.0);
+	os_perf_close(&perf);
+	free(deltas);
+	free(start_nodes);
+	destroy_graph(graph);
+	fclose(input_file);
 
 	return 0;
 }
 
-static void *get_uint(unsigned int integer)
+/*
+ * Root task of a flood: claim the start nodes and queue them from inside
+ * the pool, which skips the shared queue.
+ */
+static void seed_start_nodes(void *unused)
 {
-	unsigned int *heap_uint = malloc(sizeof(unsigned int));
+	node_batch_t *batch = NULL;
+
+	(void)unused;
 
-	DIE(!heap_uint, "malloc failed\n");
+	for (unsigned int i = 0; i < num_start_nodes; i++) {
+		unsigned int idx = start_nodes[i];
 
-	*heap_uint = integer;
+		if (!os_graph_try_visit(graph, idx))
+			continue;
+
+		if (batch_size == 0) {
+			enqueue_node_task(create_task_inline(&parallel_process_node, &idx,
+						sizeof(idx)), idx);
+			continue;
+		}
+
+		if (batch == NULL)
+			batch = create_batch();
+		batch->ids[batch->count++] = idx;
+		if (batch->count == batch_size) {
+			enqueue_node_task(create_task(&parallel_process_batch, batch,
+						&destroy_batch), batch->ids[0]);
+			batch = NULL;
+		}
+	}
 
-	return (void *)heap_uint;
+	if (batch != NULL)
+		enqueue_node_task(create_task(&parallel_process_batch, batch, &destroy_batch),
+				batch->ids[0]);
 }
 
-static void destory_uint(void *heap_uint)
+/*
+ * Queue a task processing idx, first of its nodes. With -p, tasks of hubs
+ * get a higher priority, since they uncover the most work, and every task
+ * prefers the worker owning its node range.
+ */
+static void enqueue_node_task(os_task_t *t, unsigned int idx)
 {
-	free(heap_uint);
+	if (use_hints) {
+		if (os_graph_degree(graph, idx) >= hub_degree)
+			set_task_priority(t, OS_TASK_PRIO_HIGH);
+		set_task_locality(t, tp, idx, graph->num_nodes);
+	}
+
+	enqueue_task(tp, t);
 }
 
-static void parallel_process_node(void *heap_uint)
+/*
+ * Claim the unvisited nodes among ids[0 .. count), count being at most
+ * CLAIM_BLOCK, and store them in claimed. Return how many there are. The
+ * visit states of the whole block are gathered and checked at once first,
+ * so that nodes visited already never cost a CAS nor a branch each.
+ */
+static unsigned int claim_nodes(const unsigned int *ids, unsigned int count,
+		unsigned int *claimed)
 {
-	unsigned int idx = *(unsigned int *)heap_uint;
+	unsigned int n, k = 0;
+
+	if (graph->visited != NULL) {
+		n = os_simd_filter_unvisited(os_graph_visit_states(graph), ids, count, claimed);
+	} else {
+		memcpy(claimed, ids, count * sizeof(*ids));
+		n = count;
+	}
 
-	atomic_fetch_add(&sum, graph->nodes[idx]->info);
+	for (unsigned int i = 0; i < n; i++)
+		if (os_graph_try_visit(graph, claimed[i]))
+			claimed[k++] = claimed[i];
+
+	return k;
+}
+
+static void parallel_process_node(void *idx_arg)
+{
+	unsigned int idx = *(unsigned int *)idx_arg;
+	unsigned int *neighbours = os_graph_neighbours(graph, idx);
+	unsigned int degree = os_graph_degree(graph, idx);
+	unsigned int claimed[CLAIM_BLOCK];
+
+	threadpool_reduce_value(tp, os_graph_info(graph, idx));
 
 	// Go through the neighbours, and if they aren't visited, create new tasks
 	// for them
-	for (unsigned int i = 0; i < graph->nodes[idx]->num_neighbours; i++) {
-		unsigned int arg = graph->nodes[idx]->neighbours[i];
+	for (unsigned int off = 0; off < degree; off += CLAIM_BLOCK) {
+		unsigned int count = degree - off < CLAIM_BLOCK ? degree - off : CLAIM_BLOCK;
+		unsigned int n = claim_nodes(neighbours + off, count, claimed);
 
-		pthread_mutex_lock(&tp->list_mutex);
-		if (graph->visited[arg] != NOT_VISITED) {
-			pthread_mutex_unlock(&tp->list_mutex);
-			continue;
-		}
-		graph->visited[arg] = PROCESSING;
-		pthread_mutex_unlock(&tp->list_mutex);
+		for (unsigned int i = 0; i < n; i++)
+			enqueue_node_task(create_task_inline(&parallel_process_node, &claimed[i],
+						sizeof(claimed[i])), claimed[i]);
+	}
 
-		void *heap_idx = get_uint(arg);
+	os_graph_mark_done(graph, idx);
+}
 
-		os_task_t *new_task = create_task(&parallel_process_node, heap_idx, &destory_uint);
+static node_batch_t *create_batch(void)
+{
+	node_batch_t *batch = malloc(sizeof(*batch) + batch_size * sizeof(batch->ids[0]));
 
-		enqueue_task(tp, new_task);
-	}
+	DIE(batch == NULL, "malloc");
+
+	batch->count = 0;
 
-	// Mark the node as DONE
-	pthread_mutex_lock(&tp->list_mutex);
-	graph->visited[idx] = DONE;
-	pthread_mutex_unlock(&tp->list_mutex);
+	return batch;
+}
+
+static void destroy_batch(void *batch)
+{
+	free(batch);
 }
 
+/*
+ * Process a slice of claimed nodes. Newly discovered nodes are gathered in a
+ * local batch that becomes a single new task whenever it fills up, instead
+ * of one allocation and one enqueue per node.
+ */
+static void parallel_process_batch(void *arg)
+{
+	node_batch_t *batch = arg;
+	node_batch_t *next = create_batch();
+	unsigned int claimed[CLAIM_BLOCK];
+	os_reduction_t local;
+
+	os_reduction_init(&local);
+	os_simd_reduce_info(&local, graph->info, batch->ids, batch->count);
+
+	for (unsigned int k = 0; k < batch->count; k++) {
+		unsigned int idx = batch->ids[k];
+		unsigned int *neighbours = os_graph_neighbours(graph, idx);
+		unsigned int degree = os_graph_degree(graph, idx);
+
+		for (unsigned int off = 0; off < degree; off += CLAIM_BLOCK) {
+			unsigned int count = degree - off < CLAIM_BLOCK ? degree - off : CLAIM_BLOCK;
+			unsigned int n = claim_nodes(neighbours + off, count, claimed);
+
+			for (unsigned int i = 0; i < n; i++) {
+				next->ids[next->count++] = claimed[i];
+				if (next->count == batch_size) {
+					enqueue_node_task(create_task(&parallel_process_batch, next,
+								&destroy_batch), next->ids[0]);
+					next = create_batch();
+				}
+			}
+		}
+
+		os_graph_mark_done(graph, idx);
+	}
+
+	if (next->count != 0)
+		enqueue_node_task(create_task(&parallel_process_batch, next, &destroy_batch),
+				next->ids[0]);
+	else
+		destroy_batch(next);
 
+	threadpool_reduce(tp, &local);
+}
@@ -2,44 +2,487 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "os_dyncc.h"
 #include "os_graph.h"
+#include "os_pagerank.h"
+#include "os_perf.h"
+#include "os_reduce.h"
+#include "os_reorder.h"
+#include "os_time.h"
 #include "log/log.h"
 #include "utils.h"
 
-static int sum;
+/* Flood nodes ahead of the current one whose data is prefetched. */
+#define PREFETCH_DISTANCE	8
+#define FLOOD_BUF_INITIAL	4096
+
+static os_reduction_t reduction;
 static os_graph_t *graph;
 
-static void process_node(unsigned int idx)
+/*
+ * Nodes of the flood seen but not processed yet: a stack for DFS, a FIFO
+ * for BFS. Nodes are marked when they go in, so each goes in at most once
+ * per run and the FIFO never needs to wrap. Grown on demand and kept
+ * across start nodes and runs.
+ */
+static unsigned int *flood_buf;
+static size_t flood_capacity;
+
+/* Entry of the Dijkstra heap, stale once the node got a shorter distance. */
+typedef struct heap_entry {
+	unsigned long long dist;
+	unsigned int node;
+} heap_entry_t;
+
+static void flood_push(size_t *tail, unsigned int idx)
+{
+	if (*tail == flood_capacity) {
+		flood_capacity = flood_capacity ? 2 * flood_capacity : FLOOD_BUF_INITIAL;
+		flood_buf = realloc(flood_buf, flood_capacity * sizeof(*flood_buf));
+		DIE(flood_buf == NULL, "realloc");
+	}
+
+	os_graph_mark_done(graph, idx);
+	flood_buf[(*tail)++] = idx;
+}
+
+/*
+ * Add up the values of the nodes reachable from root, none of which may be
+ * visited yet, depth first or breadth first. The next nodes to process are
+ * known in advance: the head of the FIFO, or for DFS the neighbours just
+ * pushed. Their value and offsets are prefetched then, their neighbour
+ * lists one step later, and the visit state of each neighbour a few
+ * neighbours ahead of the scan.
+ */
+static void flood(unsigned int root, int bfs)
+{
+	size_t head = 0, tail = 0;
+
+	flood_push(&tail, root);
+
+	while (head != tail) {
+		unsigned int idx, degree, *neighbours;
+
+		if (bfs) {
+			idx = flood_buf[head++];
+			if (tail - head > 2 * PREFETCH_DISTANCE) {
+				unsigned int next = flood_buf[head + 2 * PREFETCH_DISTANCE];
+
+				__builtin_prefetch(&graph->info[next]);
+				__builtin_prefetch(&graph->offsets[next]);
+			}
+			if (tail - head > PREFETCH_DISTANCE)
+				__builtin_prefetch(os_graph_neighbours(graph,
+						flood_buf[head + PREFETCH_DISTANCE]));
+		} else {
+			idx = flood_buf[--tail];
+			if (tail != 0)
+				__builtin_prefetch(os_graph_neighbours(graph, flood_buf[tail - 1]));
+		}
+
+		neighbours = os_graph_neighbours(graph, idx);
+		degree = os_graph_degree(graph, idx);
+		os_reduction_add(&reduction, os_graph_info(graph, idx));
+
+		for (unsigned int i = 0; i < degree; i++) {
+			unsigned int v = neighbours[i];
+
+			if (i + PREFETCH_DISTANCE < degree)
+				__builtin_prefetch(&graph->visited[neighbours[i + PREFETCH_DISTANCE]]);
+			if (os_graph_is_visited(graph, v))
+				continue;
+
+			if (!bfs) {
+				__builtin_prefetch(&graph->info[v]);
+				__builtin_prefetch(&graph->offsets[v]);
+			}
+			flood_push(&tail, v);
+		}
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-e engine] [-o output] [-s nodes] [-n runs] [-i iterations]\n"
+		"       [-r tolerance] [-R order] [-u updates] input_file\n", name);
+	fprintf(stderr, "  -e  flood (default, depth first), bfs (same sum, breadth first), cc,\n"
+		"      sssp or pagerank, the references for the parallel engines of the\n"
+		"      same name\n");
+	fprintf(stderr, "  -o  write \"node component sum\" / \"node rank\" lines instead of\n"
+		"      stdout (cc and pagerank) or \"node distance\" lines to output (sssp)\n");
+	fprintf(stderr, "  -i  maximum PageRank iterations (default %d)\n",
+		OS_PAGERANK_MAX_ITERATIONS);
+	fprintf(stderr, "  -r  PageRank convergence threshold (default %g)\n",
+		OS_PAGERANK_TOLERANCE);
+	fprintf(stderr, "  -s  comma separated start nodes, or $OS_START_NODES (default 0)\n");
+	fprintf(stderr, "  -n  repeat the traversal (flood and bfs only)\n");
+	fprintf(stderr, "  -R  relabel nodes after loading: none (default), degree, rcm or bfs,\n"
+		"      or $OS_GRAPH_ORDER\n");
+	fprintf(stderr, "  -u  apply the edge and value updates of a file after the components\n"
+		"      are found and print its queries' sums; -o then gets the final\n"
+		"      components (cc only)\n");
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Label components with an explicit-stack DFS started from every unlabelled
+ * node in increasing order, so each component is named after its smallest
+ * node.
+ */
+static void run_cc(const char *output, const char *updates)
 {
-	os_node_t *node;
+	unsigned int num_nodes = graph->num_nodes;
+	unsigned int *comp, *stack;
+	long long *sums;
+	size_t top;
+	FILE *file = stdout;
 
-	node = graph->nodes[idx];
-	sum += node->info;
-	graph->visited[idx] = DONE;
+	comp = malloc(num_nodes * sizeof(*comp));
+	stack = malloc(num_nodes * sizeof(*stack));
+	sums = calloc(num_nodes + 1, sizeof(*sums));
+	DIE((comp == NULL || stack == NULL) && num_nodes != 0, "malloc");
+	DIE(sums == NULL, "calloc");
+	memset(comp, 0xff, num_nodes * sizeof(*comp));
 
-	for (unsigned int i = 0; i < node->num_neighbours; i++)
-		if (graph->visited[node->neighbours[i]] == NOT_VISITED)
-			process_node(node->neighbours[i]);
+	for (unsigned int root = 0; root < num_nodes; root++) {
+		if (comp[root] != (unsigned int)-1)
+			continue;
+
+		comp[root] = root;
+		stack[0] = root;
+		top = 1;
+		while (top != 0) {
+			unsigned int idx = stack[--top];
+			unsigned int *neighbours = os_graph_neighbours(graph, idx);
+			unsigned int degree = os_graph_degree(graph, idx);
+
+			sums[root] += os_graph_info(graph, idx);
+			for (unsigned int i = 0; i < degree; i++) {
+				if (comp[neighbours[i]] != (unsigned int)-1)
+					continue;
+				comp[neighbours[i]] = root;
+				stack[top++] = neighbours[i];
+			}
+		}
+	}
+
+	if (updates != NULL) {
+		if (os_dyncc_run_file(graph, comp, updates, output) < 0)
+			exit(EXIT_FAILURE);
+	} else {
+		if (output != NULL) {
+			file = fopen(output, "w");
+			DIE(file == NULL, "fopen");
+		}
+		DIE(write_graph_components(graph, comp, sums, file) < 0, "fprintf");
+		if (output != NULL)
+			DIE(fclose(file) != 0, "fclose");
+	}
+
+	free(comp);
+	free(stack);
+	free(sums);
+}
+
+static void heap_push(heap_entry_t **heap, size_t *size, size_t *capacity,
+		unsigned long long dist, unsigned int node)
+{
+	heap_entry_t *h;
+	size_t i;
+
+	if (*size == *capacity) {
+		*capacity = *capacity ? 2 * *capacity : 1024;
+		*heap = realloc(*heap, *capacity * sizeof(**heap));
+		DIE(*heap == NULL, "realloc");
+	}
+
+	h = *heap;
+	for (i = (*size)++; i > 0 && h[(i - 1) / 2].dist > dist; i = (i - 1) / 2)
+		h[i] = h[(i - 1) / 2];
+	h[i].dist = dist;
+	h[i].node = node;
+}
+
+static heap_entry_t heap_pop(heap_entry_t *h, size_t *size)
+{
+	heap_entry_t top = h[0], last = h[--(*size)];
+	size_t i = 0;
+
+	while (2 * i + 1 < *size) {
+		size_t c = 2 * i + 1;
+
+		if (c + 1 < *size && h[c + 1].dist < h[c].dist)
+			c++;
+		if (h[c].dist >= last.dist)
+			break;
+		h[i] = h[c];
+		i = c;
+	}
+	h[i] = last;
+
+	return top;
+}
+
+/*
+ * Dijkstra with a binary heap and lazy deletion, the reference for the
+ * parallel delta-stepping engine. Unweighted edges weigh 1.
+ */
+static void run_sssp(const unsigned int *roots, unsigned int num_roots, const char *output)
+{
+	unsigned long long *dist;
+	heap_entry_t *heap = NULL;
+	size_t size = 0, capacity = 0;
+	unsigned int num_reached = 0;
+	long long sum = 0;
+	FILE *file;
+
+	dist = malloc(graph->num_nodes * sizeof(*dist));
+	DIE(dist == NULL && graph->num_nodes != 0, "malloc");
+	for (unsigned int i = 0; i < graph->num_nodes; i++)
+		dist[i] = OS_GRAPH_DIST_INF;
+
+	for (unsigned int i = 0; i < num_roots; i++) {
+		if (roots[i] >= graph->num_nodes || dist[roots[i]] == 0)
+			continue;
+		dist[roots[i]] = 0;
+		heap_push(&heap, &size, &capacity, 0, roots[i]);
+	}
+
+	while (size != 0) {
+		heap_entry_t e = heap_pop(heap, &size);
+		unsigned int *neighbours = os_graph_neighbours(graph, e.node);
+		unsigned int *weights = os_graph_weights(graph, e.node);
+		unsigned int degree = os_graph_degree(graph, e.node);
+
+		if (e.dist != dist[e.node])
+			continue;
+
+		num_reached++;
+		sum += os_graph_info(graph, e.node);
+		for (unsigned int i = 0; i < degree; i++) {
+			unsigned int v = neighbours[i];
+			unsigned long long nd = e.dist + (weights != NULL ? weights[i] : 1);
+
+			if (nd < dist[v]) {
+				dist[v] = nd;
+				heap_push(&heap, &size, &capacity, nd, v);
+			}
+		}
+	}
+
+	if (getenv("OS_GRAPH_STATS") != NULL)
+		log_info("Dijkstra reached %u nodes", num_reached);
+
+	if (output != NULL) {
+		file = fopen(output, "w");
+		DIE(file == NULL, "fopen");
+		DIE(write_graph_distances(graph, dist, file) < 0, "fprintf");
+		DIE(fclose(file) != 0, "fclose");
+	}
+
+	printf("%lld", sum);
+
+	free(heap);
+	free(dist);
+}
+
+/*
+ * Same blocks, in the same order, as the parallel engine, so both come up
+ * with the very same ranks.
+ */
+static void run_pagerank(const os_pagerank_params_t *params, const char *output)
+{
+	unsigned int n = graph->num_nodes;
+	os_pagerank_state_t st;
+	double dangling, error = 0;
+	unsigned int it;
+	FILE *file = stdout;
+
+	dangling = os_pagerank_init(graph, &st, params->damping);
+
+	for (it = 0; it < params->max_iterations && n != 0; ) {
+		double block_dangling;
+
+		os_pagerank_set_base(&st, n, dangling);
+		error = 0;
+		dangling = 0;
+		for (unsigned int first = 0; first < n; first += OS_PAGERANK_BLOCK) {
+			unsigned int last = n - first > OS_PAGERANK_BLOCK ?
+				first + OS_PAGERANK_BLOCK : n;
+
+			error += os_pagerank_block(graph, &st, first, last, &block_dangling);
+			dangling += block_dangling;
+		}
+		st.cur ^= 1;
+		it++;
+
+		if (error < params->tolerance)
+			break;
+	}
+
+	if (getenv("OS_GRAPH_STATS") != NULL)
+		log_info("PageRank: %u iterations, L1 change %g", it, error);
+
+	if (output != NULL) {
+		file = fopen(output, "w");
+		DIE(file == NULL, "fopen");
+	}
+	DIE(write_graph_ranks(graph, st.rank[st.cur], file) < 0, "fprintf");
+	if (output != NULL)
+		DIE(fclose(file) != 0, "fclose");
+
+	for (unsigned int i = 0; i < 2; i++) {
+		free(st.rank[i]);
+		free(st.contrib[i]);
+	}
 }
 
 int main(int argc, char *argv[])
 {
 	FILE *input_file;
+	const char *engine = "flood";
+	const char *output = NULL;
+	const char *updates = NULL;
+	const char *starts = getenv("OS_START_NODES");
+	const char *order_name = getenv("OS_GRAPH_ORDER");
+	os_order_t order = OS_ORDER_NONE;
+	os_perf_t perf;
+	unsigned long long count[OS_PERF_NUM_COUNTERS];
+	unsigned int *start_nodes = NULL;
+	unsigned int num_start_nodes = 1;
+	unsigned int num_runs = 1;
+	os_pagerank_params_t pr = {
+		.damping = OS_PAGERANK_DAMPING,
+		.tolerance = OS_PAGERANK_TOLERANCE,
+		.max_iterations = OS_PAGERANK_MAX_ITERATIONS,
+	};
+	int opt;
 
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s input_file\n", argv[0]);
-		exit(EXIT_FAILURE);
+	while ((opt = getopt(argc, argv, "e:i:n:o:r:R:s:u:")) != -1) {
+		switch (opt) {
+		case 'e':
+			engine = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 's':
+			starts = optarg;
+			break;
+		case 'n':
+			num_runs = strtoul(optarg, NULL, 0);
+			if (num_runs == 0)
+				usage(argv[0]);
+			break;
+		case 'i':
+			pr.max_iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			pr.tolerance = strtod(optarg, NULL);
+			break;
+		case 'R':
+			order_name = optarg;
+			break;
+		case 'u':
+			updates = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
 	}
 
-	input_file = fopen(argv[1], "r");
+	if (strcmp(engine, "flood") != 0 && strcmp(engine, "bfs") != 0 &&
+			strcmp(engine, "cc") != 0 &&
+			strcmp(engine, "sssp") != 0 && strcmp(engine, "pagerank") != 0)
+		usage(argv[0]);
+
+	if (updates != NULL && strcmp(engine, "cc") != 0)
+		usage(argv[0]);
+
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	if (order_name != NULL && os_order_parse(order_name, &order) < 0)
+		usage(argv[0]);
+
+	os_perf_init(&perf);
+	if (getenv("OS_GRAPH_STATS") != NULL && os_perf_open(&perf) < 0)
+		log_info("Cache counters unavailable");
+
+	input_file = fopen(argv[optind], "r");
 	DIE(input_file == NULL, "fopen");
 
 	graph = create_graph_from_file(input_file);
+	DIE(graph == NULL, "create_graph_from_file");
+
+	graph = os_graph_reorder(graph, order);
+
+	if (getenv("OS_GRAPH_STATS") != NULL)
+		print_load_stats(graph);
+
+	if (starts != NULL) {
+		start_nodes = parse_start_nodes(graph, starts, &num_start_nodes);
+		if (start_nodes == NULL)
+			exit(EXIT_FAILURE);
+	}
+
+	os_perf_start(&perf);
+
+	if (strcmp(engine, "cc") == 0) {
+		run_cc(output, updates);
+	} else if (strcmp(engine, "pagerank") == 0) {
+		run_pagerank(&pr, output);
+	} else if (strcmp(engine, "sssp") == 0) {
+		unsigned int root = os_graph_node_of(graph, 0);
+
+		run_sssp(start_nodes != NULL ? start_nodes : &root, num_start_nodes, output);
+	} else {
+		int bfs = strcmp(engine, "bfs") == 0;
+		double start = os_time_seconds(), elapsed;
+
+		for (unsigned int run = 0; run < num_runs; run++) {
+			if (run != 0)
+				os_graph_reset_visited(graph);
+			os_reduction_init(&reduction);
+			for (unsigned int i = 0; i < num_start_nodes; i++) {
+				unsigned int idx = start_nodes != NULL ? start_nodes[i] :
+					os_graph_node_of(graph, 0);
+
+				if (!os_graph_is_visited(graph, idx))
+					flood(idx, bfs);
+			}
+		}
+		elapsed = os_time_seconds() - start;
+
+		if (num_runs > 1 && getenv("OS_GRAPH_STATS") != NULL)
+			log_info("%u traversals in %.3f ms (%.0f per second, %.2f ns per edge)",
+				num_runs, elapsed * 1e3, elapsed > 0 ? num_runs / elapsed : 0.0,
+				graph->num_edges ? elapsed * 1e9 / num_runs / (2.0 * graph->num_edges) :
+				0.0);
+
+		if (getenv("OS_GRAPH_STATS") != NULL)
+			log_info("Reduced %llu nodes: sum %lld, min %lld, max %lld",
+				reduction.count, reduction.sum, reduction.min, reduction.max);
+
+		printf("%lld", reduction.sum);
+	}
+
+	os_perf_stop(&perf);
+	if (os_perf_read(&perf, count) == 0)
+		log_info("Traversal: %llu cache misses out of %llu references (%.2f%%)",
+			count[OS_PERF_CACHE_MISSES], count[OS_PERF_CACHE_REFERENCES],
+			count[OS_PERF_CACHE_REFERENCES] ? 100.0 * count[OS_PERF_CACHE_MISSES] /
+			count[OS_PERF_CACHE_REFERENCES] : 0.0);
+	os_perf_close(&perf);
 
-	process_node(0);
+	free(start_nodes);
+	free(flood_buf);
 
-	printf("%d", sum);
+	destroy_graph(graph);
+	fclose(input_file);
 
 	return 0;
 }
@@ -0,0 +1,244 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Check every SIMD level the CPU supports against the scalar kernels.
+ *
+ * Random blocks of 0 to MAX_BLOCK ids are filtered and reduced at each
+ * level and must give exactly what OS_SIMD_SCALAR gives, with nothing
+ * written past the end of out. Ids are drawn from a window at the start
+ * of the id space and, in some blocks, from windows around INT_MAX and
+ * UINT_MAX, which the SIMD kernels have to leave to the scalar code. The
+ * state and info arrays span all 2^32 ids, mapped without reserving
+ * memory so only the pages around the windows are ever backed; if that
+ * mapping fails, only the first window is used.
+ */
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "os_simd.h"
+#include "log/log.h"
+#include "utils.h"
+
+#define DEFAULT_ROUNDS	20000
+#define MAX_BLOCK	300
+#define WINDOW		4096
+/* Slack after out, which no kernel may write to. */
+#define GUARD		32
+#define GUARD_VALUE	0xdeadbeefu
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+/* splitmix64 */
+static uint64_t rng(void)
+{
+	uint64_t z = (rng_state += 0x9e3779b97f4a7c15ull);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+static unsigned int rng_below(unsigned int n)
+{
+	return rng() % n;
+}
+
+/* First id of every window; only the first one without the big mapping. */
+static const unsigned int window_base[] = {
+	0,
+	INT_MAX - WINDOW / 2,
+	UINT_MAX - WINDOW + 1,
+};
+
+static unsigned int num_windows;
+static int *state, *info;
+static size_t array_size;
+
+static void map_arrays(void)
+{
+	array_size = ((size_t)UINT_MAX + 1) * sizeof(int);
+	state = mmap(NULL, array_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	info = mmap(NULL, array_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (state != MAP_FAILED && info != MAP_FAILED) {
+		num_windows = sizeof(window_base) / sizeof(window_base[0]);
+		return;
+	}
+
+	if (state != MAP_FAILED)
+		munmap(state, array_size);
+	if (info != MAP_FAILED)
+		munmap(info, array_size);
+	log_info("Can't map 2^32 ids, skipping ids above %u", WINDOW - 1);
+
+	array_size = WINDOW * sizeof(int);
+	state = calloc(WINDOW, sizeof(int));
+	info = calloc(WINDOW, sizeof(int));
+	DIE(state == NULL || info == NULL, "calloc");
+	num_windows = 1;
+}
+
+static void unmap_arrays(void)
+{
+	if (num_windows == 1) {
+		free(state);
+		free(info);
+	} else {
+		munmap(state, array_size);
+		munmap(info, array_size);
+	}
+}
+
+/* A value that is often one of the extremes the reductions must carry. */
+static int random_value(void)
+{
+	static const int edges[] = { INT_MIN, INT_MIN + 1, -1, 0, 1, INT_MAX - 1, INT_MAX };
+
+	if (rng_below(2) == 0)
+		return edges[rng_below(sizeof(edges) / sizeof(edges[0]))];
+	return (int)(uint32_t)rng();
+}
+
+/* New states, NOT_VISITED with probability density / 100, and values. */
+static void fill_windows(unsigned int density)
+{
+	for (unsigned int w = 0; w < num_windows; w++) {
+		for (unsigned int k = 0; k < WINDOW; k++) {
+			unsigned int id = window_base[w] + k;
+
+			state[id] = rng_below(100) < density ? 0 : 1 + rng_below(2);
+			info[id] = random_value();
+		}
+	}
+}
+
+/*
+ * count ids from the first window, or if mixed, one in 16 from the others,
+ * so that vectors with and without large ids both come up.
+ */
+static void fill_ids(unsigned int *ids, unsigned int count, int mixed)
+{
+	for (unsigned int i = 0; i < count; i++) {
+		unsigned int w = 0;
+
+		if (mixed && rng_below(16) == 0)
+			w = 1 + rng_below(num_windows - 1);
+
+		ids[i] = window_base[w] + rng_below(WINDOW);
+	}
+}
+
+static void fail(const char *what, os_simd_level_t level, unsigned int round,
+		unsigned int count)
+{
+	log_error("%s differs at level %s, round %u, %u ids", what,
+			os_simd_name(level), round, count);
+	exit(EXIT_FAILURE);
+}
+
+static unsigned int filter(os_simd_level_t level, const unsigned int *ids,
+		unsigned int count, unsigned int *out)
+{
+	DIE(os_simd_set_level(level) < 0, "os_simd_set_level");
+	return os_simd_filter_unvisited(state, ids, count, out);
+}
+
+static void reduce(os_simd_level_t level, os_reduction_t *r, const unsigned int *ids,
+		unsigned int count)
+{
+	DIE(os_simd_set_level(level) < 0, "os_simd_set_level");
+	os_simd_reduce_info(r, info, ids, count);
+}
+
+static int same_reduction(const os_reduction_t *a, const os_reduction_t *b)
+{
+	return a->sum == b->sum && a->min == b->min && a->max == b->max &&
+		a->count == b->count;
+}
+
+/* Check level against the scalar kernels on one block, filter and reduce. */
+static void check_block(os_simd_level_t level, unsigned int round,
+		const unsigned int *ids, unsigned int count,
+		const unsigned int *expected, unsigned int num_expected,
+		const os_reduction_t *expected_r, const os_reduction_t *start)
+{
+	unsigned int out[MAX_BLOCK + GUARD], copy[MAX_BLOCK + GUARD];
+	os_reduction_t r = *start;
+	unsigned int n;
+
+	for (unsigned int i = 0; i < MAX_BLOCK + GUARD; i++)
+		out[i] = GUARD_VALUE;
+	n = filter(level, ids, count, out);
+	if (n != num_expected || memcmp(out, expected, n * sizeof(*out)) != 0)
+		fail("filter", level, round, count);
+	for (unsigned int i = count; i < MAX_BLOCK + GUARD; i++)
+		if (out[i] != GUARD_VALUE)
+			fail("filter guard", level, round, count);
+
+	/* In place, as claim_nodes() does it. */
+	memcpy(copy, ids, count * sizeof(*ids));
+	for (unsigned int i = count; i < MAX_BLOCK + GUARD; i++)
+		copy[i] = GUARD_VALUE;
+	n = filter(level, copy, count, copy);
+	if (n != num_expected || memcmp(copy, expected, n * sizeof(*copy)) != 0)
+		fail("in-place filter", level, round, count);
+	for (unsigned int i = count; i < MAX_BLOCK + GUARD; i++)
+		if (copy[i] != GUARD_VALUE)
+			fail("in-place filter guard", level, round, count);
+
+	reduce(level, &r, ids, count);
+	if (!same_reduction(&r, expected_r))
+		fail("reduce", level, round, count);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int rounds = argc > 1 ? strtoul(argv[1], NULL, 0) : DEFAULT_ROUNDS;
+	os_simd_level_t levels[OS_SIMD_AVX512 + 1];
+	unsigned int num_levels = 0, mixed_rounds = 0;
+
+	for (os_simd_level_t level = OS_SIMD_SCALAR; level <= OS_SIMD_AVX512; level++)
+		if (os_simd_set_level(level) == 0)
+			levels[num_levels++] = level;
+
+	map_arrays();
+
+	for (unsigned int round = 0; round < rounds; round++) {
+		unsigned int ids[MAX_BLOCK], expected[MAX_BLOCK];
+		unsigned int count = rng_below(MAX_BLOCK + 1), num_expected;
+		int mixed = num_windows > 1 && rng_below(2) == 0;
+		os_reduction_t start, expected_r;
+
+		if (round % 64 == 0)
+			fill_windows(rng_below(101));
+		fill_ids(ids, count, mixed);
+		mixed_rounds += mixed;
+
+		/* Merging into a reduction that already holds values, sometimes. */
+		os_reduction_init(&start);
+		if (rng_below(2) == 0)
+			os_reduction_add(&start, random_value());
+
+		num_expected = filter(OS_SIMD_SCALAR, ids, count, expected);
+		expected_r = start;
+		reduce(OS_SIMD_SCALAR, &expected_r, ids, count);
+
+		for (unsigned int l = 0; l < num_levels; l++)
+			check_block(levels[l], round, ids, count, expected, num_expected,
+					&expected_r, &start);
+	}
+
+	printf("%u blocks, %u with ids above INT_MAX, at", rounds, mixed_rounds);
+	for (unsigned int l = 0; l < num_levels; l++)
+		printf(" %s", os_simd_name(levels[l]));
+	printf(": ok\n");
+
+	unmap_arrays();
+	return 0;
+}